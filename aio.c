@@ -0,0 +1,418 @@
+/*
+ * aio.c --	Asynchronous serial transmit engine.
+ *
+ * Everything for the target goes through a queue of buffers which is
+ * written out in the background, so the transfer loop can go on
+ * compressing, hashing and collecting replies while the tty's transmit
+ * queue is kept full.  Large buffers, such as image data, are queued
+ * where they are instead of being copied; the caller keeps them
+ * untouched until the target has replied to them or aio_sync().  Small
+ * ones are copied into a ring first.
+ *
+ * The writes go through io_uring, which completes them in the kernel
+ * while we get on with other things.  If io_uring isn't available we
+ * fall back to non-blocking writes on a second descriptor for the
+ * port, driven by epoll.  Either way there is only ever one write in
+ * flight, so the data can't be reordered.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "aio.h"
+#include "board.h"
+#include "util.h"
+
+#define AIO_QUEUE	256	/* buffers queued, power of 2 */
+#define AIO_MAXIOV	64	/* buffers per write */
+#define AIO_RINGSIZE	0x4000	/* for copied buffers */
+
+struct txq {
+	const char	*base;
+	unsigned	len;
+	unsigned	ring;		/* copy ring bytes to free once written */
+};
+
+static __thread struct txq txq[AIO_QUEUE];
+static __thread unsigned txq_head, txq_tail;	/* free-running */
+static __thread int busy;			/* a write is in flight */
+
+static __thread char ring[AIO_RINGSIZE];
+static __thread unsigned ring_head, ring_tail;	/* free-running */
+
+static __thread int portfd = -1;			/* blocking, for reads */
+static __thread int nbfd = -1;			/* non-blocking, for epoll writes */
+static __thread int epfd = -1;
+static __thread int hangup;
+static __thread int aborting;			/* in aio_abort() */
+
+#ifdef __NR_io_uring_setup
+static __thread int uring = -1;
+static __thread struct iovec uring_iov[AIO_MAXIOV];	/* of the write in flight */
+static __thread unsigned *sq_tail, *sq_mask, *sq_array;
+static __thread unsigned *cq_head, *cq_tail, *cq_mask;
+static __thread struct io_uring_sqe *sqes;
+static __thread struct io_uring_cqe *cqes;
+static __thread void *sq_ring, *cq_ring;
+static __thread size_t sq_size, cq_size, sqes_size;
+
+static int uring_setup(void)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof p);
+	uring = syscall(__NR_io_uring_setup, 4, &p);
+	if (uring < 0)
+		return 0;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+	sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, uring, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		perror_exit("io_uring");
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, uring,
+			       IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+			perror_exit("io_uring");
+	}
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, uring, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		perror_exit("io_uring");
+
+	sq_tail = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+	sq_mask = (unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+	sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+	cq_head = (unsigned *)((char *)cq_ring + p.cq_off.head);
+	cq_tail = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+	cq_mask = (unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+	return 1;
+}
+
+static void uring_submit(int nr_iov)
+{
+	unsigned tail = *sq_tail;
+	unsigned i = tail & *sq_mask;
+	struct io_uring_sqe *sqe = &sqes[i];
+
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = portfd;
+	sqe->addr = (unsigned long)uring_iov;
+	sqe->len = nr_iov;
+	sqe->off = -1;			/* it's a tty: no offset */
+	/* a tty can't write without blocking, so unless we ask for it to
+	   be done by a kernel worker, io_uring_enter() may write it here */
+	sqe->flags = IOSQE_ASYNC;
+	sq_array[i] = i;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (syscall(__NR_io_uring_enter, uring, 1, 0, 0, NULL, 0) < 0)
+		perror_exit("io_uring_enter");
+}
+#endif
+
+static void kick(void);
+
+/* a write failed; when giving up on the port anyway, drop the rest */
+static void write_failed(void)
+{
+	if (!aborting)
+		perror_exit("write");
+	txq_head = txq_tail;
+	ring_head = ring_tail;
+}
+
+/* n bytes from the front of the queue have been written */
+static void advance(unsigned n)
+{
+	struct txq *q;
+
+	while (n > 0) {
+		q = &txq[txq_head % AIO_QUEUE];
+		if (n < q->len) {
+			q->base += n;
+			q->len -= n;
+			return;
+		}
+		n -= q->len;
+		ring_head += q->ring;
+		txq_head++;
+	}
+}
+
+#ifdef __NR_io_uring_setup
+/* pick up finished writes and start the next one */
+static void uring_reap(void)
+{
+	unsigned head = *cq_head;
+	struct io_uring_cqe *cqe;
+
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &cqes[head & *cq_mask];
+		busy = 0;
+		if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+			errno = -cqe->res;
+			write_failed();
+		}
+		if (cqe->res > 0)
+			advance(cqe->res);
+		head++;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	kick();
+}
+#endif
+
+/* start writing whatever is queued, if nothing is in flight */
+static void kick(void)
+{
+	struct iovec iov[AIO_MAXIOV], *v = iov;
+	struct txq *q;
+	unsigned i;
+	ssize_t n;
+	int nr;
+
+#ifdef __NR_io_uring_setup
+	if (uring >= 0)
+		v = uring_iov;
+#endif
+	while (!busy && txq_head != txq_tail) {
+		for (i = txq_head, nr = 0;
+		     i != txq_tail && nr < AIO_MAXIOV; i++, nr++) {
+			q = &txq[i % AIO_QUEUE];
+			v[nr].iov_base = (void *)q->base;
+			v[nr].iov_len = q->len;
+		}
+#ifdef __NR_io_uring_setup
+		if (uring >= 0) {
+			uring_submit(nr);
+			busy = 1;
+			return;
+		}
+#endif
+		n = writev(nbfd, v, nr);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;		/* wait for EPOLLOUT */
+			write_failed();
+			return;
+		}
+		advance(n);
+	}
+}
+
+/*
+ * Wait up to msecs (-1: forever) for something to happen, dealing
+ * with finished writes.  Returns 0 if nothing did.
+ */
+static int aio_wait(int msecs)
+{
+	struct epoll_event ev[2];
+	int i, n;
+
+	/* let the other boards run meanwhile */
+	if (board_multi && msecs) {
+		board_wait(epfd, msecs);
+		msecs = 0;
+	}
+	n = epoll_wait(epfd, ev, 2, msecs);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 1;
+		perror_exit("epoll_wait");
+	}
+	for (i = 0; i < n; i++) {
+		if (ev[i].data.fd == portfd) {
+			if (ev[i].events & (EPOLLHUP | EPOLLERR))
+				hangup = 1;
+		}
+#ifdef __NR_io_uring_setup
+		else if (ev[i].data.fd == uring)
+			uring_reap();
+#endif
+		else
+			kick();
+	}
+	return n;
+}
+
+static void watch(int fd, unsigned events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = events | EPOLLET;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		perror_exit("epoll_ctl");
+}
+
+/* take over writing to fd, which is the port dev */
+void aio_open(int fd, const char *dev)
+{
+	portfd = fd;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		perror_exit("epoll_create1");
+	watch(portfd, EPOLLIN);
+#ifdef __NR_io_uring_setup
+	if (uring_setup()) {
+		watch(uring, EPOLLIN);
+		return;
+	}
+#endif
+	/* its own open file, so O_NONBLOCK doesn't affect portfd */
+	nbfd = open(dev, O_WRONLY | O_NOCTTY | O_NONBLOCK);
+	if (nbfd < 0)
+		perror_exit(dev);
+	watch(nbfd, EPOLLOUT);
+}
+
+void aio_close(void)
+{
+	aio_sync();
+#ifdef __NR_io_uring_setup
+	if (uring >= 0) {
+		munmap(sqes, sqes_size);
+		if (cq_ring != sq_ring)
+			munmap(cq_ring, cq_size);
+		munmap(sq_ring, sq_size);
+		xclose(uring);
+		uring = -1;
+	}
+#endif
+	if (nbfd >= 0) {
+		xclose(nbfd);
+		nbfd = -1;
+	}
+	xclose(epfd);
+	epfd = -1;
+	portfd = -1;
+}
+
+/*
+ * As aio_close(), for a port being given up on: what hasn't been
+ * handed to the kernel yet is thrown away, and only the write in
+ * flight, which may be using those buffers still, is waited for, and
+ * if it fails, so be it.
+ */
+void aio_abort(void)
+{
+	unsigned keep = busy ? AIO_MAXIOV : 0;
+
+	if (txq_tail - txq_head > keep)
+		txq_tail = txq_head + keep;
+	aborting = 1;
+	aio_close();
+	aborting = 0;
+}
+
+/*
+ * Queue len bytes at buf; once written, free copied bytes of the copy
+ * ring.  The entry is complete before kick(), which may write all of
+ * it and retire it right away.
+ */
+static void queue(const void *buf, unsigned len, unsigned copied)
+{
+	struct txq *q;
+
+	while (txq_tail - txq_head == AIO_QUEUE)
+		aio_wait(-1);
+	q = &txq[txq_tail++ % AIO_QUEUE];
+	q->base = buf;
+	q->len = len;
+	q->ring = copied;
+	kick();
+}
+
+/* queue len bytes at buf, which must stay put until written */
+void aio_write(const void *buf, unsigned len)
+{
+	if (len)
+		queue(buf, len, 0);
+}
+
+/* queue a copy of len bytes at buf */
+void aio_copy(const void *buf, unsigned len)
+{
+	unsigned offset, skip;
+
+	if (!len)
+		return;
+	if (len > AIO_RINGSIZE) {
+		fprintf(stderr, "aio_copy: %u bytes won't fit\n", len);
+		exit(1);
+	}
+	/* copies are contiguous; skip the end of the ring if need be */
+	offset = ring_tail % AIO_RINGSIZE;
+	skip = offset + len > AIO_RINGSIZE ? AIO_RINGSIZE - offset : 0;
+	while (AIO_RINGSIZE - (ring_tail - ring_head) < skip + len ||
+	       txq_tail - txq_head == AIO_QUEUE)
+		aio_wait(-1);
+	ring_tail += skip;
+	offset = ring_tail % AIO_RINGSIZE;
+	memcpy(ring + offset, buf, len);
+	ring_tail += len;
+	queue(ring + offset, len, skip + len);
+}
+
+/* wait until everything queued has been written */
+void aio_sync(void)
+{
+	kick();
+	while (txq_head != txq_tail)
+		aio_wait(-1);
+}
+
+/*
+ * Read up to len bytes from the port, keeping the writes going while
+ * we wait up to msecs (-1: forever, 0: don't) for them.  Returns the
+ * number of bytes read, 0 at end of file, -1 on timeout.
+ */
+int aio_read(void *buf, unsigned len, int msecs)
+{
+	struct timeval now, end;
+	int avail;
+
+	gettimeofday(&end, NULL);
+	end.tv_sec += msecs / 1000;
+	end.tv_usec += msecs % 1000 * 1000;
+	while (1) {
+		if (ioctl(portfd, FIONREAD, &avail) < 0)
+			perror_exit("FIONREAD");
+		if (avail > 0 || hangup)
+			return xread(portfd, buf, avail > 0 ? min(len, avail)
+							    : len);
+		if (msecs < 0) {
+			aio_wait(-1);
+			continue;
+		}
+		gettimeofday(&now, NULL);
+		msecs = (end.tv_sec - now.tv_sec) * 1000 +
+			(end.tv_usec - now.tv_usec) / 1000;
+		if (msecs <= 0 || !aio_wait(msecs))
+			return -1;
+	}
+}
@@ -0,0 +1,15 @@
+/*
+ * aio.h --	Asynchronous serial transmit engine.
+ */
+#ifndef _SHOEHORN_AIO_H
+#define _SHOEHORN_AIO_H
+
+extern void aio_open(int fd, const char *dev);
+extern void aio_close(void);
+extern void aio_abort(void);
+extern void aio_write(const void *buf, unsigned len);
+extern void aio_copy(const void *buf, unsigned len);
+extern void aio_sync(void);
+extern int aio_read(void *buf, unsigned len, int msecs);
+
+#endif /* _SHOEHORN_AIO_H */
@@ -0,0 +1,350 @@
+/*
+ * board.c --	Booting several targets at once.
+ *
+ * Each board runs the ordinary boot code on a thread of its own, so
+ * the per-board state in serial.c, aio.c, metrics.c and shoehorn.c
+ * (declared __thread) is kept apart, while the images, loaders and
+ * options are shared.  Only one board runs at a time: when it would
+ * block, in aio_wait() or board_sleep(), it hands its port's epoll
+ * descriptor and a deadline to the event loop here and waits to be
+ * given its turn again.  So there is one event loop waiting on every
+ * port, and nothing but the delta hashing threads runs in parallel.
+ *
+ * A board's output is prefixed with its port's name.  If it fails,
+ * fail() ends that board only, and the others carry on; a summary of
+ * every board comes at the end.
+ *
+ * For work done once for all of them, the boards can gather: each
+ * waits in board_gather() until every board still going, and not out
+ * of the group, has got as far.  One of them is then told to do it.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "metrics.h"
+#include "serial.h"
+#include "util.h"
+
+struct board {
+	const char	*port;
+	const char	*name;		/* for messages */
+	pthread_t	thread;
+	sem_t		go;		/* its turn */
+	int		fd;		/* waiting for this, or -1 */
+	double		deadline;	/* or until then, if not 0 */
+	int		waiting;
+	int		gathers;	/* board_gather() calls */
+	int		gathering;	/* waiting in one */
+	int		lead;		/* and chosen to do the work */
+	int		grouped;
+	int		ending;		/* in finish() */
+	int		done, failed;
+	double		start, end;
+	FILE		*out;
+	int		bol;		/* at the start of a line */
+	char		line[80];	/* being written */
+	unsigned	len;
+	char		last[80];	/* last line, for the summary */
+};
+
+int board_multi;			/* more than one board */
+
+static struct board *boards;
+static int nr_boards;
+static void (*boot_fn)(const char *port);
+static sem_t back;			/* the event loop's turn */
+static FILE *real_stdout, *real_stderr;
+static __thread struct board *self;
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* write a board's output, with its name at the start of each line */
+static ssize_t board_write(void *cookie, const char *buf, size_t size)
+{
+	struct board *b = cookie;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (b->bol)
+			fprintf(real_stdout, "%s: ", b->name);
+		fputc(buf[i], real_stdout);
+		b->bol = buf[i] == '\n';
+		if (b->bol && b->len) {
+			memcpy(b->last, b->line, b->len);
+			b->last[b->len] = 0;
+			b->len = 0;
+		} else if (!b->bol && b->len < sizeof b->line - 1) {
+			b->line[b->len++] = buf[i];
+		}
+	}
+	fflush(real_stdout);
+	return size;
+}
+
+/* let b run until it waits or ends */
+static void run(struct board *b)
+{
+	stdout = stderr = b->out;
+	sem_post(&b->go);
+	sem_wait(&back);
+	stdout = real_stdout;
+	stderr = real_stderr;
+}
+
+/* hand over to the event loop until it's our turn again */
+static void yield(void)
+{
+	fflush(self->out);
+	sem_post(&back);
+	sem_wait(&self->go);
+}
+
+/*
+ * If everyone due has got to the gathering, let them all go on, with
+ * leader (or the first there) to do the work.  Returns 1 if it did.
+ */
+static int gather_check(struct board *leader)
+{
+	struct board *b;
+	int i, n = -1;
+
+	for (i = 0; i < nr_boards; i++)
+		if (boards[i].gathering)
+			n = boards[i].gathers;
+	if (n < 0)
+		return 0;
+	for (i = 0; i < nr_boards; i++) {
+		b = &boards[i];
+		if (!b->done && b->grouped && b->gathers < n)
+			return 0;
+	}
+	for (i = 0; i < nr_boards; i++) {
+		b = &boards[i];
+		if (!b->gathering)
+			continue;
+		if (!leader)
+			leader = b;
+		b->gathering = 0;
+		b->waiting = 0;
+	}
+	leader->lead = 1;
+	return 1;
+}
+
+static void finish(int failed)
+{
+	struct board *b = self;
+
+	/* its port, if it failed with it open; a failure on the way
+	   just ends it */
+	if (!b->ending) {
+		b->ending = 1;
+		serial_abort();
+		metrics_close();
+	}
+	fflush(b->out);
+	b->failed = failed;
+	b->end = now();
+	b->done = 1;
+	gather_check(NULL);
+	sem_post(&back);
+	pthread_exit(NULL);
+}
+
+static void board_fail(void)
+{
+	finish(1);
+}
+
+static void *board_main(void *arg)
+{
+	self = arg;
+	sem_wait(&self->go);
+	self->start = now();
+	boot_fn(self->port);
+	finish(0);
+	return NULL;
+}
+
+/*
+ * Wait until fd is readable, or msecs (-1: forever) have passed.
+ * Only for a board's thread.
+ */
+void board_wait(int fd, int msecs)
+{
+	self->fd = fd;
+	self->deadline = msecs < 0 ? 0 : now() + msecs / 1000.0;
+	self->waiting = 1;
+	yield();
+}
+
+void board_sleep(int msecs)
+{
+	if (board_multi)
+		board_wait(-1, msecs);
+	else
+		usleep(msecs * 1000);
+}
+
+const char *board_name(void)
+{
+	return self ? self->name : NULL;
+}
+
+/*
+ * Wait for the other boards in the group to get here too.  Returns 1
+ * on the one board that should do whatever is done once for them all.
+ */
+int board_gather(void)
+{
+	if (!board_multi)
+		return 1;
+	self->gathers++;
+	self->gathering = 1;
+	if (!gather_check(self)) {
+		self->fd = -1;
+		self->deadline = 0;
+		self->waiting = 1;
+		yield();
+	}
+	if (!self->lead)
+		return 0;
+	self->lead = 0;
+	return 1;
+}
+
+/* this board won't be gathering any more */
+void board_ungroup(void)
+{
+	if (!board_multi)
+		return;
+	self->grouped = 0;
+	gather_check(NULL);
+}
+
+/*
+ * Boot a board on each port.  Returns how many failed.
+ */
+int boards_run(char **ports, int nr_ports, void (*boot)(const char *port))
+{
+	cookie_io_functions_t io = { NULL, board_write, NULL, NULL };
+	struct epoll_event ev[16];
+	struct board *b;
+	int loop, alive, failures = 0, timeout, i, n;
+	double t, start = now();
+
+	board_multi = 1;
+	fail_hook = board_fail;
+	boot_fn = boot;
+	nr_boards = nr_ports;
+	boards = xmalloc(nr_boards * sizeof *boards);
+	memset(boards, 0, nr_boards * sizeof *boards);
+	real_stdout = stdout;
+	real_stderr = stderr;
+	sem_init(&back, 0, 0);
+	if ((loop = epoll_create1(0)) < 0)
+		perror_exit("epoll_create1");
+
+	for (i = 0; i < nr_boards; i++) {
+		b = &boards[i];
+		b->port = ports[i];
+		b->name = strrchr(ports[i], '/') ? strrchr(ports[i], '/') + 1
+						  : ports[i];
+		b->fd = -1;
+		b->bol = 1;
+		b->grouped = 1;
+		if (!(b->out = fopencookie(b, "w", io)))
+			perror_exit("fopencookie");
+		setvbuf(b->out, NULL, _IOLBF, 0);
+		sem_init(&b->go, 0, 0);
+		if (pthread_create(&b->thread, NULL, board_main, b))
+			perror_exit("pthread_create");
+	}
+
+	for (alive = nr_boards; alive; ) {
+		/* give everything that can run a turn */
+		for (i = 0; i < nr_boards; i++) {
+			b = &boards[i];
+			if (b->done || b->waiting)
+				continue;
+			run(b);
+			if (b->done) {
+				pthread_join(b->thread, NULL);
+				alive--;
+			} else if (b->fd >= 0) {
+				struct epoll_event e = { EPOLLIN, { .ptr = b } };
+
+				if (epoll_ctl(loop, EPOLL_CTL_ADD, b->fd, &e) < 0)
+					perror_exit("epoll_ctl");
+			}
+		}
+		if (!alive)
+			break;
+
+		/* then wait for one of them to have something to do; one let
+		   go from a gathering already has */
+		timeout = -1;
+		t = now();
+		for (i = 0; i < nr_boards; i++) {
+			b = &boards[i];
+			if (!b->done && !b->waiting)
+				timeout = 0;
+			if (timeout && b->waiting && b->deadline) {
+				n = b->deadline > t ?
+					(int)((b->deadline - t) * 1000) + 1 : 0;
+				if (timeout < 0 || n < timeout)
+					timeout = n;
+			}
+		}
+		n = epoll_wait(loop, ev, 16, timeout);
+		if (n < 0 && errno != EINTR)
+			perror_exit("epoll_wait");
+		for (i = 0; i < n; i++) {
+			b = ev[i].data.ptr;
+			b->waiting = 0;
+		}
+		t = now();
+		for (i = 0; i < nr_boards; i++) {
+			b = &boards[i];
+			if (b->waiting && b->deadline && t >= b->deadline)
+				b->waiting = 0;
+			if (!b->waiting && b->fd >= 0) {
+				epoll_ctl(loop, EPOLL_CTL_DEL, b->fd, NULL);
+				b->fd = -1;
+			}
+		}
+	}
+	xclose(loop);
+
+	printf("Summary (%.1fs):\n", now() - start);
+	for (i = 0; i < nr_boards; i++) {
+		b = &boards[i];
+		if (b->failed) {
+			failures++;
+			printf("  %s: FAILED after %.1fs: %s\n", b->name,
+				b->end - b->start, b->last);
+		} else {
+			printf("  %s: ok, %.1fs\n", b->name, b->end - b->start);
+		}
+		fclose(b->out);
+	}
+	printf("%d of %d boards booted\n", nr_boards - failures, nr_boards);
+	return failures;
+}
@@ -0,0 +1,17 @@
+/*
+ * board.h --	Booting several targets at once.
+ */
+#ifndef _SHOEHORN_BOARD_H
+#define _SHOEHORN_BOARD_H
+
+extern int board_multi;
+
+extern int boards_run(char **ports, int nr_ports,
+		      void (*boot)(const char *port));
+extern void board_wait(int fd, int msecs);
+extern void board_sleep(int msecs);
+extern const char *board_name(void);
+extern int board_gather(void);
+extern void board_ungroup(void);
+
+#endif /* _SHOEHORN_BOARD_H */
@@ -0,0 +1,289 @@
+/*
+ * bundle.c --	A kernel, initrd and command line, prepared once.
+ *
+ * "shoehorn bundle FILE" does to the kernel and initrd what prep.c does
+ * for a resident shoehorn (fill segments, compressed chunks and page
+ * hashes) and writes the results to FILE along with the images, the
+ * kernel command line and where they go (see bundle.h).  A boot with
+ * --bundle FILE maps it, and hands the results back to prep.c, so the
+ * transfer starts at once and nothing is worked out again.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "compress.h"
+#include "delta.h"
+#include "prep.h"
+#include "util.h"
+
+#define BUNDLE_PAGE	0x1000		/* images are aligned to this */
+
+
+/* write n bytes of p at the next multiple of align; returns where */
+static unsigned put(FILE *f, const char *filename, const void *p,
+		    unsigned n, unsigned align)
+{
+	long offset = ftell(f);
+
+	for (; offset % align; offset++)
+		if (putc(0, f) == EOF)
+			perror_exit(filename);
+	if (n && fwrite(p, 1, n, f) != n)
+		perror_exit(filename);
+	return offset;
+}
+
+/* write the segments, chunks and hashes of a prepared image */
+static void put_index(FILE *f, const char *filename, struct image *img,
+		      struct bundle_image *bi)
+{
+	const char *buf = (const char *)img->map;
+	unsigned pages = (img->size + DELTA_PAGESIZE - 1) / DELTA_PAGESIZE;
+	struct bundle_chunk *bc;
+	struct chunk_list *cl;
+	struct segment *seg;
+	struct chunk *c;
+	unsigned *hashes, count, n = 0, i, j;
+
+	seg = prep_segments(buf, img->size, &count);
+	for (i = 0; i < count; i++)
+		if (!seg[i].fill)
+			n += compress_count(prep_chunks(buf + seg[i].offset,
+							seg[i].size));
+	bc = xmalloc(n * sizeof *bc);
+	bi->nr_chunks = 0;
+	for (i = 0; i < count; i++) {
+		if (seg[i].fill)
+			continue;
+		cl = prep_chunks(buf + seg[i].offset, seg[i].size);
+		for (j = 0; j < compress_count(cl); j++) {
+			c = compress_wait(cl, j);
+			bc[bi->nr_chunks].offset = c->offset;
+			bc[bi->nr_chunks].size = c->size;
+			bc[bi->nr_chunks].csize = c->csize;
+			bc[bi->nr_chunks].data = c->csize ?
+				put(f, filename, c->data, c->csize, 1) : 0;
+			bi->nr_chunks++;
+		}
+	}
+	bi->name = put(f, filename, img->name, strlen(img->name) + 1, 1);
+	bi->segments = put(f, filename, seg, count * sizeof *seg, 4);
+	bi->nr_segments = count;
+	bi->chunks = put(f, filename, bc, n * sizeof *bc, 4);
+
+	hashes = xmalloc(pages * sizeof *hashes);
+	prep_hashes(buf, img->size, hashes);
+	bi->hashes = put(f, filename, hashes, pages * sizeof *hashes, 4);
+	free(hashes);
+	free(bc);
+	free(seg);
+}
+
+/*
+ * Prepare kernel and initrd, and write them to filename with kargs.
+ * The kernel goes at kernel_addr, the initrd at the top of DRAM.
+ */
+void bundle_write(const char *filename, struct image *kernel,
+		  unsigned kernel_addr, struct image *initrd,
+		  const char *kargs)
+{
+	struct bundle_header h;
+	char tmp[4096];
+	FILE *f;
+
+	if (kernel->streamed || initrd->streamed) {
+		fprintf(stderr, "%s: a bundle needs the images in regular "
+			"files\n", filename);
+		exit(1);
+	}
+	snprintf(tmp, sizeof tmp, "%s.tmp", filename);
+	if (!(f = fopen(tmp, "w")))
+		perror_exit(tmp);
+
+	printf("Preparing %s and %s\n", kernel->name, initrd->name);
+	prep_image((const char *)kernel->map, kernel->size);
+	prep_image((const char *)initrd->map, initrd->size);
+
+	memset(&h, 0, sizeof h);
+	put(f, tmp, &h, sizeof h, 1);
+	h.kargs = put(f, tmp, kargs, strlen(kargs) + 1, 1);
+	put_index(f, tmp, kernel, &h.kernel);
+	put_index(f, tmp, initrd, &h.initrd);
+	h.kernel.addr = kernel_addr;
+	h.kernel.size = kernel->size;
+	h.kernel.offset = put(f, tmp, kernel->map, kernel->size, BUNDLE_PAGE);
+	h.initrd.addr = 0;
+	h.initrd.size = initrd->size;
+	h.initrd.offset = put(f, tmp, initrd->map, initrd->size, BUNDLE_PAGE);
+	h.size = ftell(f);
+	memcpy(h.magic, BUNDLE_MAGIC, sizeof h.magic);
+	if (fseek(f, 0, SEEK_SET) < 0)
+		perror_exit(tmp);
+	put(f, tmp, &h, sizeof h, 1);
+	if (fclose(f) == EOF)
+		perror_exit(tmp);
+	/* a daemon watching it sees it change all at once */
+	if (rename(tmp, filename) < 0)
+		perror_exit(filename);
+
+	prep_forget((const char *)kernel->map);
+	prep_forget((const char *)initrd->map);
+	printf("%s: %u bytes\n", filename, h.size);
+}
+
+
+/* n items of size bytes at offset are all in the bundle */
+static int inside(const struct bundle *b, unsigned offset, unsigned n,
+		  unsigned size)
+{
+	return offset <= b->size && (!n || (b->size - offset) / n >= size);
+}
+
+static struct bundle *damaged(const char *filename)
+{
+	fprintf(stderr, "%s: not a bundle, or a damaged one\n", filename);
+	return NULL;
+}
+
+/* check that one image's part of the bundle is all there and sound */
+static int check_image(const struct bundle *b, const struct bundle_image *bi)
+{
+	const unsigned char *map = b->map;
+	const struct segment *seg = (const void *)(map + bi->segments);
+	const struct bundle_chunk *bc = (const void *)(map + bi->chunks);
+	unsigned pages = (bi->size + DELTA_PAGESIZE - 1) / DELTA_PAGESIZE;
+	unsigned i, j, n, first;
+
+	if (!inside(b, bi->offset, bi->size, 1) ||
+	    !inside(b, bi->name, 1, 1) ||
+	    !memchr(map + bi->name, 0, b->size - bi->name) ||
+	    bi->segments % 4 || bi->chunks % 4 || bi->hashes % 4 ||
+	    !inside(b, bi->segments, bi->nr_segments, sizeof *seg) ||
+	    !inside(b, bi->chunks, bi->nr_chunks, sizeof *bc) ||
+	    !inside(b, bi->hashes, pages, sizeof(unsigned)))
+		return 0;
+
+	for (i = j = 0; i < bi->nr_segments; i++) {
+		if (seg[i].offset > bi->size ||
+		    seg[i].size > bi->size - seg[i].offset)
+			return 0;
+		if (seg[i].fill)
+			continue;
+		n = (seg[i].size + COMPRESS_BLOCKSIZE - 1) /
+			COMPRESS_BLOCKSIZE;
+		if (n > bi->nr_chunks - j)
+			return 0;
+		for (first = j; j < first + n; j++)
+			if (bc[j].offset > seg[i].size ||
+			    bc[j].size > seg[i].size - bc[j].offset ||
+			    (bc[j].csize && !inside(b, bc[j].data,
+						    bc[j].csize, 1)))
+				return 0;
+	}
+	return 1;
+}
+
+/* give prep.c a checked image's index */
+static struct image *load_image(struct bundle *b,
+				const struct bundle_image *bi)
+{
+	const unsigned char *map = b->map;
+	const struct segment *seg = (const void *)(map + bi->segments);
+	const struct bundle_chunk *bc = (const void *)(map + bi->chunks);
+	struct chunk_list **chunks;
+	struct chunk *c;
+	unsigned i, j, n, first;
+
+	chunks = xmalloc(bi->nr_segments * sizeof *chunks);
+	c = xmalloc((bi->nr_chunks + 1) * sizeof *c);
+	for (i = j = 0; i < bi->nr_segments; i++) {
+		chunks[i] = NULL;
+		if (seg[i].fill)
+			continue;
+		n = (seg[i].size + COMPRESS_BLOCKSIZE - 1) /
+			COMPRESS_BLOCKSIZE;
+		for (first = j; j < first + n; j++) {
+			c[j].offset = bc[j].offset;
+			c[j].size = bc[j].size;
+			c[j].csize = bc[j].csize;
+			c[j].data = bc[j].csize ? b->map + bc[j].data : NULL;
+		}
+		chunks[i] = compress_list(map + bi->offset + seg[i].offset,
+					  c + first, n);
+	}
+	free(c);
+	prep_add((const char *)map + bi->offset, bi->size, seg,
+		 bi->nr_segments, chunks,
+		 (const unsigned *)(map + bi->hashes));
+	return image_mapped((const char *)map + bi->name,
+			    b->map + bi->offset, bi->size);
+}
+
+/*
+ * Map a bundle, with its images ready to send.  Returns NULL, having
+ * said why, if it can't be read or isn't sound.
+ */
+struct bundle *bundle_open(const char *filename)
+{
+	const struct bundle_header *h;
+	struct bundle *b;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror_msg(filename);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof *h) {
+		close(fd);
+		return damaged(filename);
+	}
+	b = xmalloc(sizeof *b);
+	b->size = st.st_size;
+	b->map = image_map(fd, b->size);
+	close(fd);
+	if (b->map == MAP_FAILED) {
+		perror_msg(filename);
+		free(b);
+		return NULL;
+	}
+
+	h = (const struct bundle_header *)b->map;
+	if (memcmp(h->magic, BUNDLE_MAGIC, sizeof h->magic) ||
+	    h->size != b->size || !inside(b, h->kargs, 1, 1) ||
+	    !memchr(b->map + h->kargs, 0, b->size - h->kargs) ||
+	    !check_image(b, &h->kernel) || !check_image(b, &h->initrd)) {
+		munmap(b->map, b->size);
+		free(b);
+		return damaged(filename);
+	}
+	b->kargs = (const char *)b->map + h->kargs;
+	b->kernel_addr = h->kernel.addr;
+	b->initrd_addr = h->initrd.addr;
+	b->kernel = load_image(b, &h->kernel);
+	b->initrd = load_image(b, &h->initrd);
+	madvise(b->map, b->size, MADV_WILLNEED);
+	printf("%s: %s (%u bytes) and %s (%u bytes)\n", filename,
+	       b->kernel->name, b->kernel->size, b->initrd->name,
+	       b->initrd->size);
+	return b;
+}
+
+void bundle_close(struct bundle *b)
+{
+	prep_forget((const char *)b->kernel->map);
+	prep_forget((const char *)b->initrd->map);
+	image_close(b->kernel);
+	image_close(b->initrd);
+	munmap(b->map, b->size);
+	free(b);
+}
@@ -0,0 +1,60 @@
+/*
+ * bundle.h --	A kernel, initrd and command line, prepared once.
+ */
+#ifndef _SHOEHORN_BUNDLE_H
+#define _SHOEHORN_BUNDLE_H
+
+#include "image.h"
+
+#define BUNDLE_MAGIC	"shbndl1\n"
+
+/*
+ * The file starts with a struct bundle_header; the offsets in it are
+ * from the start of the file, and everything is in the host's byte
+ * order.  The images themselves start on pages, to be mapped as they
+ * are, and the rest on words.
+ */
+struct bundle_image {
+	unsigned	addr;		/* where it goes; 0 for the initrd:
+					   the top of DRAM, planned at boot */
+	unsigned	name;		/* the file it was, for messages */
+	unsigned	offset;
+	unsigned	size;		/* padded to an even size */
+	unsigned	segments;	/* struct segment[], from fill_scan() */
+	unsigned	nr_segments;
+	unsigned	chunks;		/* struct bundle_chunk[], for the
+					   literal segments in turn */
+	unsigned	nr_chunks;
+	unsigned	hashes;		/* CRC-32 per DELTA_PAGESIZE page */
+};
+
+struct bundle_header {
+	char		magic[8];
+	unsigned	size;		/* of the whole file */
+	unsigned	kargs;		/* kernel command line */
+	struct bundle_image kernel, initrd;
+};
+
+/* a chunk of a literal segment, as compress_start() cut it */
+struct bundle_chunk {
+	unsigned	offset;		/* within the segment */
+	unsigned	size;
+	unsigned	csize;		/* compressed size, 0 if stored */
+	unsigned	data;		/* the compressed bytes, if any */
+};
+
+struct bundle {
+	unsigned char	*map;
+	unsigned	size;
+	struct image	*kernel, *initrd;
+	unsigned	kernel_addr, initrd_addr;
+	const char	*kargs;
+};
+
+extern void bundle_write(const char *filename, struct image *kernel,
+			 unsigned kernel_addr, struct image *initrd,
+			 const char *kargs);
+extern struct bundle *bundle_open(const char *filename);
+extern void bundle_close(struct bundle *b);
+
+#endif /* _SHOEHORN_BUNDLE_H */
@@ -0,0 +1,179 @@
+/*
+ * compress.c --	Parallel chunk compression for block transfers.
+ *
+ * A buffer is cut into COMPRESS_BLOCKSIZE chunks which a pool of
+ * worker threads compresses in order, so the transfer loop can send
+ * chunk n while chunks n+1... are still being compressed.  A chunk
+ * that doesn't shrink by at least 1/COMPRESS_MINGAIN is left to be
+ * sent as is.  A list can also be kept (see prep.c) and sent again.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "lz.h"
+#include "util.h"
+
+#define COMPRESS_THREADS	8	/* at most */
+#define COMPRESS_MINGAIN	16
+
+struct chunk_list {
+	const unsigned char *buf;
+	unsigned	nr_chunks;
+	struct chunk	*chunks;
+	unsigned	next;		/* next chunk for a worker */
+	pthread_mutex_t	lock;
+	pthread_cond_t	ready;
+	int		nr_threads;
+	pthread_t	threads[COMPRESS_THREADS];
+	int		kept;		/* compress_finish() leaves it */
+	int		borrowed;	/* the compressed bytes aren't ours */
+};
+
+static void *compress_worker(void *arg)
+{
+	struct chunk_list *cl = arg;
+	struct chunk *c;
+	unsigned limit;
+
+	while (1) {
+		pthread_mutex_lock(&cl->lock);
+		c = cl->next < cl->nr_chunks ? &cl->chunks[cl->next++] : NULL;
+		pthread_mutex_unlock(&cl->lock);
+		if (!c)
+			return NULL;
+
+		limit = c->size - c->size / COMPRESS_MINGAIN;
+		c->data = xmalloc(limit);
+		c->csize = lz_compress(cl->buf + c->offset, c->size,
+				       c->data, limit);
+		if (!c->csize) {
+			free(c->data);
+			c->data = NULL;
+		}
+
+		pthread_mutex_lock(&cl->lock);
+		c->ready = 1;
+		pthread_cond_broadcast(&cl->ready);
+		pthread_mutex_unlock(&cl->lock);
+	}
+}
+
+/* cut a buffer into chunks and start compressing them */
+struct chunk_list *compress_start(const unsigned char *buf, unsigned size)
+{
+	struct chunk_list *cl = xmalloc(sizeof *cl);
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i;
+
+	cl->buf = buf;
+	cl->nr_chunks = (size + COMPRESS_BLOCKSIZE - 1) / COMPRESS_BLOCKSIZE;
+	cl->chunks = xmalloc(cl->nr_chunks * sizeof *cl->chunks);
+	for (i = 0; i < cl->nr_chunks; i++) {
+		cl->chunks[i].offset = i * COMPRESS_BLOCKSIZE;
+		cl->chunks[i].size = min(size - i * COMPRESS_BLOCKSIZE,
+					 COMPRESS_BLOCKSIZE);
+		cl->chunks[i].csize = 0;
+		cl->chunks[i].data = NULL;
+		cl->chunks[i].ready = 0;
+	}
+	cl->next = 0;
+	cl->kept = cl->borrowed = 0;
+	pthread_mutex_init(&cl->lock, NULL);
+	pthread_cond_init(&cl->ready, NULL);
+
+	if (ncpus < 1)
+		ncpus = 1;
+	cl->nr_threads = min(ncpus, COMPRESS_THREADS);
+	for (i = 0; i < cl->nr_threads; i++) {
+		if (pthread_create(&cl->threads[i], NULL,
+				   compress_worker, cl) != 0)
+			break;
+	}
+	cl->nr_threads = i;
+	if (!cl->nr_threads) {
+		/* no threads: compress everything up front */
+		compress_worker(cl);
+	}
+	return cl;
+}
+
+/*
+ * A kept list of nr_chunks chunks of buf compressed before (see
+ * bundle.c), whose compressed bytes stay where they are.
+ */
+struct chunk_list *compress_list(const unsigned char *buf,
+				 const struct chunk *chunks,
+				 unsigned nr_chunks)
+{
+	struct chunk_list *cl = xmalloc(sizeof *cl);
+	unsigned i;
+
+	cl->buf = buf;
+	cl->nr_chunks = nr_chunks;
+	cl->chunks = xmalloc(nr_chunks * sizeof *cl->chunks);
+	for (i = 0; i < nr_chunks; i++) {
+		cl->chunks[i] = chunks[i];
+		cl->chunks[i].ready = 1;
+	}
+	cl->next = nr_chunks;
+	cl->nr_threads = 0;
+	cl->kept = cl->borrowed = 1;
+	pthread_mutex_init(&cl->lock, NULL);
+	pthread_cond_init(&cl->ready, NULL);
+	return cl;
+}
+
+unsigned compress_count(const struct chunk_list *cl)
+{
+	return cl->nr_chunks;
+}
+
+/* wait until chunk i has been compressed (or found incompressible) */
+struct chunk *compress_wait(struct chunk_list *cl, unsigned i)
+{
+	struct chunk *c = &cl->chunks[i];
+
+	pthread_mutex_lock(&cl->lock);
+	while (!c->ready)
+		pthread_cond_wait(&cl->ready, &cl->lock);
+	pthread_mutex_unlock(&cl->lock);
+	return c;
+}
+
+/* wait for the whole buffer to be compressed, and keep it that way */
+void compress_keep(struct chunk_list *cl)
+{
+	unsigned i;
+
+	for (i = 0; i < cl->nr_threads; i++)
+		pthread_join(cl->threads[i], NULL);
+	cl->nr_threads = 0;
+	cl->kept = 1;
+}
+
+/* wait for the workers and free everything, unless it's kept */
+void compress_finish(struct chunk_list *cl)
+{
+	unsigned i;
+
+	if (cl->kept)
+		return;
+	for (i = 0; i < cl->nr_threads; i++)
+		pthread_join(cl->threads[i], NULL);
+	for (i = 0; i < cl->nr_chunks && !cl->borrowed; i++)
+		free(cl->chunks[i].data);
+	free(cl->chunks);
+	pthread_mutex_destroy(&cl->lock);
+	pthread_cond_destroy(&cl->ready);
+	free(cl);
+}
+
+/* free a kept list */
+void compress_drop(struct chunk_list *cl)
+{
+	cl->kept = 0;
+	compress_finish(cl);
+}
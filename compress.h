@@ -0,0 +1,30 @@
+/*
+ * compress.h --	Parallel chunk compression for block transfers.
+ */
+#ifndef _SHOEHORN_COMPRESS_H
+#define _SHOEHORN_COMPRESS_H
+
+#define COMPRESS_BLOCKSIZE	0x4000
+
+struct chunk {
+	unsigned	offset;		/* within the buffer */
+	unsigned	size;		/* uncompressed size */
+	unsigned	csize;		/* compressed size, 0 if stored */
+	unsigned char	*data;		/* compressed bytes */
+	int		ready;
+};
+
+struct chunk_list;
+
+extern struct chunk_list *compress_start(const unsigned char *buf,
+					 unsigned size);
+extern struct chunk_list *compress_list(const unsigned char *buf,
+					const struct chunk *chunks,
+					unsigned nr_chunks);
+extern struct chunk *compress_wait(struct chunk_list *cl, unsigned i);
+extern unsigned compress_count(const struct chunk_list *cl);
+extern void compress_finish(struct chunk_list *cl);
+extern void compress_keep(struct chunk_list *cl);
+extern void compress_drop(struct chunk_list *cl);
+
+#endif /* _SHOEHORN_COMPRESS_H */
@@ -7,12 +7,20 @@
    EDB7111. so we have to read them as 32-bit registers and ignore the
    upper 16-bits. i'm not sure if this holds for the EDB7211. */
 
-#define CS8900_RTDATA *(volatile unsigned int *)(CS8900_BASE+0x00)
-#define CS8900_TxCMD  *(volatile unsigned int *)(CS8900_BASE+0x08)
-#define CS8900_TxLEN  *(volatile unsigned int *)(CS8900_BASE+0x0C)
-#define CS8900_ISQ    *(volatile unsigned int *)(CS8900_BASE+0x10)
-#define CS8900_PPTR   *(volatile unsigned int *)(CS8900_BASE+0x14)
-#define CS8900_PDATA  *(volatile unsigned int *)(CS8900_BASE+0x18)
+#ifdef SIM
+// loader-sim: accesses go through the CS8900 model in sim.c
+extern volatile unsigned int *sim_cs8900(unsigned offset);
+#define CS8900_REG(offset) (*sim_cs8900(offset))
+#else
+#define CS8900_REG(offset) (*(volatile unsigned int *)(CS8900_BASE+(offset)))
+#endif
+
+#define CS8900_RTDATA CS8900_REG(0x00)
+#define CS8900_TxCMD  CS8900_REG(0x08)
+#define CS8900_TxLEN  CS8900_REG(0x0C)
+#define CS8900_ISQ    CS8900_REG(0x10)
+#define CS8900_PPTR   CS8900_REG(0x14)
+#define CS8900_PDATA  CS8900_REG(0x18)
 
 #define ISQ_RxEvent     0x04
 #define ISQ_TxEvent     0x08
@@ -0,0 +1,477 @@
+/*
+ * daemon.c --	A resident shoehorn, booting boards on request.
+ *
+ *	shoehorn --daemon SOCKET [options] [kernel command line]
+ *	shoehorn --connect SOCKET [--port PORT]...
+ *
+ * The daemon reads the loaders and maps the kernel and initrd once,
+ * prepares them (prep.c), and waits on a Unix socket.  A request is a
+ * line naming the ports to boot, or none for the daemon's own.  Each
+ * is booted by a child of the daemon's, which has everything ready to
+ * go when it starts and sends its output back to the client; if it
+ * fails it fails alone.  The last line of the answer is DAEMON_STATUS
+ * and the child's exit status, which --connect exits with.
+ *
+ * The files are watched with inotify and read again a little after
+ * they change; if the new ones won't do, the old ones are kept.  Boots
+ * under way carry on with what they had.  A port is only booted by one
+ * request at a time, and a client has DAEMON_WAIT to send its request,
+ * which is read along with everything else.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "util.h"
+
+#define DAEMON_CHILDREN	64	/* requests at once */
+#define DAEMON_PORTS	64	/* ports per request */
+#define DAEMON_REQUEST	4096	/* longest request line */
+#define DAEMON_SETTLE	500	/* msecs from a change to reading it */
+#define DAEMON_WAIT	2000	/* msecs for a client to send its request */
+
+struct child {
+	pid_t		pid;		/* 0: free */
+	int		fd;		/* the client */
+	char		*line;		/* request being read, if not NULL */
+	int		len;
+	double		deadline;	/* for the rest of it */
+	char		*ports[DAEMON_PORTS];
+	int		nr_ports;
+	double		start;
+};
+
+struct watch {
+	const char	*name;
+	const char	*base;		/* name within its directory */
+	int		wd;
+};
+
+static struct child children[DAEMON_CHILDREN];
+static struct watch *watches;
+static int nr_watches;
+static int listen_fd, inotify_fd, signal_fd;
+static sigset_t oldmask;
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void address(struct sockaddr_un *sa, const char *path)
+{
+	if (strlen(path) >= sizeof sa->sun_path) {
+		fprintf(stderr, "%s: socket name too long\n", path);
+		exit(1);
+	}
+	memset(sa, 0, sizeof *sa);
+	sa->sun_family = AF_UNIX;
+	strcpy(sa->sun_path, path);
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+	int fd;
+
+	address(&sa, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		perror_exit("socket");
+	/* take over from a daemon that's gone, but not one that isn't */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == 0) {
+			fprintf(stderr, "%s: already in use\n", path);
+			exit(1);
+		}
+		unlink(path);
+	}
+	if (bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0)
+		perror_exit(path);
+	if (listen(fd, 16) < 0)
+		perror_exit("listen");
+	return fd;
+}
+
+/* watch the directories, to see files replaced as well as rewritten */
+static void watch_files(char **files, int nr_files)
+{
+	char dir[4096];
+	const char *slash;
+	int i;
+
+	if ((inotify_fd = inotify_init()) < 0)
+		perror_exit("inotify_init");
+	watches = xmalloc(nr_files * sizeof *watches);
+	for (i = 0; i < nr_files; i++) {
+		watches[i].name = files[i];
+		slash = strrchr(files[i], '/');
+		if (!slash) {
+			strcpy(dir, ".");
+			watches[i].base = files[i];
+		} else {
+			snprintf(dir, sizeof dir, "%.*s",
+				 slash == files[i] ? 1 : (int)(slash - files[i]),
+				 files[i]);
+			watches[i].base = slash + 1;
+		}
+		watches[i].wd = inotify_add_watch(inotify_fd, dir,
+						  IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (watches[i].wd < 0)
+			perror_exit(dir);
+	}
+	nr_watches = nr_files;
+}
+
+/* returns true if one of our files has changed */
+static int changed(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	int n, i, any = 0;
+	char *p;
+
+	n = read(inotify_fd, buf, sizeof buf);
+	for (p = buf; n > 0 && p < buf + n; p += sizeof *ev + ev->len) {
+		ev = (const struct inotify_event *)p;
+		for (i = 0; i < nr_watches; i++) {
+			if (ev->wd == watches[i].wd && ev->len &&
+			    strcmp(ev->name, watches[i].base) == 0) {
+				printf("%s changed\n", watches[i].name);
+				any = 1;
+			}
+		}
+	}
+	return any;
+}
+
+/* returns true if the files are all there to be read again */
+static int complete(void)
+{
+	struct stat st;
+	int i;
+
+	for (i = 0; i < nr_watches; i++) {
+		if (stat(watches[i].name, &st) < 0 || !S_ISREG(st.st_mode)) {
+			printf("%s: missing; keeping what we have\n",
+			       watches[i].name);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void print_ports(const struct child *c)
+{
+	int i;
+
+	for (i = 0; i < c->nr_ports; i++)
+		printf("%s%s", i ? " " : "", c->ports[i]);
+}
+
+/* is port being booted already? */
+static int busy(const char *port)
+{
+	int i, j;
+
+	for (i = 0; i < DAEMON_CHILDREN; i++)
+		for (j = 0; children[i].pid && j < children[i].nr_ports; j++)
+			if (!strcmp(port, children[i].ports[j]))
+				return 1;
+	return 0;
+}
+
+static void forget(struct child *c)
+{
+	int i;
+
+	for (i = 0; i < c->nr_ports; i++)
+		free(c->ports[i]);
+	c->nr_ports = 0;
+	c->pid = 0;
+}
+
+static void refuse(struct child *c, const char *why)
+{
+	dprintf(c->fd, "%s\n" DAEMON_STATUS "1\n", why);
+	close(c->fd);
+	free(c->line);
+	c->line = NULL;
+	forget(c);
+}
+
+/* take a new client, whose request is read as it comes */
+static void accept_client(void)
+{
+	struct child *c = NULL;
+	int fd, i;
+
+	if ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) < 0)
+		return;
+	for (i = 0; i < DAEMON_CHILDREN && !c; i++)
+		if (!children[i].pid && !children[i].line)
+			c = &children[i];
+	if (!c) {
+		dprintf(fd, "Too many requests\n" DAEMON_STATUS "1\n");
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->line = xmalloc(DAEMON_REQUEST);
+	c->len = 0;
+	c->deadline = now() + DAEMON_WAIT / 1000.0;
+}
+
+/*
+ * Boot the ports of c's request line: the ports to boot, space
+ * separated.
+ */
+static void start(struct child *c, int (*boot)(char **ports, int nr_ports),
+		  char **ports, int nr_ports)
+{
+	char *word;
+	int fd = c->fd, i;
+
+	c->nr_ports = 0;
+	for (word = strtok(c->line, " \t"); word; word = strtok(NULL, " \t")) {
+		if (c->nr_ports == DAEMON_PORTS) {
+			refuse(c, "Too many ports");
+			return;
+		}
+		c->ports[c->nr_ports++] = strdup(word);
+	}
+	free(c->line);
+	c->line = NULL;
+	if (!c->nr_ports) {
+		for (i = 0; i < nr_ports; i++)
+			c->ports[i] = strdup(ports[i]);
+		c->nr_ports = nr_ports;
+	}
+	for (i = 0; i < c->nr_ports; i++) {
+		if (busy(c->ports[i])) {
+			refuse(c, "Port busy");
+			return;
+		}
+	}
+
+	/* the child's output goes to it as it comes */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	fflush(stdout);
+	fflush(stderr);
+	c->start = now();
+	if ((c->pid = fork()) < 0) {
+		c->pid = 0;
+		refuse(c, strerror(errno));
+		return;
+	}
+	if (c->pid == 0) {
+		sigprocmask(SIG_SETMASK, &oldmask, NULL);
+		signal(SIGPIPE, SIG_DFL);
+		close(listen_fd);
+		close(inotify_fd);
+		close(signal_fd);
+		for (i = 0; i < DAEMON_CHILDREN; i++)
+			if ((children[i].pid || children[i].line) &&
+			    &children[i] != c)
+				close(children[i].fd);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		close(fd);
+		exit(boot(c->ports, c->nr_ports) ? 1 : 0);
+	}
+	print_ports(c);
+	printf(": booting, pid %d\n", c->pid);
+}
+
+/* read what has come of c's request, and start it once it's all there */
+static void read_request(struct child *c,
+			 int (*boot)(char **ports, int nr_ports),
+			 char **ports, int nr_ports)
+{
+	char *nl;
+	int n;
+
+	n = read(c->fd, c->line + c->len, DAEMON_REQUEST - c->len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		refuse(c, "Bad request");
+		return;
+	}
+	c->len += n;
+	if ((nl = memchr(c->line, '\n', c->len))) {
+		*nl = 0;
+		start(c, boot, ports, nr_ports);
+	} else if (c->len == DAEMON_REQUEST) {
+		refuse(c, "Bad request");
+	}
+}
+
+/* finish off the requests whose children have exited */
+static void reap(void)
+{
+	struct signalfd_siginfo si;
+	struct child *c;
+	int status, code;
+	pid_t pid;
+
+	while (read(signal_fd, &si, sizeof si) > 0)
+		;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (c = children; c < children + DAEMON_CHILDREN; c++)
+			if (c->pid == pid)
+				break;
+		if (c == children + DAEMON_CHILDREN)
+			continue;
+		code = WIFEXITED(status) ? WEXITSTATUS(status) :
+			128 + WTERMSIG(status);
+		dprintf(c->fd, DAEMON_STATUS "%d\n", code);
+		close(c->fd);
+		print_ports(c);
+		printf(": %s, %.1fs\n", code ? "FAILED" : "ok",
+		       now() - c->start);
+		forget(c);
+	}
+}
+
+/*
+ * Serve boot requests on path for ever.  load() reads the files in
+ * again, and boot() boots the ports of a request, returning non-zero
+ * if any failed; ports are booted if the request names none.
+ */
+void daemon_run(const char *path, char **files, int nr_files,
+		void (*load)(void), int (*boot)(char **ports, int nr_ports),
+		char **ports, int nr_ports)
+{
+	struct pollfd pfd[3 + DAEMON_CHILDREN];
+	struct child *reading[DAEMON_CHILDREN];
+	sigset_t mask;
+	double reload, t;
+	int timeout, nr_reading, i;
+
+	/* a client that's gone is no reason to stop */
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK)) < 0)
+		perror_exit("signalfd");
+	watch_files(files, nr_files);
+	listen_fd = listen_on(path);
+	printf("Waiting for requests on %s\n", path);
+
+	pfd[0].fd = listen_fd;
+	pfd[1].fd = inotify_fd;
+	pfd[2].fd = signal_fd;
+	for (i = 0; i < 3 + DAEMON_CHILDREN; i++)
+		pfd[i].events = POLLIN;
+	reload = 0;
+	while (1) {
+		/* wait for the clients whose requests are still coming too,
+		   until the first of them or a reload is due */
+		nr_reading = 0;
+		t = reload;
+		for (i = 0; i < DAEMON_CHILDREN; i++) {
+			if (!children[i].line)
+				continue;
+			reading[nr_reading] = &children[i];
+			pfd[3 + nr_reading++].fd = children[i].fd;
+			if (!t || children[i].deadline < t)
+				t = children[i].deadline;
+		}
+		timeout = -1;
+		if (t)
+			timeout = t > now() ? (int)((t - now()) * 1000) + 1 : 0;
+		if (poll(pfd, 3 + nr_reading, timeout) < 0) {
+			if (errno != EINTR)
+				perror_exit("poll");
+			continue;
+		}
+		if (pfd[2].revents)
+			reap();
+		if (pfd[1].revents && changed())
+			reload = now() + DAEMON_SETTLE / 1000.0;
+		if (reload && now() >= reload) {
+			reload = 0;
+			if (complete())
+				load();
+		}
+		for (i = 0; i < nr_reading; i++) {
+			if (pfd[3 + i].revents)
+				read_request(reading[i], boot, ports, nr_ports);
+			else if (now() >= reading[i]->deadline)
+				refuse(reading[i], "No request");
+		}
+		if (pfd[0].revents)
+			accept_client();
+	}
+}
+
+/*
+ * Ask the daemon on path to boot ports (its own if there are none),
+ * copying its answer to stdout.  Returns the exit status.
+ */
+int daemon_request(const char *path, char **ports, int nr_ports)
+{
+	const unsigned plen = strlen(DAEMON_STATUS);
+	struct sockaddr_un sa;
+	char buf[0x1000], line[64];
+	int fd, n, i, held = 0, status = -1;
+
+	address(&sa, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		perror_exit("socket");
+	if (connect(fd, (struct sockaddr *)&sa, sizeof sa) < 0)
+		perror_exit(path);
+	for (i = 0; i < nr_ports; i++)
+		dprintf(fd, "%s%s", i ? " " : "", ports[i]);
+	dprintf(fd, "\n");
+
+	/* pass everything on but the status line, which is held back
+	   for as long as a line might be it */
+	while ((n = read(fd, buf, sizeof buf)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (held < 0) {
+				putchar(buf[i]);
+			} else if (held < plen && buf[i] != DAEMON_STATUS[held]) {
+				fwrite(line, 1, held, stdout);
+				putchar(buf[i]);
+				held = -1;
+			} else if (buf[i] == '\n') {
+				line[held] = 0;
+				status = atoi(line + plen);
+				held = 0;
+			} else if (held < sizeof line - 1) {
+				line[held++] = buf[i];
+			}
+			if (held < 0 && buf[i] == '\n')
+				held = 0;
+		}
+		fflush(stdout);
+	}
+	close(fd);
+	if (status < 0) {
+		fprintf(stderr, "%s: no answer from the daemon\n", path);
+		return 1;
+	}
+	return status;
+}
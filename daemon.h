@@ -0,0 +1,16 @@
+/*
+ * daemon.h --	A resident shoehorn, booting boards on request.
+ */
+#ifndef _SHOEHORN_DAEMON_H
+#define _SHOEHORN_DAEMON_H
+
+/* the last line of the answer to a request */
+#define DAEMON_STATUS	"shoehorn: exit status "
+
+extern void daemon_run(const char *path, char **files, int nr_files,
+		       void (*load)(void),
+		       int (*boot)(char **ports, int nr_ports),
+		       char **ports, int nr_ports);
+extern int daemon_request(const char *path, char **ports, int nr_ports);
+
+#endif /* _SHOEHORN_DAEMON_H */
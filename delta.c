@@ -0,0 +1,135 @@
+/*
+ * delta.c --	Send only the pages the target doesn't already have.
+ *
+ * When the same board is booted over and over, most of the last
+ * kernel and initrd is still in DRAM.  The loader hashes the pages we
+ * are about to write ('H') while a pool of threads hashes ours, and
+ * only the pages whose hashes differ are sent.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "delta.h"
+#include "prep.h"
+#include "serial.h"
+#include "util.h"
+
+#define DELTA_THREADS	8	/* at most */
+
+struct hasher {
+	pthread_t	thread;
+	const char	*buf;
+	unsigned	size;
+	unsigned	*hashes;
+	int		started;
+};
+
+static void *hash_worker(void *arg)
+{
+	struct hasher *h = arg;
+	unsigned i;
+
+	for (i = 0; i * DELTA_PAGESIZE < h->size; i++)
+		h->hashes[i] = crc32(0, h->buf + i * DELTA_PAGESIZE,
+				     min(h->size - i * DELTA_PAGESIZE,
+					 DELTA_PAGESIZE));
+	return NULL;
+}
+
+/*
+ * detect_dram leaves the address of every step in its first word, so
+ * a page holding one of those words may still be ours apart from it.
+ * If so, put the word right and report the page as unchanged.
+ */
+static int clobbered(unsigned addr, const char *page, unsigned size,
+		     unsigned step, unsigned hash)
+{
+	char copy[DELTA_PAGESIZE];
+	unsigned a = (addr + step - 1) & ~(step - 1);
+	unsigned w;
+
+	if (a - addr + 4 > size)
+		return 0;
+	memcpy(copy, page, size);
+	memcpy(copy + (a - addr), &a, 4);
+	if (crc32(0, copy, size) != hash)
+		return 0;
+	memcpy(&w, page + (a - addr), 4);
+	target_write_word(a, w);
+	return 1;
+}
+
+/*
+ * Compare buf with what the target has at addr, returning a malloced
+ * array of *count segments that need to be sent.  step is the DRAM
+ * detection step size.
+ */
+struct segment *delta_scan(unsigned addr, const char *buf, unsigned size,
+			   unsigned step, unsigned *count)
+{
+	struct hasher hasher[DELTA_THREADS];
+	struct segment *seg;
+	unsigned pages = (size + DELTA_PAGESIZE - 1) / DELTA_PAGESIZE;
+	unsigned *ours = xmalloc(pages * sizeof *ours);
+	unsigned *theirs = xmalloc(pages * sizeof *theirs);
+	unsigned per_thread, offset, n, i, changed = 0;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nr_threads, t;
+
+	/* hash our pages while the loader hashes its own, unless
+	   that's been done already */
+	if (ncpus < 1)
+		ncpus = 1;
+	nr_threads = min(min(ncpus, DELTA_THREADS), pages);
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (prep_hashes(buf, size, ours))
+		nr_threads = 0;
+	per_thread = nr_threads ? (pages + nr_threads - 1) / nr_threads : 0;
+	for (t = 0; t < nr_threads; t++) {
+		offset = min(t * per_thread * DELTA_PAGESIZE, size);
+		hasher[t].buf = buf + offset;
+		hasher[t].size = min(size - offset,
+				     per_thread * DELTA_PAGESIZE);
+		hasher[t].hashes = ours + t * per_thread;
+		hasher[t].started = pthread_create(&hasher[t].thread, NULL,
+						   hash_worker,
+						   &hasher[t]) == 0;
+		if (!hasher[t].started)
+			hash_worker(&hasher[t]);
+	}
+	target_hash_pages(addr, size, DELTA_PAGESIZE, theirs);
+	for (t = 0; t < nr_threads; t++) {
+		if (hasher[t].started)
+			pthread_join(hasher[t].thread, NULL);
+	}
+
+	/* one segment per run of changed pages */
+	seg = xmalloc((pages / 2 + 1) * sizeof *seg);
+	*count = 0;
+	for (i = 0; i < pages; i++) {
+		offset = i * DELTA_PAGESIZE;
+		n = min(size - offset, DELTA_PAGESIZE);
+		if (ours[i] == theirs[i] ||
+		    clobbered(addr + offset, buf + offset, n, step, theirs[i]))
+			continue;
+		changed++;
+		if (*count && seg[*count - 1].offset +
+		    seg[*count - 1].size == offset) {
+			seg[*count - 1].size += n;
+		} else {
+			seg[*count].offset = offset;
+			seg[*count].size = n;
+			seg[*count].fill = 0;
+			++*count;
+		}
+	}
+	printf("- %u of %u pages changed\n", changed, pages);
+	free(ours);
+	free(theirs);
+	return seg;
+}
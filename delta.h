@@ -0,0 +1,15 @@
+/*
+ * delta.h --	Send only the pages the target doesn't already have.
+ */
+#ifndef _SHOEHORN_DELTA_H
+#define _SHOEHORN_DELTA_H
+
+#include "fill.h"
+
+#define DELTA_PAGESIZE	0x1000
+
+extern struct segment *delta_scan(unsigned addr, const char *buf,
+				  unsigned size, unsigned step,
+				  unsigned *count);
+
+#endif /* _SHOEHORN_DELTA_H */
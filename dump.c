@@ -0,0 +1,249 @@
+/*
+ * dump.c --	Reading target memory into a file.
+ *
+ * "shoehorn dump ADDR LEN FILE" reads LEN bytes from ADDR on the board
+ * in chunks, as pipelined 'R' blocks (target_read_block()), or with a
+ * stage 2 loader that has Ethernet, as frames it sends ('S') with the
+ * serial line only fetching the ones lost.  FILE is mapped, and pages
+ * that are zero on the board are left as holes in it.
+ *
+ * Which chunks are in FILE is kept in FILE.resume, so a dump that is
+ * interrupted, or fails, goes on where it stopped when run again with
+ * the same ADDR and LEN.  It is removed once the dump is complete.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dump.h"
+#include "eth.h"
+#include "loader.h"
+#include "metrics.h"
+#include "serial.h"
+#include "util.h"
+
+#define DUMP_CHUNK	0x10000		/* read, and noted as done, at once */
+#define DUMP_PAGE	0x1000		/* left a hole if it's all zero */
+#define DUMP_TIMEOUT	2.0		/* seconds without the 'S' CRC */
+#define DUMP_FRAMES	((DUMP_CHUNK + ETH_BURST_DATA - 1) / ETH_BURST_DATA)
+#define BURST_HEAD	(ETH_HEADER + sizeof(struct eth_burst))
+
+static const char resume_magic[8] = "shdump1\n";
+
+/* FILE.resume: what's being dumped, and a bit per chunk that's done */
+struct resume {
+	char		magic[8];
+	unsigned	addr;
+	unsigned	len;
+	unsigned	chunk;
+	unsigned char	done[];
+};
+
+static unsigned eth_bytes, serial_bytes, frames_lost;
+
+
+/* copy a chunk into the file a page at a time, leaving holes alone */
+static void store(char *dst, const char *src, unsigned size)
+{
+	unsigned i, n;
+
+	for (i = 0; i < size; i += n) {
+		n = min(size - i, DUMP_PAGE);
+		if (memcmp(dst + i, src + i, n))
+			memcpy(dst + i, src + i, n);
+	}
+}
+
+static void read_serial(unsigned addr, char *buf, unsigned size,
+			unsigned progress)
+{
+	target_read_block(addr, buf, size, progress);
+	serial_bytes += size;
+	xfer_stats.bytes += size;
+}
+
+/* take a frame of the chunk at addr; returns 1 if it's a new one */
+static int take_frame(const unsigned char *frame, unsigned len,
+		      unsigned addr, char *buf, unsigned size,
+		      unsigned char *have)
+{
+	unsigned seq = get_le(frame + ETH_HEADER + 4);
+	unsigned n = get_le(frame + ETH_HEADER + 8);
+
+	if (len < BURST_HEAD || get_le(frame + ETH_HEADER) != addr ||
+	    seq >= DUMP_FRAMES || seq * ETH_BURST_DATA >= size ||
+	    have[seq / 8] & 1 << seq % 8 ||
+	    n != min(size - seq * ETH_BURST_DATA, ETH_BURST_DATA) ||
+	    len < BURST_HEAD + n)
+		return 0;
+	memcpy(buf + seq * ETH_BURST_DATA, frame + BURST_HEAD, n);
+	have[seq / 8] |= 1 << seq % 8;
+	eth_bytes += n;
+	xfer_stats.bytes += n;
+	return 1;
+}
+
+/*
+ * Have the loader send a chunk over Ethernet, and read the frames that
+ * didn't come over serial.  Returns 0 if the chunk's CRC is wrong.
+ */
+static int read_ethernet(unsigned addr, char *buf, unsigned size,
+			 const unsigned char *mac, unsigned progress)
+{
+	unsigned char frame[BURST_HEAD + ETH_BURST_DATA];
+	unsigned char have[(DUMP_FRAMES + 7) / 8];
+	unsigned frames = (size + ETH_BURST_DATA - 1) / ETH_BURST_DATA;
+	unsigned got = 0, seq, crc, n;
+	double deadline = metrics_now() + DUMP_TIMEOUT;
+	int c, len, i;
+
+	memset(have, 0, sizeof have);
+	target_sync();
+	put_char('S');
+	for (i = 0; i < 6; i++)
+		put_char(eth_mac()[i]);
+	put_word(addr);
+	put_word(size);
+	put_word(ETH_BURST_DATA);
+	serial_flush();
+
+	/* the CRC comes over serial once the last frame has gone */
+	while (1) {
+		if (got < frames &&
+		    (len = eth_read(frame, sizeof frame, mac, 2)) > 0) {
+			got += take_frame(frame, len, addr, buf, size, have);
+			continue;
+		}
+		if ((c = get_char_timeout(got < frames ? 0 : 10)) >= 0)
+			break;
+		if (metrics_now() > deadline) {
+			printf("\nNo reply to 'S' at 0x%08x\n", addr);
+			fail();
+		}
+	}
+	crc = c & 0xff;
+	crc |= get_char() << 8;
+	crc |= get_char() << 16;
+	crc |= get_char() << 24;
+	while (got < frames &&
+	       (len = eth_read(frame, sizeof frame, mac, 1)) > 0)
+		got += take_frame(frame, len, addr, buf, size, have);
+
+	for (seq = 0; seq < frames; seq++) {
+		if (have[seq / 8] & 1 << seq % 8)
+			continue;
+		frames_lost++;
+		n = min(size - seq * ETH_BURST_DATA, ETH_BURST_DATA);
+		read_serial(addr + seq * ETH_BURST_DATA,
+			    buf + seq * ETH_BURST_DATA, n, progress);
+	}
+	if (crc32(0, buf, size) != crc) {
+		printf("\nCRC error in the chunk at 0x%08x; reading it "
+		       "over serial\n", addr);
+		xfer_stats.failures++;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Map FILE.resume, starting afresh unless it's for this dump and FILE
+ * is still there, as big as it should be.
+ */
+static struct resume *open_resume(const char *filename, unsigned addr,
+				  unsigned len, unsigned chunks, int *resumed)
+{
+	struct stat st;
+	char name[4096];
+	struct resume *r;
+	size_t size = sizeof *r + (chunks + 7) / 8;
+	int fd;
+
+	snprintf(name, sizeof name, "%s.resume", filename);
+	if ((fd = open(name, O_RDWR | O_CREAT, 0666)) < 0 ||
+	    ftruncate(fd, size) < 0)
+		perror_exit(name);
+	r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (r == MAP_FAILED)
+		perror_exit(name);
+	xclose(fd);
+
+	*resumed = !memcmp(r->magic, resume_magic, sizeof r->magic) &&
+		r->addr == addr && r->len == len && r->chunk == DUMP_CHUNK &&
+		stat(filename, &st) == 0 && st.st_size == len;
+	if (!*resumed) {
+		memset(r, 0, size);
+		r->addr = addr;
+		r->len = len;
+		r->chunk = DUMP_CHUNK;
+		memcpy(r->magic, resume_magic, sizeof r->magic);
+	}
+	return r;
+}
+
+/*
+ * Read len bytes from addr on the target into filename.  With mac, the
+ * loader sends them over Ethernet from there.
+ */
+void dump_memory(unsigned addr, unsigned len, const char *filename,
+		 const unsigned char *mac)
+{
+	unsigned chunks = (len + DUMP_CHUNK - 1) / DUMP_CHUNK;
+	unsigned i, offset, n, done = 0, resumed_at;
+	struct resume *r;
+	char name[4096], *map, *buf;
+	int fd, resumed;
+
+	if (!len)
+		return;
+	r = open_resume(filename, addr, len, chunks, &resumed);
+	if ((fd = open(filename, O_RDWR | O_CREAT, 0666)) < 0)
+		perror_exit(filename);
+	/* emptied first, so that what's left of an old file is a hole */
+	if ((!resumed && ftruncate(fd, 0) < 0) || ftruncate(fd, len) < 0)
+		perror_exit(filename);
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		perror_exit(filename);
+	xclose(fd);
+
+	for (i = 0; i < chunks; i++)
+		if (r->done[i / 8] & 1 << i % 8)
+			done += min(len - i * DUMP_CHUNK, DUMP_CHUNK);
+	if (done)
+		printf("Resuming, with %u of %u bytes already in %s\n",
+		       done, len, filename);
+
+	buf = xmalloc(DUMP_CHUNK);
+	resumed_at = done;
+	metrics_object(len - resumed_at);
+	for (i = 0; i < chunks; i++) {
+		if (r->done[i / 8] & 1 << i % 8)
+			continue;
+		offset = i * DUMP_CHUNK;
+		n = min(len - offset, DUMP_CHUNK);
+		if (!mac || !read_ethernet(addr + offset, buf, n, mac,
+					   done - resumed_at))
+			read_serial(addr + offset, buf, n, done - resumed_at);
+		store(map + offset, buf, n);
+		r->done[i / 8] |= 1 << i % 8;
+		done += n;
+		metrics_progress(done - resumed_at);
+	}
+	metrics_object_end(done - resumed_at);
+	free(buf);
+
+	munmap(map, len);
+	munmap(r, sizeof *r + (chunks + 7) / 8);
+	snprintf(name, sizeof name, "%s.resume", filename);
+	unlink(name);
+	if (mac)
+		printf("Read %u bytes over Ethernet, %u over serial "
+		       "(%u frames lost)\n", eth_bytes, serial_bytes,
+		       frames_lost);
+}
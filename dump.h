@@ -0,0 +1,10 @@
+/*
+ * dump.h --	Reading target memory into a file.
+ */
+#ifndef _SHOEHORN_DUMP_H
+#define _SHOEHORN_DUMP_H
+
+extern void dump_memory(unsigned addr, unsigned len, const char *filename,
+			const unsigned char *mac);
+
+#endif /* _SHOEHORN_DUMP_H */
@@ -2,22 +2,50 @@
  * Copyright (c) 2000 Blue Mug, Inc.  All Rights Reserved.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <linux/filter.h>
 #include <linux/if_packet.h>
 #include <net/if.h>
 #include <netinet/ether.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "eth.h"
+#include "loader.h"
+#include "metrics.h"
+#include "record.h"
 #include "util.h"
 
+#define ETH_BATCH	64	/* frames per sendmmsg() */
+#define ETH_ZLEN	60	/* the shortest frame, without its CRC */
+
 static int sockfd = -1;
+static unsigned char localmac[6];
+
+/* only frames of our type: the socket is bound to it, but to be sure */
+static struct sock_filter type_filter[] = {
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_TYPE, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 0xffff),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static void attach(struct sock_filter *code, unsigned short len)
+{
+	struct sock_fprog prog = { len, code };
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER,
+		       &prog, sizeof prog) < 0)
+		perror_exit("setsockopt(SO_ATTACH_FILTER)");
+}
 
 /* open a socket for access to the local ethernet */
 void eth_open(const char *netif)
@@ -28,15 +56,22 @@ void eth_open(const char *netif)
 
 	assert(sockfd == -1);
 
-	/* open the socket */
-	sockfd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	/* open the socket, for our frame type only, so that the rest of
+	   the LAN's traffic doesn't wake us up */
+	sockfd = socket(PF_PACKET, SOCK_RAW, htons(ETH_TYPE));
 	if (sockfd < 0)
 		perror_exit("socket");
+	attach(type_filter, sizeof type_filter / sizeof *type_filter);
+#ifdef PACKET_IGNORE_OUTGOING
+	/* nor what we send ourselves; eth_read() checks, if this fails */
+	i = 1;
+	setsockopt(sockfd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &i, sizeof i);
+#endif
 
 	/* bind it to the local interface */
 	memset(&sa, 0, sizeof sa);
 	sa.sll_family   = AF_PACKET;
-	sa.sll_protocol = htons(ETH_P_ALL);
+	sa.sll_protocol = htons(ETH_TYPE);
 	sa.sll_ifindex  = if_nametoindex(netif);
 
 	/* bind socket to name (socket address) */
@@ -54,21 +89,108 @@ void eth_open(const char *netif)
 	}
 	printf("MAC address for %s is ", netif);
 	for (i=0; i<6; ++i) {
-		printf("%02X%c", ifr.ifr_hwaddr.sa_data[i] & 0xFF,
-			(i == 5) ? '\n' : ':');
+		localmac[i] = ifr.ifr_hwaddr.sa_data[i];
+		printf("%02X%c", localmac[i], (i == 5) ? '\n' : ':');
 	}
 
 }
 
-/* write onto the local ethernet */
-void eth_write(const void *buf, size_t count)
+/* our own MAC address, for the source of frames */
+const unsigned char *eth_mac(void)
 {
-	/* could just be an incomplete write, but with packet
-	   socket I imagine that's probably not a good thing. */
-	if (write(sockfd, buf, count) != count)
-		perror_exit("write");
+	return localmac;
+}
+
+/* from now on, only take frames from this address */
+void eth_filter(const unsigned char *from)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_TYPE, 0, 5),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned)from[0] << 24 |
+			 from[1] << 16 | from[2] << 8 | from[3], 0, 3),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 10),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, from[4] << 8 | from[5],
+			 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+
+	attach(code, sizeof code / sizeof *code);
+}
+
+/*
+ * Send n frames onto the local ethernet, as few system calls as it
+ * takes.  Each is gathered from its header and its data where they
+ * lie, so image data isn't copied, and padded to the shortest frame.
+ */
+void eth_send(const struct eth_frame *f, unsigned n)
+{
+	static const unsigned char pad[ETH_ZLEN];
+	struct mmsghdr msg[ETH_BATCH];
+	struct iovec iov[ETH_BATCH][3];
+	unsigned i, len, batch;
+	int sent;
+
+	while (n > 0) {
+		batch = min(n, ETH_BATCH);
+		memset(msg, 0, batch * sizeof *msg);
+		for (i = 0; i < batch; i++) {
+			len = f[i].headlen + f[i].datalen;
+			iov[i][0].iov_base = (void *)f[i].head;
+			iov[i][0].iov_len = f[i].headlen;
+			iov[i][1].iov_base = (void *)f[i].data;
+			iov[i][1].iov_len = f[i].datalen;
+			iov[i][2].iov_base = (void *)pad;
+			iov[i][2].iov_len = len < ETH_ZLEN ? ETH_ZLEN - len : 0;
+			msg[i].msg_hdr.msg_iov = iov[i];
+			msg[i].msg_hdr.msg_iovlen = 3;
+			recordv(REC_ETH, iov[i], 3);
+		}
+		for (i = 0; i < batch; i += sent)
+			if ((sent = sendmmsg(sockfd, msg + i, batch - i, 0)) < 0)
+				perror_exit("sendmmsg");
+		f += batch;
+		n -= batch;
+	}
 }
  
+/*
+ * Read a frame from the given address into buf, waiting up to msecs
+ * for it.  Returns its length, or 0 if none came.
+ */
+int eth_read(void *buf, size_t count, const unsigned char *from, int msecs)
+{
+	unsigned char *frame = buf;
+	struct sockaddr_ll sa;
+	struct pollfd pfd = { sockfd, POLLIN, 0 };
+	socklen_t salen;
+	double deadline = metrics_now() + msecs / 1000.0;
+	ssize_t n;
+	int wait;
+
+	while ((wait = (deadline - metrics_now()) * 1000) >= 0) {
+		if (poll(&pfd, 1, wait) < 0)
+			perror_exit("poll");
+		if (!pfd.revents)
+			continue;
+		salen = sizeof sa;
+		n = recvfrom(sockfd, buf, count, 0, (struct sockaddr *)&sa,
+			     &salen);
+		if (n < 0)
+			perror_exit("recvfrom");
+		/* a packet socket sees what we send, too */
+		if (sa.sll_pkttype == PACKET_OUTGOING || n < ETH_HEADER ||
+		    memcmp(frame + 6, from, 6) ||
+		    (frame[12] << 8 | frame[13]) != ETH_TYPE)
+			continue;
+		record(REC_ETH_RX, buf, n);
+		return n;
+	}
+	return 0;
+}
+
 /* close ethernet socket */
 void eth_close(void)
 {
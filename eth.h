@@ -4,8 +4,20 @@
 #ifndef _SHOEHORN_ETH_H
 #define _SHOEHORN_ETH_H
 
+/* a frame to send: a header, then data, each where it lies */
+struct eth_frame {
+	const void	*head;
+	unsigned	headlen;
+	const void	*data;
+	unsigned	datalen;
+};
+
 extern void eth_open(const char *netif);
-extern void eth_write(const void *buf, size_t count);
+extern void eth_filter(const unsigned char *from);
+extern void eth_send(const struct eth_frame *f, unsigned n);
+extern int eth_read(void *buf, size_t count, const unsigned char *from,
+		    int msecs);
+extern const unsigned char *eth_mac(void);
 extern void eth_close(void);
 
 #endif /* _SHOEHORN_ETH_H */
@@ -0,0 +1,69 @@
+/*
+ * fill.c --	Find runs of a repeated pattern in an image.
+ *
+ * Ramdisks and padded kernels are mostly long runs of zeros, and
+ * sending them byte by byte is a waste of the serial link.  We split
+ * a buffer into literal segments, sent as usual, and fill segments,
+ * which the loader writes itself from a single pattern word.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fill.h"
+#include "util.h"
+
+/* length of the run with period 4 at the start of p */
+static unsigned run_length(const char *p, unsigned size)
+{
+	unsigned n = 4;
+
+	if (size < 4)
+		return size;
+	while (n < size && p[n] == p[n - 4])
+		n++;
+	return n;
+}
+
+static struct segment *add_segment(struct segment *seg, unsigned *count,
+				   unsigned offset, unsigned size, int fill)
+{
+	/* grow in powers of 2 */
+	if ((*count & (*count - 1)) == 0)
+		seg = realloc(seg, (*count ? *count * 2 : 1) * sizeof *seg);
+	if (!seg)
+		perror_exit("realloc");
+	seg[*count].offset = offset;
+	seg[*count].size = size;
+	seg[*count].fill = fill;
+	++*count;
+	return seg;
+}
+
+/*
+ * Split buf into literal and fill segments, returning a malloced
+ * array of *count segments which covers the buffer in order.
+ */
+struct segment *fill_scan(const char *buf, unsigned size, unsigned *count)
+{
+	struct segment *seg = NULL;
+	unsigned lit = 0, i = 0, run;
+
+	*count = 0;
+	while (i + FILL_MINRUN <= size) {
+		run = run_length(buf + i, size - i);
+		if (run < FILL_MINRUN) {
+			/* no longer run can start inside this one */
+			i += run > 7 ? run - 3 : 4;
+			continue;
+		}
+		if (i > lit)
+			seg = add_segment(seg, count, lit, i - lit, 0);
+		seg = add_segment(seg, count, i, run, 1);
+		i += run;
+		lit = i;
+	}
+	if (size > lit || *count == 0)
+		seg = add_segment(seg, count, lit, size - lit, 0);
+	return seg;
+}
@@ -0,0 +1,25 @@
+/*
+ * fill.h --	Find runs of a repeated pattern in an image.
+ */
+#ifndef _SHOEHORN_FILL_H
+#define _SHOEHORN_FILL_H
+
+/*
+ * Runs of a repeated 4-byte pattern at least this long are filled in
+ * by the loader ('F') instead of being sent.  Anything shorter isn't
+ * worth the round trip: the host has to wait for each fill to finish
+ * before sending more.
+ */
+#define FILL_MINRUN	1024
+
+/* a piece of an image, either to be sent or filled */
+struct segment {
+	unsigned	offset;		/* within the buffer */
+	unsigned	size;
+	int		fill;		/* repeats the 4 bytes at offset */
+};
+
+extern struct segment *fill_scan(const char *buf, unsigned size,
+				 unsigned *count);
+
+#endif /* _SHOEHORN_FILL_H */
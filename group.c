@@ -0,0 +1,256 @@
+/*
+ * group.c --	Sending images once, to a group of boards.
+ *
+ * With --ethernet and several ports, each image goes out once, as a
+ * stream of frames to the broadcast address or the --group multicast
+ * address, and every board's loader takes the frames ('G') in any
+ * order.  At the end of a round each board is asked over its own
+ * serial line which frames it lacks ('m'); the next round is the frames
+ * any of them lacks ('N'), until none does.  So the time on the wire
+ * hardly depends on how many boards there are.
+ *
+ * The boards meet in board_gather() before each round, and the one
+ * chosen sends it, at the targets' 10 Mbit/s: a switch would only drop
+ * what a faster host sent any faster.  The others wait for it to have
+ * set the round up before they go on, since when a board leaves the
+ * group they may be let go first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "eth.h"
+#include "group.h"
+#include "loader.h"
+#include "metrics.h"
+#include "serial.h"
+#include "util.h"
+
+#define GROUP_RATE	10e6	/* bits/s, the targets' link */
+#define GROUP_SLACK	0.5	/* seconds, on top of the wire time */
+#define GROUP_BATCH	16	/* frames handed over at once */
+#define BURST_HEAD	(ETH_HEADER + sizeof(struct eth_burst))
+#define WIRE_EXTRA	24	/* CRC, preamble and gap, in bytes */
+
+unsigned char group_mac[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+/* the group burst under way, shared by the boards */
+static struct {
+	unsigned	addr;
+	const char	*buf;
+	unsigned	size;
+	unsigned	frames;
+	unsigned	crc;
+	unsigned char	*missing;	/* a bit per frame some board lacks */
+	double		deadline;	/* for the round to be all there */
+	int		finished;
+	unsigned	led;		/* gatherings set up by their leader */
+} group;
+
+static __thread unsigned gathered;	/* this board's gatherings */
+
+
+/*
+ * Meet the others.  Returns 1 on the board that is to set things up,
+ * and on the others once it has, with led().
+ */
+static int gather(void)
+{
+	gathered++;
+	if (board_gather())
+		return 1;
+	while (group.led < gathered)
+		board_sleep(1);
+	return 0;
+}
+
+static void led(void)
+{
+	group.led = gathered;
+}
+
+static int is_missing(unsigned seq)
+{
+	return group.missing[seq / 8] & 1 << seq % 8;
+}
+
+static void set_header(unsigned char *head, unsigned seq, unsigned len)
+{
+	memcpy(head, group_mac, 6);
+	memcpy(head + 6, eth_mac(), 6);
+	head[12] = ETH_TYPE >> 8;
+	head[13] = ETH_TYPE & 0xff;
+	put_le(head + ETH_HEADER, group.addr);
+	put_le(head + ETH_HEADER + 4, seq);
+	put_le(head + ETH_HEADER + 8, len);
+}
+
+/* send the frames some board lacks, and the end of the round */
+static void send_round(unsigned round)
+{
+	unsigned char head[GROUP_BATCH][BURST_HEAD];
+	struct eth_frame frame[GROUP_BATCH];
+	unsigned seq, n = 0, count = 0;
+	double start = metrics_now(), wire = 0;
+	int ms;
+
+	for (seq = 0; seq < group.frames; seq++)
+		count += is_missing(seq) != 0;
+	group.deadline = start + GROUP_SLACK + (count + 1) *
+		(BURST_HEAD + ETH_BURST_DATA + WIRE_EXTRA) * 8 / GROUP_RATE;
+	led();
+	if (round)
+		xfer_stats.retries += count;
+
+	for (seq = 0; seq <= group.frames; seq++) {
+		if (seq < group.frames && !is_missing(seq))
+			continue;
+		frame[n].head = head[n];
+		frame[n].headlen = BURST_HEAD;
+		if (seq < group.frames) {
+			frame[n].data = group.buf + seq * ETH_BURST_DATA;
+			frame[n].datalen = min(group.size - seq * ETH_BURST_DATA,
+					       ETH_BURST_DATA);
+			set_header(head[n], seq, frame[n].datalen);
+		} else {
+			frame[n].data = NULL;
+			frame[n].datalen = 0;
+			set_header(head[n], ETH_GROUP_END, round);
+		}
+		xfer_stats.blocks++;
+		xfer_stats.bytes += frame[n].datalen;
+		wire += (BURST_HEAD + frame[n].datalen + WIRE_EXTRA) * 8 /
+			GROUP_RATE;
+		if (++n < GROUP_BATCH && seq < group.frames)
+			continue;
+		eth_send(frame, n);
+		n = 0;
+		/* no faster than the targets take them */
+		ms = (start + wire - metrics_now()) * 1000;
+		if (ms > 0)
+			board_sleep(ms);
+	}
+	memset(group.missing, 0, (group.frames + 7) / 8);
+}
+
+static void expect(unsigned char want)
+{
+	unsigned char c;
+
+	if ((c = get_char()) != want) {
+		printf("Group burst: got %02x, not '%c'\n", c, want);
+		fail();
+	}
+}
+
+/*
+ * Ask the loader which frames it has, and add the ones it lacks to the
+ * round after next.  Returns how many it lacks.
+ */
+static unsigned report(void)
+{
+	unsigned char have[ETH_GROUP_FRAMES / 8];
+	unsigned missing, i, crc;
+	int c;
+
+	put_char('m');
+	/* the end of the round may come just as we ask anyway */
+	if ((c = get_char()) == '.')
+		c = get_char();
+	if (c != '=') {
+		printf("Group burst: got %02x, not '='\n", c);
+		fail();
+	}
+	if (!(missing = get_word())) {
+		crc = get_word();
+		if (crc != group.crc) {
+			printf("\nGroup burst CRC error at 0x%08x\n",
+			       group.addr);
+			fail();
+		}
+		return 0;
+	}
+	for (i = 0; i < (group.frames + 7) / 8; i++)
+		have[i] = get_char();
+	for (i = 0; i < group.frames; i++)
+		if (!(have[i / 8] & 1 << i % 8))
+			group.missing[i / 8] |= 1 << i % 8;
+	return missing;
+}
+
+/*
+ * Write buf to addr on this board along with the rest of the group.
+ * Returns 0, and leaves the group, if the others aren't writing the
+ * same thing now; send it some other way then.
+ */
+int group_write(unsigned addr, const char *buf, unsigned size,
+		unsigned progress)
+{
+	unsigned frames = (size + ETH_BURST_DATA - 1) / ETH_BURST_DATA;
+	unsigned round = 0, missing = frames;
+	int ms, c;
+
+	if (frames > ETH_GROUP_FRAMES) {
+		board_ungroup();
+		return 0;
+	}
+	if (gather()) {
+		group.addr = addr;
+		group.buf = buf;
+		group.size = size;
+		group.frames = frames;
+		group.crc = crc32(0, buf, size);
+		free(group.missing);
+		group.missing = xmalloc((frames + 7) / 8);
+		memset(group.missing, 0xff, (frames + 7) / 8);
+		group.finished = 0;
+		led();
+	}
+	if (group.addr != addr || group.buf != buf || group.size != size) {
+		printf("The group is writing something else; leaving it\n");
+		board_ungroup();
+		return 0;
+	}
+
+	put_char('G');
+	put_word(addr);
+	put_word(size);
+	put_word(ETH_BURST_DATA);
+	expect('+');
+	while (1) {
+		if (gather()) {
+			group.finished = 1;
+			for (c = 0; c < (frames + 7) / 8; c++)
+				if (group.missing[c])
+					group.finished = 0;
+			if (group.finished)
+				led();
+			else
+				send_round(round);
+		}
+		if (group.finished)
+			break;
+		round++;
+		if (!missing)
+			continue;
+
+		/* till the end of the round, or when it should have come */
+		ms = (group.deadline - metrics_now()) * 1000;
+		if ((c = get_char_timeout(ms > 0 ? ms : 0)) >= 0 && c != '.') {
+			printf("Group burst: got %02x, not '.'\n", c);
+			fail();
+		}
+		missing = report();
+		metrics_progress(progress + min((frames - missing) *
+						ETH_BURST_DATA, size));
+		if (missing) {
+			put_char('N');
+			put_word(round);
+			expect('+');
+		}
+	}
+	xfer_stats.payload += size;
+	return 1;
+}
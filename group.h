@@ -0,0 +1,12 @@
+/*
+ * group.h --	Sending images once, to a group of boards.
+ */
+#ifndef _SHOEHORN_GROUP_H
+#define _SHOEHORN_GROUP_H
+
+extern unsigned char group_mac[6];
+
+extern int group_write(unsigned addr, const char *buf, unsigned size,
+		       unsigned progress);
+
+#endif /* _SHOEHORN_GROUP_H */
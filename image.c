@@ -0,0 +1,207 @@
+/*
+ * image.c --	Kernel and initrd images, mapped or streamed.
+ *
+ * A regular file is mapped rather than read into a buffer, so it takes
+ * no memory of its own and the kernel reads it in as we send it.
+ * Anything else (a pipe, or "-" for stdin) is read by a thread into a
+ * small ring of chunks, so the transfer starts with the first chunk
+ * and memory use doesn't grow with the image.  Either way images are
+ * padded to an even size for the Ethernet loader.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "util.h"
+
+static void *image_reader(void *arg)
+{
+	struct image *img = arg;
+	unsigned char *chunk;
+	unsigned len;
+	ssize_t n;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&img->lock);
+		while (img->filled - img->used == IMAGE_CHUNKS)
+			pthread_cond_wait(&img->cond, &img->lock);
+		chunk = img->chunk[img->filled % IMAGE_CHUNKS];
+		pthread_mutex_unlock(&img->lock);
+
+		for (len = 0; len < IMAGE_CHUNKSIZE; len += n) {
+			n = xread(img->fd, chunk + len, IMAGE_CHUNKSIZE - len);
+			if (n == 0)
+				break;
+		}
+		if (len & 1)
+			chunk[len++] = 0;
+
+		pthread_mutex_lock(&img->lock);
+		if (len) {
+			i = img->filled++ % IMAGE_CHUNKS;
+			img->len[i] = len;
+			img->size += len;
+		}
+		img->eof = len < IMAGE_CHUNKSIZE;
+		pthread_cond_broadcast(&img->cond);
+		pthread_mutex_unlock(&img->lock);
+		if (img->eof)
+			return NULL;
+	}
+}
+
+/* copy files in as they're mapped; for a daemon, which keeps them */
+int image_snapshot;
+
+/*
+ * Map size bytes of fd, or return MAP_FAILED.  With image_snapshot
+ * they are read into memory of our own instead, so that what we have
+ * isn't changed, or taken away, by the file being rewritten in place.
+ */
+void *image_map(int fd, unsigned size)
+{
+	unsigned char *map;
+	unsigned done;
+	ssize_t n;
+
+	if (!image_snapshot)
+		return mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return map;
+	for (done = 0; done < size; done += n) {
+		if ((n = pread(fd, map + done, size - done, done)) <= 0) {
+			if (n == 0)
+				errno = EIO;	/* it got shorter */
+			munmap(map, size);
+			return MAP_FAILED;
+		}
+	}
+	mprotect(map, size, PROT_READ);
+	return map;
+}
+
+/* say why img couldn't be opened, and let go of it */
+static struct image *failed(struct image *img)
+{
+	perror_msg(img->name);
+	if (img->fd >= 0)
+		close(img->fd);
+	free(img);
+	return NULL;
+}
+
+/*
+ * Map a file, or start reading it if it can't be mapped.  Returns
+ * NULL, having said why, if it can't be opened.
+ */
+struct image *image_open(const char *filename)
+{
+	struct image *img = xmalloc(sizeof *img);
+	struct stat st;
+	int i;
+
+	memset(img, 0, sizeof *img);
+	img->name = filename;
+	if (strcmp(filename, "-") == 0)
+		img->fd = dup(0);
+	else
+		img->fd = open(filename, O_RDONLY);
+	if (img->fd < 0 || fstat(img->fd, &st) < 0)
+		return failed(img);
+
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		img->size = st.st_size;
+		/* an odd size isn't a multiple of the page size, so the
+		   mapping has a zero byte to spare */
+		img->map = image_map(img->fd, img->size);
+		if (img->map == MAP_FAILED)
+			return failed(img);
+		madvise(img->map, img->size, MADV_SEQUENTIAL);
+		printf("%s: %d bytes\n", filename, img->size);
+		if (img->size & 1)
+			img->size += 1;
+		return img;
+	}
+
+	img->streamed = 1;
+	for (i = 0; i < IMAGE_CHUNKS; i++)
+		img->chunk[i] = xmalloc(IMAGE_CHUNKSIZE);
+	pthread_mutex_init(&img->lock, NULL);
+	pthread_cond_init(&img->cond, NULL);
+	if (pthread_create(&img->reader, NULL, image_reader, img) != 0)
+		perror_exit("pthread_create");
+	printf("%s: streaming\n", filename);
+	return img;
+}
+
+/* an image that is part of a mapping kept by someone else (a bundle) */
+struct image *image_mapped(const char *name, unsigned char *map,
+			   unsigned size)
+{
+	struct image *img = xmalloc(sizeof *img);
+
+	memset(img, 0, sizeof *img);
+	img->name = name;
+	img->fd = -1;
+	img->map = map;
+	img->size = size;
+	return img;
+}
+
+/*
+ * Point *data at the next piece of the image, returning its size, or
+ * 0 at the end.  A streamed piece is only valid until the next call.
+ */
+unsigned image_next(struct image *img, const char **data)
+{
+	unsigned len;
+
+	if (!img->streamed) {
+		len = img->size - img->offset;
+		*data = (const char *)img->map + img->offset;
+		img->offset += len;
+		return len;
+	}
+
+	pthread_mutex_lock(&img->lock);
+	if (img->offset && img->used < img->filled) {
+		/* done with the last one */
+		img->len[img->used++ % IMAGE_CHUNKS] = 0;
+		pthread_cond_broadcast(&img->cond);
+	}
+	while (img->used == img->filled && !img->eof)
+		pthread_cond_wait(&img->cond, &img->lock);
+	len = img->used == img->filled ? 0 : img->len[img->used % IMAGE_CHUNKS];
+	*data = (const char *)img->chunk[img->used % IMAGE_CHUNKS];
+	img->offset += len;
+	pthread_mutex_unlock(&img->lock);
+	return len;
+}
+
+void image_close(struct image *img)
+{
+	int i;
+
+	if (img->streamed) {
+		pthread_join(img->reader, NULL);
+		for (i = 0; i < IMAGE_CHUNKS; i++)
+			free(img->chunk[i]);
+		pthread_mutex_destroy(&img->lock);
+		pthread_cond_destroy(&img->cond);
+	} else if (img->fd >= 0) {
+		munmap(img->map, img->size);
+	}
+	if (img->fd >= 0)
+		xclose(img->fd);
+	free(img);
+}
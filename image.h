@@ -0,0 +1,39 @@
+/*
+ * image.h --	Kernel and initrd images, mapped or streamed.
+ */
+#ifndef _SHOEHORN_IMAGE_H
+#define _SHOEHORN_IMAGE_H
+
+#include <pthread.h>
+
+#define IMAGE_CHUNKSIZE	0x100000	/* streamed in pieces this big */
+#define IMAGE_CHUNKS	4		/* read ahead at most this many */
+
+struct image {
+	const char	*name;
+	int		fd;		/* -1: mapped by someone else */
+	unsigned	size;		/* so far, if streamed */
+	int		streamed;	/* not a regular file */
+	unsigned char	*map;		/* regular file: all of it */
+	unsigned	offset;		/* next byte for image_next() */
+
+	/* streamed: a ring of chunks filled by a reader thread */
+	pthread_t	reader;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned char	*chunk[IMAGE_CHUNKS];
+	unsigned	len[IMAGE_CHUNKS];	/* 0: free */
+	unsigned	filled, used;		/* free-running chunk counts */
+	int		eof;
+};
+
+extern int image_snapshot;
+
+extern void *image_map(int fd, unsigned size);
+extern struct image *image_open(const char *filename);
+extern struct image *image_mapped(const char *name, unsigned char *map,
+				  unsigned size);
+extern unsigned image_next(struct image *img, const char **data);
+extern void image_close(struct image *img);
+
+#endif /* _SHOEHORN_IMAGE_H */
@@ -5,11 +5,19 @@
 #include "ep7211.h"
 
 #define IO_START	0x80000000
+#define IO_SIZE		0x4000		/* internal registers */
 
 #define IO(offset)	(IO_START + (offset))
 
+#ifdef SIM
+/* loader-sim: register accesses go through the UART model in sim.c */
+extern volatile void *sim_io(unsigned offset);
+#define IO_BYTE(offset)	(*(volatile unsigned char *)sim_io(offset))
+#define IO_WORD(offset)	(*(volatile unsigned *)sim_io(offset))
+#else
 #define IO_BYTE(offset)	(*(volatile unsigned char *)(IO_START + (offset)))
 #define IO_WORD(offset)	(*(volatile unsigned long *)(IO_START + (offset)))
+#endif
 
 #define IO_PADR		IO_BYTE(PADR)
 #define IO_PBDR		IO_BYTE(PBDR)
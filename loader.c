@@ -10,6 +10,13 @@
  * this code in bootstrap mode.  All the board specifics can be handled on
  * the host.
  *
+ * The same source, compiled with STAGE2 defined, is the stage 2 loader.
+ * The SRAM loader writes it into DRAM once DRAM has been detected and
+ * calls it.  Stage 2 has room for things that don't fit in 2kB of SRAM,
+ * such as decompression, and reports what it can do with 'v' (the SRAM
+ * loader answers '?' like any unknown command).  Its first argument
+ * tells it whether the PhatBox 8051 has already been set up.
+ *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation; either version 2 of the License, or
@@ -25,17 +32,33 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include "cs8900.h"
 #include "ioregs.h"
+#include "loader.h"
+#include "lz.h"
 
 #define DRAM_START	((unsigned *)0xc0000000)
 #define DRAM_END	((unsigned *)0xe0000000)
-#define STEP_BYTES	(256*1024)
-#define STEP_WORDS	(STEP_BYTES / 4)
 #define PATTERN		0x12345678
 
+#ifdef STAGE2
+#define CAPABILITIES	(CAP_LZ | CAP_WINDOW | CAP_FILL | CAP_HASH | CAP_ETH | \
+			 CAP_GROUP | CAP_SEND)
+
+/* CRC-32 (as in zlib) of the data written by the current command */
+static unsigned crc_table[256];
+static unsigned crc;
+#define crc_update(b)	(crc = crc_table[(crc ^ (b)) & 0xff] ^ (crc >> 8))
+#else
+#define crc_update(b)
+#endif
+
 
 extern void flush_v3(void);
 extern void flush_v4(void);
+#ifdef SIM
+extern void sim_call(unsigned addr, int r0, int r1, int r2, int r3);
+#endif
 
 int init=1;
 
@@ -101,18 +124,21 @@ static void put_word(unsigned w)
 /*
  * This is a destructive test for DRAM, which is safe because this program
  * runs entirely from internal SRAM.  First we detect the width of the DRAM,
- * which is reported by writing a single byte value of 16 or 32.  This is
- * followed by the compiled-in step size for scanning, which is 256kB.
+ * which is reported by writing a single byte value of 16 or 32.
  * 
- * We start at the end of the DRAM space and work backwards in 256kB steps,
- * writing the address of each block into its first word.  Then we scan
- * forward looking for blocks which contain their own address.  These are
- * the unique blocks of physical memory, which we report with word addresses.
+ * We start at the end of the DRAM space and work backwards in steps of
+ * the granularity the host asks for, writing the address of each block
+ * into its first word.  Then we scan forward looking for blocks which
+ * contain their own address.  These are the unique blocks of physical
+ * memory, which we report as runs: start address and size in bytes.
  * The list is terminated with a zero address.
+ *
+ * Received:	granularity, a power of two
  */
 static void detect_dram(void)
 {
-	volatile unsigned *p;
+	volatile unsigned *p, *run = 0;
+	unsigned step = get_word() / 4;
 
 	IO_SYSCON2 &= ~DRAMSZ;		/* 32-bit wide */
 	
@@ -125,19 +151,28 @@ static void detect_dram(void)
 	} else {
 		put_char(32);
 	}
-	put_word(STEP_BYTES);
 	
 	p = DRAM_END;
 	while (p > DRAM_START) {
-		p -= STEP_WORDS;
+		p -= step;
 		*p = (unsigned)p;
 	}
 	/* p == DRAM_START */
-	while (p < DRAM_END) {
+	for (; p < DRAM_END; p += step) {
 		if (*p == (unsigned)p) {
-			put_word((unsigned)p);
+			if (!run)
+				run = p;
+			continue;
 		}
-		p+= STEP_WORDS;
+		if (run) {
+			put_word((unsigned)run);
+			put_word((unsigned)p - (unsigned)run);
+			run = 0;
+		}
+	}
+	if (run) {
+		put_word((unsigned)run);
+		put_word((unsigned)DRAM_END - (unsigned)run);
 	}
 	put_word(0);
 }
@@ -164,6 +199,20 @@ static void read_block(void)
 }
 
 
+/* receive length bytes into memory at p, returning their sum */
+static unsigned char receive_block(unsigned char *p, unsigned length)
+{
+	unsigned char checksum = 0;
+
+	while (length--) {
+		*p = get_char();
+		checksum += *p;
+		crc_update(*p);
+		p++;
+	}
+	return checksum;
+}
+
 /*
  * Received:	start address
  *		length
@@ -172,18 +221,594 @@ static void read_block(void)
  * Transmitted:	checksum byte (sum of received data)
  */
 static void write_block(void)
+{
+	unsigned char *p = (unsigned char*) get_word();
+	unsigned length = get_word();
+
+	put_char(receive_block(p, length));
+}
+
+/*
+ * Received:	table entries of (size, address, mask, value),
+ *		terminated by a zero size byte
+ *
+ * Transmitted:	'+' once the whole table has been applied
+ *
+ * Each entry does *address = (*address & ~mask) | value as a byte or
+ * word access, in table order.  A mask of all ones skips the read, so
+ * write-only registers can be set this way too.
+ */
+static void apply_table(void)
+{
+	unsigned char size;
+	unsigned addr, mask, value;
+
+	while ((size = get_char()) != 0) {
+		addr = get_word();
+		mask = get_word();
+		value = get_word();
+		if (size == 1) {
+			volatile unsigned char *b = (unsigned char *)addr;
+			if (mask != ~0)
+				value |= *b & ~mask;
+			*b = value;
+		} else {
+			volatile unsigned *w = (unsigned *)addr;
+			if (mask != ~0)
+				value |= *w & ~mask;
+			*w = value;
+		}
+	}
+	put_char('+');
+}
+
+#ifdef STAGE2
+static unsigned get_length(unsigned n)
+{
+	unsigned char c;
+
+	if (n == 15) {
+		do {
+			c = get_char();
+			n += c;
+		} while (c == 255);
+	}
+	return n;
+}
+
+/*
+ * Decode an LZ stream (see lz.h) straight into memory at p, until
+ * length bytes have been produced; returns their sum.
+ */
+static unsigned char receive_lz(unsigned char *p, unsigned length)
 {
 	unsigned char checksum = 0;
+	unsigned char *end = p + length;
+	unsigned char *q;
+	unsigned token, n;
+
+	while (p < end) {
+		token = get_char();
+		n = get_length(token >> 4);
+		while (n--) {
+			*p = get_char();
+			checksum += *p;
+			crc_update(*p);
+			p++;
+		}
+		if (p >= end)
+			break;
+		q = p - get_char();
+		q -= get_char() << 8;
+		n = get_length(token & 15) + LZ_MINMATCH;
+		while (n--) {
+			*p = *q++;
+			checksum += *p;
+			crc_update(*p);
+			p++;
+		}
+	}
+	return checksum;
+}
+
+/*
+ * Received:	start address
+ *		length (uncompressed)
+ *		LZ stream
+ *
+ * Transmitted:	checksum byte (sum of decoded data)
+ */
+static void write_lz(void)
+{
 	unsigned char *p = (unsigned char*) get_word();
 	unsigned length = get_word();
 
+	put_char(receive_lz(p, length));
+}
+
+/*
+ * Fill length bytes at p with the bytes of pattern, lowest first,
+ * over and over; returns their sum.
+ */
+static unsigned char fill_block(unsigned char *p, unsigned length,
+				unsigned pattern)
+{
+	unsigned char checksum = 0;
+
 	while (length--) {
-		*p = get_char();
-		checksum += *p++;
+		*p = pattern;
+		pattern = pattern >> 8 | pattern << 24;
+		checksum += *p;
+		crc_update(*p);
+		p++;
 	}
-	put_char(checksum);
+	return checksum;
+}
+
+/*
+ * Received:	start address
+ *		length
+ *		pattern word
+ *
+ * Transmitted:	checksum byte (sum of filled data)
+ */
+static void write_fill(void)
+{
+	unsigned char *p = (unsigned char*) get_word();
+	unsigned length = get_word();
+
+	put_char(fill_block(p, length, get_word()));
+}
+
+/*
+ * Received:	sequence number byte
+ *		type byte ('W' plain data, 'Z' LZ stream or 'F' pattern)
+ *		start address
+ *		length (uncompressed)
+ *		data (pattern word for 'F')
+ *
+ * Transmitted:	sequence number byte
+ *		CRC-32 word of written data
+ *
+ * The host keeps several of these in flight without waiting for each
+ * reply, and uses the sequence number to match replies to blocks.
+ * A block whose CRC doesn't match is simply sent again.  We don't
+ * read the UART while filling, so the host must wait for the reply
+ * to an 'F' frame before sending anything else.
+ */
+static void write_frame(void)
+{
+	unsigned char seq = get_char();
+	unsigned char type = get_char();
+	unsigned char *p = (unsigned char*) get_word();
+	unsigned length = get_word();
+
+	crc = ~0;
+	if (type == 'Z')
+		receive_lz(p, length);
+	else if (type == 'F')
+		fill_block(p, length, get_word());
+	else
+		receive_block(p, length);
+	put_char(seq);
+	put_word(~crc);
+}
+
+/*
+ * Received:	start address
+ *		length
+ *		page size
+ *
+ * Transmitted:	CRC-32 word of each page (the last may be short)
+ *
+ * The host compares these with its own image and only sends the pages
+ * that differ.
+ */
+static void hash_pages(void)
+{
+	unsigned char *p = (unsigned char*) get_word();
+	unsigned length = get_word();
+	unsigned size = get_word();
+	unsigned n;
+
+	while (length > 0) {
+		n = length < size ? length : size;
+		length -= n;
+		crc = ~0;
+		while (n--) {
+			crc_update(*p);
+			p++;
+		}
+		put_word(~crc);
+	}
+}
+
+static unsigned get_le(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+
+static void put_le(unsigned char *p, unsigned w)
+{
+	p[0] = w;
+	p[1] = w >> 8;
+	p[2] = w >> 16;
+	p[3] = w >> 24;
+}
+
+/*
+ * The CS8900A, polled.  It keeps a few received frames itself, so we
+ * only have to keep up with the wire on average.
+ */
+static unsigned char eth_mac[6];
+
+/*
+ * The length of the next received frame, ready to be read, or 0.  The
+ * ISQ is one bus read where the PacketPage RxEvent would be two.
+ */
+static unsigned eth_poll(void)
+{
+	unsigned event = CS8900_ISQ;
+
+	if ((event & ISQ_EventMask) != ISQ_RxEvent || !(event & PP_RER_RxOK))
+		return 0;
+	(void)CS8900_RTDATA;		/* its status, again */
+	return CS8900_RTDATA & 0xffff;
+}
+
+/* read n bytes of the frame into p; an odd n takes a byte extra */
+static void eth_read(unsigned char *p, unsigned n)
+{
+	unsigned w;
+
+	while (n > 1) {
+		w = CS8900_RTDATA;
+		*p++ = w;
+		*p++ = w >> 8;
+		n -= 2;
+	}
+	if (n)
+		*p = CS8900_RTDATA;
+}
+
+/* throw away the next n bytes of the frame */
+static void eth_skip(unsigned n)
+{
+	for (n = (n + 1) / 2; n > 0; n--)
+		(void)CS8900_RTDATA;
+}
+
+/* throw away the rest of a frame we don't want, without reading it */
+static void eth_discard(void)
+{
+	put_reg(PP_RxCFG, PP_RxCFG_RxOK | PP_RxCFG_Skip1);
+}
+
+/* send a frame of head, which is of even length, then n bytes of data */
+static void eth_send(const unsigned char *head, unsigned headlen,
+		     const unsigned char *data, unsigned n)
+{
+	CS8900_TxCMD = PP_TxCmd_TxStart_Full;
+	CS8900_TxLEN = headlen + n;
+	while (!(get_reg(PP_BusSTAT) & PP_BusSTAT_TxRDY))
+		;
+	for (; headlen > 1; headlen -= 2, head += 2)
+		CS8900_RTDATA = head[0] | head[1] << 8;
+	for (; n > 1; n -= 2, data += 2)
+		CS8900_RTDATA = data[0] | data[1] << 8;
+	if (n)
+		CS8900_RTDATA = data[0];
 }
 
+/* the headers, Ethernet and burst, of a frame of ours for to */
+static void eth_header(unsigned char *f, const unsigned char *to,
+		       unsigned addr, unsigned seq, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < 6; i++) {
+		f[i] = to[i];
+		f[6 + i] = eth_mac[i];
+	}
+	f[12] = ETH_TYPE >> 8;
+	f[13] = ETH_TYPE & 0xff;
+	put_le(f + ETH_HEADER, addr);
+	put_le(f + ETH_HEADER + 4, seq);
+	put_le(f + ETH_HEADER + 8, len);
+}
+
+/*
+ * Transmitted:	self status halfword
+ *		'+' and the MAC address, or '-' if there's no CS8900
+ *
+ * Resets the chip and starts it receiving frames for its own address
+ * and broadcasts.
+ */
+static void eth_init(void)
+{
+	unsigned i, w;
+
+	put_reg(PP_SelfCTL, PP_SelfCTL_Reset);
+	for (i = 0; i < 0x100000; i++)
+		if (get_reg(PP_SelfSTAT) & PP_SelfSTAT_InitD)
+			break;
+	w = get_reg(PP_SelfSTAT);
+	put_char(w);
+	put_char(w >> 8);
+	if (get_reg(PP_ChipID) != 0x630e) {
+		put_char('-');
+		return;
+	}
+	for (i = 0; i < 6; i += 2) {
+		w = get_reg(PP_IA + i);
+		eth_mac[i] = w;
+		eth_mac[i + 1] = w >> 8;
+	}
+	/* RxEvents in the ISQ, for eth_poll() */
+	put_reg(PP_RxCFG, PP_RxCFG_RxOK);
+	/* every multicast address, for group bursts */
+	for (i = 0; i < 8; i += 2)
+		put_reg(PP_LAF + i, 0xffff);
+	put_reg(PP_RxCTL, PP_RxCTL_RxOK | PP_RxCTL_IA | PP_RxCTL_Broadcast |
+		PP_RxCTL_Multicast);
+	put_reg(PP_LineCTL, PP_LineCTL_Rx | PP_LineCTL_Tx);
+	put_char('+');
+	for (i = 0; i < 6; i++)
+		put_char(eth_mac[i]);
+}
+
+/*
+ * Received:	MAC address
+ *
+ * Transmitted:	MAC address, as the chip now has it
+ */
+static void eth_set_mac(void)
+{
+	unsigned i, w;
+
+	for (i = 0; i < 6; i++)
+		eth_mac[i] = get_char();
+	for (i = 0; i < 6; i += 2)
+		put_reg(PP_IA + i, eth_mac[i] | eth_mac[i + 1] << 8);
+	for (i = 0; i < 6; i += 2) {
+		w = get_reg(PP_IA + i);
+		put_char(w);
+		put_char(w >> 8);
+	}
+}
+
+/* ask the host at to for frame next of the burst at addr */
+static void eth_ack(const unsigned char *to, unsigned addr, unsigned next)
+{
+	unsigned char f[ETH_HEADER + sizeof(struct eth_burst)];
+
+	eth_header(f, to, addr, next, 0);
+	eth_send(f, sizeof f, 0, 0);
+}
+
+/*
+ * Received:	start address
+ *		length
+ *		data bytes per frame
+ *		then, over Ethernet, the frames (see loader.h)
+ *
+ * Transmitted:	over Ethernet, the number of the next frame wanted
+ *		then CRC-32 word of written data, once it's all there
+ *
+ * Only the frame asked for next is taken, so a lost frame costs the
+ * host going back to it, and the data is written in order.
+ */
+static void eth_burst(void)
+{
+	unsigned char hdr[ETH_HEADER + sizeof(struct eth_burst)];
+	unsigned char *p = (unsigned char*) get_word();
+	unsigned length = get_word();
+	unsigned step = get_word();
+	unsigned frames = (length + step - 1) / step;
+	unsigned next = 0, len, seq, n;
+	unsigned char *q;
+
+	crc = ~0;
+	while (next < frames) {
+		if (!(len = eth_poll()))
+			continue;
+		if (len < sizeof hdr) {
+			eth_discard();
+			continue;
+		}
+		eth_read(hdr, sizeof hdr);
+		len -= sizeof hdr;
+		if (hdr[12] != ETH_TYPE >> 8 || hdr[13] != (ETH_TYPE & 0xff)) {
+			eth_discard();
+			continue;
+		}
+		/* one left over from an earlier burst is no use */
+		if (get_le(hdr + ETH_HEADER) != (unsigned)p) {
+			eth_discard();
+			continue;
+		}
+		seq = get_le(hdr + ETH_HEADER + 4);
+		n = get_le(hdr + ETH_HEADER + 8);
+		if (seq != next || n > len ||
+		    n != (length - seq * step < step ? length - seq * step
+						     : step)) {
+			eth_discard();
+			eth_ack(hdr + 6, (unsigned)p, next);
+			continue;
+		}
+		q = p + seq * step;
+		eth_read(q, n);
+		eth_skip(len - n - (n & 1));
+		while (n--) {
+			crc_update(*q);
+			q++;
+		}
+		if (++next % ETH_ACK_EVERY == 0 || next == frames)
+			eth_ack(hdr + 6, (unsigned)p, next);
+	}
+	put_word(~crc);
+}
+
+/*
+ * Received:	destination MAC address
+ *		start address
+ *		length
+ *		data bytes per frame
+ *
+ * Transmitted:	over Ethernet, the block as frames like the host's 'B'
+ *		ones, without waiting for acks
+ *		then CRC-32 word of the block
+ *
+ * The host reads back over the serial line whatever frames it lost.
+ */
+static void eth_upload(void)
+{
+	unsigned char hdr[ETH_HEADER + sizeof(struct eth_burst)];
+	unsigned char to[6];
+	unsigned char *p, *q;
+	unsigned length, step, seq, n, i;
+
+	for (i = 0; i < 6; i++)
+		to[i] = get_char();
+	p = (unsigned char*) get_word();
+	length = get_word();
+	step = get_word();
+
+	crc = ~0;
+	for (seq = 0; seq * step < length; seq++) {
+		q = p + seq * step;
+		n = length - seq * step < step ? length - seq * step : step;
+		eth_header(hdr, to, (unsigned)p, seq, n);
+		eth_send(hdr, sizeof hdr, q, n);
+		for (i = 0; i < n; i++)
+			crc_update(q[i]);
+	}
+	put_word(~crc);
+}
+
+static unsigned char group_map[ETH_GROUP_FRAMES / 8];	/* frames we have */
+static unsigned char *group_p;
+static unsigned group_length, group_step, group_frames, group_round;
+
+/*
+ * Take frames of the group burst until the round's end, or until
+ * the host says something.
+ *
+ * Transmitted:	'+' when ready for them
+ *		'.' at the end of the round
+ */
+static void group_receive(void)
+{
+	unsigned char hdr[ETH_HEADER + sizeof(struct eth_burst)];
+	unsigned len, seq, n;
+
+	put_char('+');
+	while (IO_SYSFLG1 & URXFE1) {
+		if (!(len = eth_poll()))
+			continue;
+		if (len < sizeof hdr) {
+			eth_discard();
+			continue;
+		}
+		eth_read(hdr, sizeof hdr);
+		len -= sizeof hdr;
+		seq = get_le(hdr + ETH_HEADER + 4);
+		n = get_le(hdr + ETH_HEADER + 8);
+		if (hdr[12] != ETH_TYPE >> 8 || hdr[13] != (ETH_TYPE & 0xff) ||
+		    get_le(hdr + ETH_HEADER) != (unsigned)group_p) {
+			eth_discard();
+			continue;
+		}
+		if (seq == ETH_GROUP_END && n == group_round) {
+			eth_discard();
+			put_char('.');
+			return;
+		}
+		if (seq >= group_frames || group_map[seq / 8] & 1 << seq % 8 ||
+		    n > len || n != (group_length - seq * group_step < group_step
+				     ? group_length - seq * group_step
+				     : group_step)) {
+			eth_discard();
+			continue;
+		}
+		eth_read(group_p + seq * group_step, n);
+		eth_skip(len - n - (n & 1));
+		group_map[seq / 8] |= 1 << seq % 8;
+	}
+}
+
+/*
+ * Received:	start address
+ *		length
+ *		data bytes per frame
+ *
+ * Starts a group burst with nothing received.
+ */
+static void group_start(void)
+{
+	unsigned i;
+
+	group_p = (unsigned char*) get_word();
+	group_length = get_word();
+	group_step = get_word();
+	group_frames = (group_length + group_step - 1) / group_step;
+	group_round = 0;
+	for (i = 0; i < sizeof group_map; i++)
+		group_map[i] = 0;
+	group_receive();
+}
+
+/*
+ * Received:	round
+ *
+ * Goes on with the group burst, for the frames sent again.
+ */
+static void group_resume(void)
+{
+	group_round = get_word();
+	group_receive();
+}
+
+/*
+ * Transmitted:	'='
+ *		number of frames missing
+ *		then a bit per frame, set if we have it, if any are missing
+ *		or the CRC-32 word of the burst, if none are
+ */
+static void group_report(void)
+{
+	unsigned char *p;
+	unsigned i, missing = 0;
+
+	for (i = 0; i < group_frames; i++)
+		if (!(group_map[i / 8] & 1 << i % 8))
+			missing++;
+	put_char('=');
+	put_word(missing);
+	if (missing) {
+		for (i = 0; i < (group_frames + 7) / 8; i++)
+			put_char(group_map[i]);
+		return;
+	}
+	crc = ~0;
+	for (p = group_p; p < group_p + group_length; p++)
+		crc_update(*p);
+	put_word(~crc);
+}
+
+static void crc_init(void)
+{
+	unsigned c, n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+}
+#endif /* STAGE2 */
+
 int flush_8051()
 {
 	char i=0;
@@ -269,7 +894,7 @@ int init_8051(void)
 
 
 int
-cmain(void)
+cmain(int init8051)
 {
 	void (*code)(int r0, int r1, int r2, int r3);
 
@@ -277,9 +902,14 @@ cmain(void)
 	volatile unsigned *w;
 	volatile unsigned char *b;
 
+#ifdef STAGE2
+	init = !init8051;
+	crc_init();
+#endif
 
 	while (1) {
-		if (init==0) {
+		/* not while the host is streaming, the FIFO would overflow */
+		if (init==0 && (IO_SYSFLG1 & URXFE1)) {
 			if (flush_8051())
 				put_char2(0xce);
 			write_8051(0x70);
@@ -306,10 +936,14 @@ cmain(void)
 			r2 = get_word();
 			r3 = get_word();
 			drain();
+#ifdef SIM
+			sim_call((unsigned)code, r0, r1, r2, r3);
+#else
 			code(r0, r1, r2, r3);
+#endif
 			break;
 		
-		case 'd':	/* Detect DRAM */
+		case 'D':	/* Detect DRAM (granularity) */
 			detect_dram();
 			break;
 		
@@ -348,6 +982,61 @@ cmain(void)
 			write_block();
 			break;
 
+#ifdef STAGE2
+		case 'v':	/* Version: report capabilities */
+			put_char('V');
+			put_word(CAPABILITIES);
+			break;
+
+		case 'Z':	/* Write compressed block */
+			write_lz();
+			break;
+
+		case 'F':	/* Fill block with pattern */
+			write_fill();
+			break;
+
+		case 'P':	/* Write block, pipelined */
+			write_frame();
+			break;
+
+		case 'H':	/* Hash pages */
+			hash_pages();
+			break;
+
+		case 'e':	/* Set up Ethernet */
+			eth_init();
+			break;
+
+		case 'M':	/* Set MAC address */
+			eth_set_mac();
+			break;
+
+		case 'B':	/* Write blocks, over Ethernet */
+			eth_burst();
+			break;
+
+		case 'S':	/* Send block, over Ethernet */
+			eth_upload();
+			break;
+
+		case 'G':	/* Start a group burst */
+			group_start();
+			break;
+
+		case 'N':	/* Next round of the group burst */
+			group_resume();
+			break;
+
+		case 'm':	/* Report missing frames */
+			group_report();
+			break;
+#endif
+
+		case 'T':	/* Apply register table */
+			apply_table();
+			break;
+
 		default:
 			put_char('?');
 			break;
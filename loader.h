@@ -0,0 +1,53 @@
+/*
+ * loader.h --	Definitions shared by the loaders and the host.
+ */
+#ifndef _SHOEHORN_LOADER_H
+#define _SHOEHORN_LOADER_H
+
+/*
+ * The stage 2 loader is linked to run from DRAM here, below the
+ * kernel at KERNEL_OFFSET, with its stack at the top of the area.
+ * Keep the Makefile's STAGE2_START in step.
+ */
+#define STAGE2_START	0xc0010000
+#define STAGE2_SIZE	0x00020000
+#define STAGE2_STACK	0x00001000	/* reserved for the stack */
+
+/* capability bits reported by the 'v' command */
+#define CAP_LZ		0x00000001	/* 'Z' compressed blocks */
+#define CAP_WINDOW	0x00000002	/* 'P' pipelined blocks */
+#define CAP_FILL	0x00000004	/* 'F' pattern fills */
+#define CAP_HASH	0x00000008	/* 'H' page hashes */
+#define CAP_ETH		0x00000010	/* CS8900 'e', 'M' and 'B' bursts */
+#define CAP_GROUP	0x00000020	/* 'G', 'N' and 'm' group bursts */
+#define CAP_SEND	0x00000040	/* 'S' blocks sent over Ethernet */
+
+/*
+ * Ethernet bursts ('B').  Frames both ways are of type ETH_TYPE and
+ * start with a struct eth_burst after the Ethernet header.  The host's
+ * carry up to ETH_BURST_DATA bytes each and are numbered from 0; the
+ * loader's ask for the next frame it wants, after every ETH_ACK_EVERY
+ * frames, the last, and any frame out of order.  A block the loader
+ * sends ('S') comes as frames like the host's, and nobody acks them.
+ */
+#define ETH_TYPE	0xabba
+#define ETH_HEADER	14		/* destination, source, type */
+#define ETH_BURST_DATA	1488		/* for 1514 byte frames, the most */
+#define ETH_ACK_EVERY	4
+
+/*
+ * Group bursts ('G') go to many boards at once, so nobody acks them.
+ * The frames are as for 'B', and are taken in any order; each round of
+ * them ends with a frame numbered ETH_GROUP_END whose len is the round.
+ */
+#define ETH_GROUP_END	0xffffffff
+#define ETH_GROUP_FRAMES 16384		/* the most in a group burst */
+
+struct eth_burst {
+	unsigned	addr;		/* where the burst starts; little-endian,
+					   like the serial words */
+	unsigned	seq;
+	unsigned	len;		/* data bytes in this frame */
+};
+
+#endif /* _SHOEHORN_LOADER_H */
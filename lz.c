@@ -0,0 +1,91 @@
+/*
+ * lz.c --	Host-side LZ77 compressor for compressed block transfers.
+ *
+ * This is a plain greedy compressor with a single-entry hash table of
+ * 4-byte sequences: fast enough to keep well ahead of a serial link,
+ * and producing a format simple enough for the loader to decode
+ * straight from the UART into DRAM.  See lz.h for the format.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "lz.h"
+#include "util.h"
+
+#define HASH_BITS	12
+
+static unsigned hash(const unsigned char *p)
+{
+	unsigned v;
+
+	memcpy(&v, p, sizeof v);
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* append a length nibble's extension bytes */
+static unsigned char *put_length(unsigned char *op, unsigned n)
+{
+	if (n < 15)
+		return op;
+	for (n -= 15; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+/*
+ * Compress size bytes at src into dst.  Returns the compressed size,
+ * or 0 if it wouldn't fit in dstsize bytes.
+ */
+unsigned lz_compress(const unsigned char *src, unsigned size,
+		     unsigned char *dst, unsigned dstsize)
+{
+	unsigned table[1 << HASH_BITS];
+	const unsigned char *ip = src, *anchor = src, *end = src + size;
+	const unsigned char *ref = src;
+	unsigned char *op = dst, *dend = dst + dstsize;
+	unsigned h, lits, len;
+
+	memset(table, 0, sizeof table);	/* positions + 1, 0 is empty */
+	while (1) {
+		len = 0;
+		if (ip + LZ_MINMATCH <= end) {
+			h = hash(ip);
+			ref = src + table[h] - 1;
+			if (table[h] && ip - ref <= LZ_MAXOFFSET &&
+			    !memcmp(ref, ip, LZ_MINMATCH)) {
+				len = LZ_MINMATCH;
+				while (ip + len < end && len < LZ_MAXMATCH &&
+				       ref[len] == ip[len])
+					len++;
+			}
+			table[h] = ip - src + 1;
+			if (!len) {
+				ip++;
+				continue;
+			}
+		} else if (anchor == end) {
+			break;
+		}
+
+		/* token, literals, and (unless this is the end) a match */
+		lits = (len ? ip : end) - anchor;
+		if (op + 1 + lits / 255 + 1 + lits + 2 + 1 > dend)
+			return 0;
+		*op++ = (min(lits, 15) << 4) |
+			(len ? min(len - LZ_MINMATCH, 15) : 0);
+		op = put_length(op, lits);
+		memcpy(op, anchor, lits);
+		op += lits;
+		if (!len)
+			break;
+		*op++ = (ip - ref);
+		*op++ = (ip - ref) >> 8;
+		op = put_length(op, len - LZ_MINMATCH);
+
+		ip += len;
+		anchor = ip;
+	}
+	return op - dst;
+}
@@ -0,0 +1,29 @@
+/*
+ * lz.h --	LZ77 codec used for compressed block transfers.
+ */
+#ifndef _SHOEHORN_LZ_H
+#define _SHOEHORN_LZ_H
+
+/*
+ * Stream format, decoded by write_lz() in loader.c:
+ *
+ * A sequence of (token, [literal length], literals, offset, [match
+ * length]).  The token's high nibble is the literal count and its low
+ * nibble the match length minus LZ_MINMATCH; a nibble of 15 is followed
+ * by bytes added to it, up to and including the first one below 255.
+ * The offset is two bytes, little-endian, counted back from the current
+ * output position.  The decoder knows the output size and stops as
+ * soon as it is reached, so the last sequence may end after its
+ * literals.
+ *
+ * Matches are capped at LZ_MAXMATCH bytes so the loader never spends
+ * long enough copying one to let its 16-byte UART FIFO overflow.
+ */
+#define LZ_MINMATCH	4
+#define LZ_MAXMATCH	256
+#define LZ_MAXOFFSET	0xffff
+
+extern unsigned lz_compress(const unsigned char *src, unsigned size,
+			    unsigned char *dst, unsigned dstsize);
+
+#endif /* _SHOEHORN_LZ_H */
@@ -0,0 +1,264 @@
+/*
+ * metrics.c --	Transfer timing, progress and the --stats summary.
+ *
+ * We keep the wall time of each phase of the boot, the line rate it
+ * ran at and a histogram of block round trips (from queueing a block
+ * to reading the loader's reply).  The progress line is redrawn at
+ * most METRICS_INTERVAL apart, with an ETA when the size of what we're
+ * sending is known.  With --stats, a JSON summary is written when we
+ * exit, whether or not the boot got as far as starting the kernel.
+ *
+ * With several boards all of this is kept for each (see board.c).
+ * Their progress is printed as whole lines, METRICS_LINE_INTERVAL
+ * apart, and each board's summary goes to FILE.<port>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "board.h"
+#include "metrics.h"
+#include "record.h"
+#include "serial.h"
+#include "util.h"
+
+#define METRICS_INTERVAL	0.25	/* seconds between progress lines */
+#define METRICS_LINE_INTERVAL	5.0	/* the same, with several boards */
+#define RTT_BUCKETS		24	/* powers of 2 microseconds */
+
+static const char *phase_names[NR_PHASES] = {
+	"wait", "loader", "init", "dram", "stage2",
+	"kernel", "initrd", "params", "verify", "boot",
+};
+
+static const char *stats_file;
+static const char *stats_version;
+static __thread int completed;
+
+static __thread double start_time;
+static __thread int cur_phase = -1;
+static __thread double phase_start;
+static __thread double phase_time[NR_PHASES];
+static __thread double phase_capacity[NR_PHASES];	/* line rate * time */
+static __thread unsigned phase_payload[NR_PHASES];
+static __thread unsigned line_rate = 960;		/* bytes/s at 9600 8N1 */
+
+static __thread unsigned rtt_hist[RTT_BUCKETS];
+static __thread unsigned rtt_count;
+static __thread double rtt_sum, rtt_min, rtt_max;
+
+static __thread unsigned object_size;
+static __thread double object_start, last_progress;
+static __thread unsigned object_bytes;			/* xfer_stats.bytes then */
+
+double metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* close the books on the current phase and start another */
+void metrics_phase(enum phase phase)
+{
+	static __thread unsigned payload;
+	double now = metrics_now();
+
+	if (!start_time)
+		start_time = now;
+	if (cur_phase >= 0) {
+		phase_time[cur_phase] += now - phase_start;
+		phase_capacity[cur_phase] += (now - phase_start) * line_rate;
+		phase_payload[cur_phase] += xfer_stats.payload - payload;
+	}
+	payload = xfer_stats.payload;
+	if (phase != cur_phase)
+		record(REC_PHASE, phase_names[phase], strlen(phase_names[phase]));
+	cur_phase = phase;
+	phase_start = now;
+}
+
+/* the kernel has been started */
+void metrics_done(void)
+{
+	if (cur_phase >= 0)
+		metrics_phase(cur_phase);
+	cur_phase = -1;
+	completed = 1;
+}
+
+/* the serial line now runs at bps (8N1) */
+void metrics_line_rate(unsigned bps)
+{
+	enum phase phase = cur_phase;
+
+	/* account for the time at the old rate */
+	if (cur_phase >= 0)
+		metrics_phase(phase);
+	line_rate = bps / 10;
+}
+
+/* a reply has arrived for a block queued at start */
+void metrics_rtt(double start)
+{
+	double rtt = metrics_now() - start;
+	unsigned usecs = rtt * 1e6;
+	int i;
+
+	for (i = 0; i < RTT_BUCKETS - 1 && usecs >= 1U << i; i++)
+		;
+	rtt_hist[i]++;
+	if (!rtt_count || rtt < rtt_min)
+		rtt_min = rtt;
+	if (!rtt_count || rtt > rtt_max)
+		rtt_max = rtt;
+	rtt_sum += rtt;
+	rtt_count++;
+}
+
+/* start sending something of size bytes (0 if not known) */
+void metrics_object(unsigned size)
+{
+	object_size = size;
+	object_start = metrics_now();
+	last_progress = 0;
+	object_bytes = xfer_stats.bytes;
+}
+
+static void print_progress(unsigned done, double now, int final)
+{
+	char line[80];
+	double elapsed = now - object_start;
+	double rate = elapsed > 0 ? done / elapsed : 0;
+	unsigned eta;
+	int n;
+
+	n = snprintf(line, sizeof line, "0x%08x", done);
+	if (final) {
+		snprintf(line + n, sizeof line - n,
+			 " (%u bytes moved) %.1fs, %.1f kB/s",
+			 xfer_stats.bytes - object_bytes, elapsed,
+			 rate / 1024);
+	} else if (object_size && done < object_size && rate > 0) {
+		eta = (object_size - done) / rate;
+		snprintf(line + n, sizeof line - n,
+			 " %3u%% %.1f kB/s, ETA %u:%02u",
+			 (unsigned)(done * 100.0 / object_size), rate / 1024,
+			 eta / 60, eta % 60);
+	} else {
+		snprintf(line + n, sizeof line - n, " %.1f kB/s",
+			 rate / 1024);
+	}
+	if (board_multi)
+		printf("%s\n", line);
+	else
+		printf("\r%-50s%s", line, final ? "\n" : "");
+	fflush(stdout);
+}
+
+/* done bytes of the current object are on the target */
+void metrics_progress(unsigned done)
+{
+	double now = metrics_now();
+
+	if (now - last_progress <
+	    (board_multi ? METRICS_LINE_INTERVAL : METRICS_INTERVAL))
+		return;
+	last_progress = now;
+	print_progress(done, now, 0);
+}
+
+void metrics_object_end(unsigned done)
+{
+	print_progress(done, metrics_now(), 1);
+}
+
+static void write_stats(void)
+{
+	FILE *f;
+	double transfer = 0, capacity = 0;
+	unsigned payload = 0;
+	int i, last;
+	char name[256];
+	const char *filename = stats_file;
+
+	if (!filename)
+		return;
+	if (board_name()) {
+		snprintf(name, sizeof name, "%s.%s", stats_file, board_name());
+		filename = name;
+	}
+
+	if (cur_phase >= 0)
+		metrics_phase(cur_phase);
+	for (i = PHASE_KERNEL; i <= PHASE_PARAMS; i++) {
+		transfer += phase_time[i];
+		capacity += phase_capacity[i];
+		payload += phase_payload[i];
+	}
+
+	f = fopen(filename, "w");
+	if (!f) {
+		perror(filename);
+		return;
+	}
+	fprintf(f, "{\n");
+	fprintf(f, "  \"version\": \"%s\",\n", stats_version);
+	fprintf(f, "  \"completed\": %s,\n", completed ? "true" : "false");
+	fprintf(f, "  \"wall_time\": %.6f,\n",
+		start_time ? metrics_now() - start_time : 0);
+	fprintf(f, "  \"phases\": {");
+	for (i = 0; i < NR_PHASES; i++)
+		fprintf(f, "%s\n    \"%s\": %.6f", i ? "," : "",
+			phase_names[i], phase_time[i]);
+	fprintf(f, "\n  },\n");
+	fprintf(f, "  \"blocks\": %u,\n", xfer_stats.blocks);
+	fprintf(f, "  \"bytes_sent\": %u,\n", xfer_stats.bytes);
+	fprintf(f, "  \"payload_bytes\": %u,\n", xfer_stats.payload);
+	fprintf(f, "  \"failures\": %u,\n", xfer_stats.failures);
+	fprintf(f, "  \"retries\": %u,\n", xfer_stats.retries);
+	/* over the kernel, initrd and params phases */
+	fprintf(f, "  \"goodput\": %.1f,\n",
+		transfer > 0 ? payload / transfer : 0);
+	fprintf(f, "  \"line_rate\": %.1f,\n",
+		transfer > 0 ? capacity / transfer : 0);
+	fprintf(f, "  \"goodput_ratio\": %.3f,\n",
+		capacity > 0 ? payload / capacity : 0);
+	fprintf(f, "  \"rtt\": {\n");
+	fprintf(f, "    \"count\": %u,\n", rtt_count);
+	fprintf(f, "    \"min\": %.6f,\n", rtt_min);
+	fprintf(f, "    \"mean\": %.6f,\n",
+		rtt_count ? rtt_sum / rtt_count : 0);
+	fprintf(f, "    \"max\": %.6f,\n", rtt_max);
+	fprintf(f, "    \"histogram_us\": [");
+	for (last = RTT_BUCKETS - 1; last > 0 && !rtt_hist[last]; last--)
+		;
+	for (i = 0; i <= last; i++) {
+		fprintf(f, "%s\n      { \"below\": ", i ? "," : "");
+		if (i < RTT_BUCKETS - 1)
+			fprintf(f, "%u", 1U << i);
+		else
+			fprintf(f, "null");	/* the rest */
+		fprintf(f, ", \"count\": %u }", rtt_hist[i]);
+	}
+	fprintf(f, "\n    ]\n  }\n}\n");
+	fclose(f);
+}
+
+/* write a JSON summary to filename when we exit */
+void metrics_open(const char *filename, const char *version)
+{
+	stats_file = filename;
+	stats_version = version;
+	if (!board_multi)
+		atexit(write_stats);
+}
+
+/* a board of several is done with, one way or the other */
+void metrics_close(void)
+{
+	write_stats();
+}
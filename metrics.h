@@ -0,0 +1,34 @@
+/*
+ * metrics.h --	Transfer timing, progress and the --stats summary.
+ */
+#ifndef _SHOEHORN_METRICS_H
+#define _SHOEHORN_METRICS_H
+
+/* what we're busy with, for per-phase wall times */
+enum phase {
+	PHASE_WAIT,		/* for the target to wake up */
+	PHASE_LOADER,		/* SRAM loader upload */
+	PHASE_INIT,		/* board init */
+	PHASE_DRAM,		/* DRAM detection */
+	PHASE_STAGE2,		/* stage 2 loader upload */
+	PHASE_KERNEL,
+	PHASE_INITRD,
+	PHASE_PARAMS,
+	PHASE_VERIFY,		/* --verify read-back */
+	PHASE_BOOT,		/* board teardown, starting the kernel */
+	NR_PHASES
+};
+
+extern void metrics_open(const char *filename, const char *version);
+extern void metrics_close(void);
+extern void metrics_phase(enum phase phase);
+extern void metrics_done(void);
+extern void metrics_line_rate(unsigned bps);
+extern void metrics_rtt(double start);
+extern double metrics_now(void);
+
+extern void metrics_object(unsigned size);
+extern void metrics_progress(unsigned done);
+extern void metrics_object_end(unsigned done);
+
+#endif /* _SHOEHORN_METRICS_H */
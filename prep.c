@@ -0,0 +1,167 @@
+/*
+ * prep.c --	Work done once on images that are sent again and again.
+ *
+ * A resident shoehorn sends the same kernel and initrd to board after
+ * board, so when it loads them it splits them into fill and literal
+ * segments, compresses the literal ones and hashes their pages, and
+ * keeps the results.  The transfer code asks here first, and only
+ * does the work itself for a buffer that wasn't prepared as it is
+ * (a piece of an image split across DRAM fragments, say).  A bundle
+ * keeps the results in a file, so a boot from it needn't do the work.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "prep.h"
+#include "util.h"
+
+struct prep {
+	const char		*buf;
+	unsigned		size;
+	struct segment		*seg;	/* from fill_scan() */
+	unsigned		count;
+	struct chunk_list	**chunks; /* per literal segment */
+	unsigned		*hashes; /* per DELTA_PAGESIZE page */
+	struct prep		*next;
+};
+
+static struct prep *preps;
+
+
+/* split, compress and hash buf, for the transfer code to find later */
+void prep_image(const char *buf, unsigned size)
+{
+	struct prep *p = xmalloc(sizeof *p);
+	unsigned pages = (size + DELTA_PAGESIZE - 1) / DELTA_PAGESIZE;
+	unsigned i;
+
+	p->buf = buf;
+	p->size = size;
+	p->seg = fill_scan(buf, size, &p->count);
+	p->chunks = xmalloc(p->count * sizeof *p->chunks);
+	for (i = 0; i < p->count; i++) {
+		p->chunks[i] = NULL;
+		if (p->seg[i].fill)
+			continue;
+		p->chunks[i] = compress_start((const unsigned char *)buf +
+					      p->seg[i].offset,
+					      p->seg[i].size);
+		compress_keep(p->chunks[i]);
+	}
+	p->hashes = xmalloc(pages * sizeof *p->hashes);
+	for (i = 0; i < pages; i++)
+		p->hashes[i] = crc32(0, buf + i * DELTA_PAGESIZE,
+				     min(size - i * DELTA_PAGESIZE,
+					 DELTA_PAGESIZE));
+	p->next = preps;
+	preps = p;
+}
+
+/*
+ * Take what prep_image() found out about buf some other time: count
+ * segments, chunks (malloced, with a list per literal segment) and
+ * the page hashes.  seg and hashes are copied.
+ */
+void prep_add(const char *buf, unsigned size, const struct segment *seg,
+	      unsigned count, struct chunk_list **chunks,
+	      const unsigned *hashes)
+{
+	struct prep *p = xmalloc(sizeof *p);
+	unsigned pages = (size + DELTA_PAGESIZE - 1) / DELTA_PAGESIZE;
+
+	p->buf = buf;
+	p->size = size;
+	p->seg = xmalloc(count * sizeof *p->seg);
+	memcpy(p->seg, seg, count * sizeof *p->seg);
+	p->count = count;
+	p->chunks = chunks;
+	p->hashes = xmalloc(pages * sizeof *p->hashes);
+	memcpy(p->hashes, hashes, pages * sizeof *p->hashes);
+	p->next = preps;
+	preps = p;
+}
+
+/* buf is going away */
+void prep_forget(const char *buf)
+{
+	struct prep **pp, *p;
+	unsigned i;
+
+	for (pp = &preps; (p = *pp) != NULL; pp = &p->next) {
+		if (p->buf != buf)
+			continue;
+		*pp = p->next;
+		for (i = 0; i < p->count; i++)
+			if (p->chunks[i])
+				compress_drop(p->chunks[i]);
+		free(p->chunks);
+		free(p->seg);
+		free(p->hashes);
+		free(p);
+		return;
+	}
+}
+
+/* fill_scan(buf, size, count), if it has been done */
+struct segment *prep_segments(const char *buf, unsigned size,
+			      unsigned *count)
+{
+	struct segment *seg;
+	struct prep *p;
+
+	for (p = preps; p; p = p->next) {
+		if (p->buf != buf || p->size != size)
+			continue;
+		seg = xmalloc(p->count * sizeof *seg);
+		memcpy(seg, p->seg, p->count * sizeof *seg);
+		*count = p->count;
+		return seg;
+	}
+	return NULL;
+}
+
+/*
+ * The compressed chunks of a literal segment, if it has been done.
+ * compress_finish() leaves them alone.
+ */
+struct chunk_list *prep_chunks(const char *buf, unsigned size)
+{
+	struct prep *p;
+	unsigned i;
+
+	for (p = preps; p; p = p->next) {
+		if (buf < p->buf || buf >= p->buf + p->size)
+			continue;
+		for (i = 0; i < p->count; i++)
+			if (p->chunks[i] && p->buf + p->seg[i].offset == buf &&
+			    p->seg[i].size == size)
+				return p->chunks[i];
+	}
+	return NULL;
+}
+
+/*
+ * Put the hashes of buf's pages in hashes, if they are known: buf
+ * must start on a page of a prepared image, and end on one or with it.
+ */
+int prep_hashes(const char *buf, unsigned size, unsigned *hashes)
+{
+	struct prep *p;
+	unsigned offset;
+
+	for (p = preps; p; p = p->next) {
+		if (buf < p->buf || buf + size > p->buf + p->size)
+			continue;
+		offset = buf - p->buf;
+		if (offset % DELTA_PAGESIZE || (size % DELTA_PAGESIZE &&
+						offset + size != p->size))
+			continue;
+		memcpy(hashes, p->hashes + offset / DELTA_PAGESIZE,
+		       (size + DELTA_PAGESIZE - 1) / DELTA_PAGESIZE *
+		       sizeof *hashes);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * prep.h --	Work done once on images that are sent again and again.
+ */
+#ifndef _SHOEHORN_PREP_H
+#define _SHOEHORN_PREP_H
+
+#include "compress.h"
+#include "fill.h"
+
+extern void prep_image(const char *buf, unsigned size);
+extern void prep_add(const char *buf, unsigned size,
+		     const struct segment *seg, unsigned count,
+		     struct chunk_list **chunks, const unsigned *hashes);
+extern void prep_forget(const char *buf);
+extern struct segment *prep_segments(const char *buf, unsigned size,
+				     unsigned *count);
+extern struct chunk_list *prep_chunks(const char *buf, unsigned size);
+extern int prep_hashes(const char *buf, unsigned size, unsigned *hashes);
+
+#endif /* _SHOEHORN_PREP_H */
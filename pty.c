@@ -0,0 +1,70 @@
+/*
+ * pty.c --	Pseudo-terminals standing in for a target's serial port,
+ *		for loader-sim and shoehorn-replay.
+ *
+ * The host (shoehorn --port) opens the slave side; whether it has it
+ * open shows as POLLHUP on the master, which we use in place of the
+ * target's Wakeup button.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "pty.h"
+#include "util.h"
+
+/*
+ * Returns the master side, non-blocking.  If link is given it is made
+ * a symlink to the slave, so a fixed --port can be used.
+ */
+int pty_open(const char *link, char **name)
+{
+	struct termios t;
+	int master, slave;
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+	    grantpt(master) < 0 || unlockpt(master) < 0)
+		perror_exit("pty");
+	*name = ptsname(master);
+
+	/* raw, so the host's bytes come through untouched */
+	if ((slave = open(*name, O_RDWR | O_NOCTTY)) < 0)
+		perror_exit(*name);
+	tcgetattr(slave, &t);
+	cfmakeraw(&t);
+	tcsetattr(slave, TCSANOW, &t);
+	xclose(slave);
+	fcntl(master, F_SETFL, O_NONBLOCK);
+
+	if (link) {
+		unlink(link);
+		if (symlink(*name, link) < 0)
+			perror_exit(link);
+	}
+	return master;
+}
+
+int pty_host_open(int master)
+{
+	struct pollfd pfd = { master, POLLIN, 0 };
+
+	return poll(&pfd, 1, 0) >= 0 && !(pfd.revents & POLLHUP);
+}
+
+/*
+ * Wait for the last host to go and the next one to open the port,
+ * then give it msecs to set the port up, as a person would.
+ */
+void pty_wait_host(int master, int msecs)
+{
+	while (pty_host_open(master))
+		usleep(50000);
+	while (!pty_host_open(master))
+		usleep(50000);
+	usleep(msecs * 1000);
+	tcflush(master, TCIFLUSH);
+}
@@ -0,0 +1,11 @@
+/*
+ * pty.h --	Pseudo-terminals standing in for a target's serial port.
+ */
+#ifndef _SHOEHORN_PTY_H
+#define _SHOEHORN_PTY_H
+
+extern int pty_open(const char *link, char **name);
+extern int pty_host_open(int master);
+extern void pty_wait_host(int master, int msecs);
+
+#endif /* _SHOEHORN_PTY_H */
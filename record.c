@@ -0,0 +1,61 @@
+/*
+ * record.c --	Record a session with the target, for shoehorn-replay.
+ *
+ * With --record, every byte handed to the serial port or read from
+ * it, every Ethernet frame, baud change and phase is written to a file
+ * with the time since we started.  Transmitted data is timed when it
+ * is queued, received data when we read it, so the gaps show what the
+ * host spent and what it waited for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "record.h"
+#include "util.h"
+
+static FILE *record_file;
+static struct timespec record_start;
+
+void record_open(const char *filename)
+{
+	if (!(record_file = fopen(filename, "w")))
+		perror_exit(filename);
+	setvbuf(record_file, NULL, _IOFBF, 0x10000);
+	fputs(RECORD_MAGIC, record_file);
+	clock_gettime(CLOCK_MONOTONIC, &record_start);
+}
+
+/* one record, of the pieces in iov put together */
+void recordv(int type, const struct iovec *iov, int iovcnt)
+{
+	struct record_hdr hdr;
+	struct timespec now;
+	int i;
+
+	if (!record_file)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	memset(&hdr, 0, sizeof hdr);
+	hdr.usecs = (now.tv_sec - record_start.tv_sec) * 1000000LL +
+		(now.tv_nsec - record_start.tv_nsec) / 1000;
+	for (i = 0; i < iovcnt; i++)
+		hdr.len += iov[i].iov_len;
+	hdr.type = type;
+	if (fwrite(&hdr, sizeof hdr, 1, record_file) != 1)
+		perror_exit("record");
+	for (i = 0; i < iovcnt; i++)
+		if (iov[i].iov_len && fwrite(iov[i].iov_base, iov[i].iov_len,
+					     1, record_file) != 1)
+			perror_exit("record");
+}
+
+void record(int type, const void *buf, unsigned len)
+{
+	struct iovec iov = { (void *)buf, len };
+
+	recordv(type, &iov, 1);
+}
@@ -0,0 +1,34 @@
+/*
+ * record.h --	Session recordings, for --record and shoehorn-replay.
+ *
+ * A recording is RECORD_MAGIC followed by records, each a struct
+ * record_hdr and len bytes of data, in host byte order.
+ */
+#ifndef _SHOEHORN_RECORD_H
+#define _SHOEHORN_RECORD_H
+
+#include <stdint.h>
+
+#define RECORD_MAGIC	"shoehorn recording 1\n"
+
+#define REC_TX		'T'	/* serial, host to target */
+#define REC_RX		'R'	/* serial, target to host */
+#define REC_ETH		'E'	/* Ethernet frame sent */
+#define REC_ETH_RX	'e'	/* Ethernet frame received */
+#define REC_BAUD	'B'	/* line rate changed: uint32_t bits/s */
+#define REC_PHASE	'P'	/* boot phase started: its name */
+
+struct record_hdr {
+	uint64_t	usecs;		/* since the recording started */
+	uint32_t	len;		/* of the data that follows */
+	uint8_t		type;		/* REC_* */
+	uint8_t		pad[3];
+};
+
+extern void record_open(const char *filename);
+struct iovec;
+
+extern void record(int type, const void *buf, unsigned len);
+extern void recordv(int type, const struct iovec *iov, int iovcnt);
+
+#endif /* _SHOEHORN_RECORD_H */
@@ -0,0 +1,331 @@
+/*
+ * replay.c --	Play back a shoehorn --record session as a fake target.
+ *
+ *	shoehorn-replay [-f] [-l link] FILE
+ *	shoehorn --port /dev/pts/N ...
+ *	shoehorn-replay -s FILE
+ *
+ * The target's side of the serial conversation is served on a pty.
+ * Each reply goes out once the host has sent as many bytes as it had
+ * when the reply came in the recording, after the target's delay in
+ * the recording (the time since the host's last byte or the target's
+ * last reply, whichever was later) or, with -f, straight away.  So the
+ * target behaves as it did, and any change in the wall time is the
+ * host's.  What the host sends is checked against the recording, and
+ * the first difference reported, as the replies mean little after it.
+ *
+ * At the end each phase's time is split into host time (from a reply
+ * until the host had sent what the next reply answers) and target time
+ * (the rest), for the recording and the replay side by side; -s prints
+ * the recording's only.  Ethernet frames are recorded but not replayed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pty.h"
+#include "record.h"
+#include "util.h"
+
+#define MAX_PHASES	32
+
+/* a piece of data from the target, and what it was an answer to */
+struct reply {
+	double			time;	/* in the recording */
+	double			delay;	/* the target's part of it */
+	unsigned		need;	/* host bytes sent before it */
+	double			ready;	/* when the host had sent them */
+	int			phase;
+	const unsigned char	*data;
+	unsigned		len;
+};
+
+struct phase_time {
+	char	name[16];
+	double	host, target;		/* in the recording */
+	double	rhost, rtarget;		/* in the replay */
+	unsigned tx, rx;		/* bytes each way */
+};
+
+char *progname = "shoehorn-replay";
+
+static struct reply *replies;
+static unsigned nr_replies;
+static unsigned char *tx;		/* all the host sent, in order */
+static unsigned tx_len;
+static struct phase_time phases[MAX_PHASES];
+static int nr_phases;
+static double rec_end;
+
+static int master = -1;
+static unsigned got;			/* bytes from the host so far */
+static unsigned ready;			/* replies the host is ready for */
+static long diverged = -1;		/* first byte unlike the recording */
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void load(const char *filename)
+{
+	unsigned char *buf, *p, *end;
+	unsigned size = 0, max = 0, i;
+	struct record_hdr hdr;
+	double t, last_tx = 0, last_rx = 0;
+	int phase = 0;
+
+	if (read_file(filename, &buf, &size) < 0)
+		exit(1);
+	end = buf + size;
+	if (size < strlen(RECORD_MAGIC) ||
+	    memcmp(buf, RECORD_MAGIC, strlen(RECORD_MAGIC))) {
+		fprintf(stderr, "%s: not a shoehorn recording\n", filename);
+		exit(1);
+	}
+
+	/* a phase for whatever comes before the first named one */
+	strcpy(phases[0].name, "-");
+	nr_phases = 1;
+	tx = xmalloc(size);
+	for (p = buf + strlen(RECORD_MAGIC); p + sizeof hdr <= end;
+	     p += sizeof hdr + hdr.len) {
+		memcpy(&hdr, p, sizeof hdr);
+		if (p + sizeof hdr + hdr.len > end)
+			break;
+		t = hdr.usecs / 1e6;
+		rec_end = t;
+		switch (hdr.type) {
+		case REC_TX:
+			memcpy(tx + tx_len, p + sizeof hdr, hdr.len);
+			tx_len += hdr.len;
+			phases[phase].tx += hdr.len;
+			last_tx = t;
+			break;
+
+		case REC_RX:
+			if (nr_replies == max) {
+				struct reply *r = replies;
+
+				max = max ? 2 * max : 1024;
+				replies = xmalloc(max * sizeof *replies);
+				memcpy(replies, r, nr_replies * sizeof *r);
+				free(r);
+			}
+			replies[nr_replies].time = t;
+			replies[nr_replies].delay =
+				t - (last_tx > last_rx ? last_tx : last_rx);
+			replies[nr_replies].need = tx_len;
+			replies[nr_replies].phase = phase;
+			replies[nr_replies].data = p + sizeof hdr;
+			replies[nr_replies].len = hdr.len;
+			nr_replies++;
+			phases[phase].rx += hdr.len;
+			last_rx = t;
+			break;
+
+		case REC_PHASE:
+			if (nr_phases == MAX_PHASES)
+				break;
+			phase = nr_phases++;
+			memcpy(phases[phase].name, p + sizeof hdr,
+				min(hdr.len, sizeof phases[phase].name - 1));
+			break;
+		}
+	}
+
+	for (i = 0, t = 0; i < nr_replies; i++) {
+		struct reply *r = &replies[i];
+
+		phases[r->phase].target += r->delay;
+		phases[r->phase].host += r->time - r->delay - t;
+		t = r->time;
+	}
+	if (nr_replies)
+		phases[replies[nr_replies - 1].phase].host += rec_end - t;
+}
+
+static void mark_ready(void)
+{
+	double t = now();
+
+	while (ready < nr_replies && replies[ready].need <= got)
+		replies[ready++].ready = t;
+}
+
+/*
+ * Take what the host has sent, waiting until it has sent need bytes,
+ * or until deadline (if not 0).  Returns 0 if it has closed the port.
+ */
+static int host_input(unsigned need, double deadline)
+{
+	unsigned char buf[0x1000];
+	struct pollfd pfd = { master, POLLIN, 0 };
+	int n, i, timeout;
+
+	while (deadline ? now() < deadline : got < need) {
+		timeout = deadline ? (int)((deadline - now()) * 1000) + 1 : -1;
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+		n = read(master, buf, sizeof buf);
+		if (n < 0 && errno == EAGAIN)
+			continue;
+		if (n <= 0)
+			return 0;
+		for (i = 0; i < n && diverged < 0; i++)
+			if (got + i >= tx_len || buf[i] != tx[got + i])
+				diverged = got + i;
+		got += n;
+		mark_ready();
+	}
+	return 1;
+}
+
+static void put(const unsigned char *buf, unsigned len)
+{
+	struct pollfd pfd = { master, POLLOUT, 0 };
+	int n;
+
+	while (len > 0) {
+		n = write(master, buf, len);
+		if (n < 0 && errno == EAGAIN) {
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void report(int replay)
+{
+	double h = 0, t = 0, rh = 0, rt = 0;
+	int i;
+
+	printf("%-8s %8s %8s %9s %9s", "phase", "sent", "received",
+		"host", "target");
+	if (replay)
+		printf(" %9s %9s", "host", "target");
+	printf("\n");
+	for (i = 0; i < nr_phases; i++) {
+		struct phase_time *p = &phases[i];
+
+		if (!p->tx && !p->rx && !p->host && !p->target)
+			continue;
+		printf("%-8s %8u %8u %8.3fs %8.3fs", p->name, p->tx, p->rx,
+			p->host, p->target);
+		if (replay)
+			printf(" %8.3fs %8.3fs", p->rhost, p->rtarget);
+		printf("\n");
+		h += p->host;
+		t += p->target;
+		rh += p->rhost;
+		rt += p->rtarget;
+	}
+	printf("%-8s %8u %8s %8.3fs %8.3fs", "total", tx_len, "", h, t);
+	if (replay)
+		printf(" %8.3fs %8.3fs", rh, rt);
+	printf("\n");
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: shoehorn-replay [-f] [-l link] FILE\n"
+		"       shoehorn-replay -s FILE\n"
+		"  -f		reply as soon as the host is ready\n"
+		"		(default: with the recorded target delays)\n"
+		"  -l link	symlink to the pty, for --port\n"
+		"  -s		summarise the recording and exit\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *link_name = NULL, *name;
+	int c, fast = 0, summary = 0, connected = 1;
+	double start, sent, base;
+	unsigned i;
+
+	while ((c = getopt(argc, argv, "fl:s")) != -1) {
+		switch (c) {
+		case 'f':
+			fast = 1;
+			break;
+		case 'l':
+			link_name = optarg;
+			break;
+		case 's':
+			summary = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	load(argv[optind]);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (summary) {
+		printf("%s: %.3fs, %u replies\n", argv[optind], rec_end,
+			nr_replies);
+		report(0);
+		return 0;
+	}
+
+	master = pty_open(link_name, &name);
+	printf("shoehorn-replay: %s on %s\n", argv[optind], name);
+	pty_wait_host(master, 100);
+	start = sent = now();
+	mark_ready();
+
+	for (i = 0; i < nr_replies; i++) {
+		struct reply *r = &replies[i];
+		struct phase_time *p = &phases[r->phase];
+
+		if (!(connected = host_input(r->need, 0)))
+			break;
+		base = r->ready > sent ? r->ready : sent;
+		if (!fast && base + r->delay > now() &&
+		    !(connected = host_input(0, base + r->delay)))
+			break;
+		put(r->data, r->len);
+		p->rhost += base - sent;
+		sent = now();
+		p->rtarget += sent - base;
+	}
+	if (!connected)
+		printf("shoehorn-replay: host closed the port after %u of %u "
+			"replies\n", i, nr_replies);
+	else {
+		/* until it hangs up */
+		while (host_input(got + 1, 0))
+			;
+		if (nr_replies)
+			phases[replies[nr_replies - 1].phase].rhost +=
+				now() - sent;
+	}
+	if (diverged >= 0)
+		printf("shoehorn-replay: host differs from the recording "
+			"from byte %ld of %u\n", diverged, tx_len);
+	printf("shoehorn-replay: %.3fs, recorded %.3fs\n", now() - start,
+		rec_end);
+	report(1);
+	return 0;
+}
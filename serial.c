@@ -8,6 +8,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -15,13 +16,106 @@
 #include <unistd.h>
 #include <string.h>
 
+#include "aio.h"
+#include "board.h"
+#include "compress.h"
+#include "fill.h"
+#include "ioregs.h"
+#include "metrics.h"
+#include "prep.h"
+#include "record.h"
 #include "serial.h"
 #include "util.h"
 
 #define SERIAL_BLOCKSIZE	0x1000
+#define SERIAL_TXBUFSIZE	0x1000	/* transmit coalescing buffer */
+#define SERIAL_RXBUFSIZE	0x1000	/* read-ahead ring, power of 2 */
+#define SERIAL_ZEROCOPY		0x100	/* queue blocks this big in place */
+#define SERIAL_READSIZE		0x400	/* bytes per 'R' */
+#define SERIAL_READAHEAD	2	/* 'R's asked for; the UART FIFO
+					   holds one */
 
-static struct termios oldtio, newtio, contio;
-static int portfd = -1;
+static __thread struct termios oldtio, newtio, contio;
+static __thread int portfd = -1;
+
+/*
+ * Everything we send is collected in txbuf and only handed to the
+ * transmit engine (aio.c) at flush points, so a command and its
+ * arguments go out in one write() instead of one per byte.  The
+ * buffer is always flushed before we block waiting for the target.  Received bytes are read
+ * ahead into rxbuf, so a reply costs one read() rather than one per
+ * character.
+ */
+static __thread unsigned char txbuf[SERIAL_TXBUFSIZE];
+static __thread unsigned txlen;
+static __thread unsigned char rxbuf[SERIAL_RXBUFSIZE];
+static __thread unsigned rxhead, rxtail;		/* free-running ring indices */
+
+/*
+ * Host-side shadows of the target's IO registers.  Once we have read
+ * or written a register we know its value and don't read it again,
+ * and a write is held back until something else goes to the target,
+ * so back-to-back read-modify-writes of one register cost one write.
+ * Registers in volatile_regs change behind our back or have side
+ * effects when accessed, and always go straight to the target.
+ */
+#define SHADOW_REGS	32
+
+struct shadow {
+	unsigned	addr;
+	unsigned	value;
+	unsigned char	size;
+};
+
+static __thread struct shadow shadow[SHADOW_REGS];
+static __thread int nr_shadow;
+static __thread struct shadow *shadow_pending;	/* write not yet sent */
+
+/*
+ * Blocks sent with 'P' but not yet acknowledged, oldest first.  The
+ * loader handles them strictly in order, so replies come back in the
+ * same order.
+ */
+#define SERIAL_MAXWINDOW	16
+
+struct inflight {
+	unsigned char	seq;
+	unsigned char	type;
+	unsigned	addr;
+	const char	*raw;		/* what should end up in memory */
+	unsigned	size;
+	const char	*data;		/* what we send */
+	unsigned	datalen;
+	unsigned	progress;	/* to report once acknowledged */
+	double		queued;		/* when, for the round trip time */
+	int		retries;
+};
+
+static __thread int window;			/* 0: wait for each reply */
+static __thread int fills;			/* loader has CAP_FILL */
+static __thread struct inflight inflight[SERIAL_MAXWINDOW];
+static __thread int first_inflight, nr_inflight;
+static __thread unsigned char next_seq;
+static __thread struct inflight deferred[SERIAL_MAXWINDOW];
+static __thread int nr_deferred, deferring;	/* see fill_sync() */
+
+/*
+ * A block that fails its check is sent again, up to SERIAL_RETRIES
+ * times, rather than giving up on the whole transfer.
+ */
+#define SERIAL_RETRIES		5
+
+__thread struct xfer_stats xfer_stats;
+
+static const unsigned volatile_regs[] = {
+	PADR, PBDR, PDDR, PEDR,			/* port pins */
+	SYSFLG1, SYSFLG2, INTSR1, INTSR2, INTSR3,
+	TC1D, TC2D, RTCDR,
+	CODR, UARTDR1, UARTDR2, SYNCIO, SS2DR,
+	MCDR0, MCDR1, MCDR2, MCSR,
+	STFCLR, BLEOI, MCEOI, TEOI, TC1EOI, TC2EOI, RTCEOI, UMSEOI,
+	COEOI, HALT, STDBY, SRXEOF, SS2POP, KBDEOI,
+};
 
 /* kill handler used when only the serial port is open */
 static void handler1(int signal)
@@ -71,26 +165,99 @@ void serial_open(const char *dev)
 	tcflush(portfd, TCIFLUSH);
 	if (tcsetattr(portfd, TCSANOW, &newtio) < 0)
 		perror_exit("tcsetattr");
+	aio_open(portfd, dev);
 }
 
 /* close serial port and restore settings */
 void serial_close(void)
 {
 	assert(portfd >= 0);
+	serial_flush();
+	aio_close();
+	tcsetattr(portfd, TCSANOW, &oldtio);
+	xclose(portfd);
+	portfd = -1;
+}
+
+/*
+ * Close the port of a board that has failed, if it's open, without
+ * waiting for what hasn't gone out yet.
+ */
+void serial_abort(void)
+{
+	if (portfd < 0)
+		return;
+	txlen = 0;
+	shadow_pending = NULL;
+	tcflush(portfd, TCOFLUSH);
+	aio_abort();
 	tcsetattr(portfd, TCSANOW, &oldtio);
 	xclose(portfd);
 	portfd = -1;
 }
 
+/*
+ * Wait until everything written has left the port.  tcdrain() would
+ * hold up every board, so with several the UART is watched instead,
+ * and only its FIFO left to tcdrain().
+ */
+static void drain(void)
+{
+	int queued;
+
+	aio_sync();
+	while (board_multi && ioctl(portfd, TIOCOUTQ, &queued) == 0 &&
+	       queued > 0)
+		board_sleep(10);
+	tcdrain(portfd);
+}
+
+/*
+ * Keep up to blocks writes in flight; only for loaders that have
+ * CAP_WINDOW.  0 goes back to waiting for each reply.
+ */
+void serial_window(int blocks)
+{
+	window = min(blocks, SERIAL_MAXWINDOW);
+}
+
+/*
+ * Have the loader fill in runs of a repeated pattern rather than
+ * sending them; only for loaders that have CAP_FILL.
+ */
+void serial_fills(int enable)
+{
+	fills = enable;
+}
+
+static unsigned baud_rate(speed_t speed)
+{
+	switch (speed) {
+	case B9600:	return 9600;
+	case B19200:	return 19200;
+	case B38400:	return 38400;
+	case B57600:	return 57600;
+	case B115200:	return 115200;
+	case B230400:	return 230400;
+	default:	return 0;
+	}
+}
+
 /* switch baud rate */
 void serial_baud(speed_t speed)
 {
+	uint32_t bps;
+
 	assert(portfd >= 0);
-	tcdrain(portfd);
-	usleep(50 * 1000);	/* 50 ms sleep; arbitrary */
+	serial_flush();
+	drain();
+	board_sleep(50);	/* 50 ms sleep; arbitrary */
 	cfsetispeed(&newtio, speed);
 	cfsetospeed(&newtio, speed);
 	tcsetattr(portfd, TCSANOW, &newtio);
+	metrics_line_rate(baud_rate(speed));
+	bps = baud_rate(speed);
+	record(REC_BAUD, &bps, sizeof bps);
 }
 
 /* enter terminal mode */
@@ -111,6 +278,9 @@ void serial_terminal(void)
 	tio.c_cc[VMIN] = 1;   /* blocking read until 1 char received */
 	tcsetattr(STDIN_FILENO,TCSANOW,&tio);
 
+	serial_flush();
+	while (rxhead != rxtail)
+		putchar(rxbuf[rxhead++ % SERIAL_RXBUFSIZE]);
 	while (1) {
 		fd_set fds;
 		int retval;
@@ -122,50 +292,110 @@ void serial_terminal(void)
 
 		retval = select(portfd + 1, &fds, NULL, NULL, NULL);
 		if (FD_ISSET(portfd, &fds)) {
-			if (1 == read(portfd, &c, 1))
+			if (1 == read(portfd, &c, 1)) {
+				record(REC_RX, &c, 1);
 				putchar(c);
+			}
 		}
 		if (FD_ISSET(STDIN_FILENO, &fds)) {
-			if (1 == read(STDIN_FILENO, &c, 1))
+			if (1 == read(STDIN_FILENO, &c, 1)) {
 				put_char(c);
+				serial_flush();
+				aio_sync();
+			}
 		}
 		fflush(NULL);
 	}
 }
 
+static void shadow_flush(void);
+
+/* hand everything queued in the transmit buffer to the engine */
+void serial_flush(void)
+{
+	assert(portfd >= 0);
+	if (shadow_pending)
+		shadow_flush();
+	if (txlen) {
+		record(REC_TX, txbuf, txlen);
+		aio_copy(txbuf, txlen);
+		txlen = 0;
+	}
+}
+
+/* as serial_flush(), and wait until it has all gone out */
+void serial_drain(void)
+{
+	serial_flush();
+	drain();
+}
+
+/*
+ * Read whatever the port has into the ring, waiting up to msecs
+ * (-1: forever, 0: don't) for at least one byte.  Returns 0 if
+ * nothing came.
+ */
+static int serial_fill(int msecs)
+{
+	unsigned offset = rxtail % SERIAL_RXBUFSIZE;
+	unsigned space = SERIAL_RXBUFSIZE - (rxtail - rxhead);
+	int nread;
+
+	/* only read up to the physical end of the ring */
+	space = min(space, SERIAL_RXBUFSIZE - offset);
+	assert(space > 0);
+	nread = aio_read(rxbuf + offset, space, msecs);
+	if (nread == 0) {
+		fprintf(stderr, "\nSerial port closed\n");
+		fail();
+	}
+	if (nread < 0)
+		return 0;
+	record(REC_RX, rxbuf + offset, nread);
+	rxtail += nread;
+	return 1;
+}
+
 /* wait for a character on the serial port */
 unsigned char get_char(void)
 {
-	unsigned char c;
 	assert(portfd >= 0);
-	xread(portfd, &c, 1);
-	return c;
+	if (rxhead == rxtail) {
+		serial_flush();
+		serial_fill(-1);
+	}
+	return rxbuf[rxhead++ % SERIAL_RXBUFSIZE];
 }
 
 /* wait for a character, or until a given timeout */
 int get_char_timeout(int msecs)
 {
-	fd_set fds;
-	struct timeval tv;
-
 	assert(portfd >= 0);
-
-	FD_ZERO(&fds);
-	FD_SET(portfd, &fds);
-	tv.tv_sec = 0;
-	tv.tv_usec = msecs * 1000;
-
-	select(portfd+1, &fds, NULL, NULL, &tv);
-	if (FD_ISSET(portfd, &fds))
+	if (rxhead != rxtail)
+		return get_char();
+	serial_flush();
+	if (serial_fill(msecs))
 		return get_char();
 	return -1;
 }
 
-/* send a character on the serial port */
+/* without blocking, see how many received bytes are waiting */
+static unsigned serial_poll(void)
+{
+	if (rxtail - rxhead < SERIAL_RXBUFSIZE)
+		serial_fill(0);
+	return rxtail - rxhead;
+}
+
+/* queue a character for the serial port */
 void put_char(unsigned char c)
 {
 	assert(portfd >= 0);
-	xwrite(portfd, &c, 1);
+	if (shadow_pending)
+		shadow_flush();
+	if (txlen == SERIAL_TXBUFSIZE)
+		serial_flush();
+	txbuf[txlen++] = c;
 }
 
 /* wait for a word on the serial port, LSB first */
@@ -189,23 +419,146 @@ void put_word(unsigned w)
 	put_char(w >> 24);
 }
 
+/*
+ * Queue a block.  Large blocks are sent from where they are rather
+ * than copied, so buf must be left alone until the target has replied
+ * to it.
+ */
 void put_block(const char *buf, unsigned size)
 {
 	assert(portfd >= 0);
-	xawrite(portfd, buf, size);
+	if (shadow_pending)
+		shadow_flush();
+	if (size >= SERIAL_ZEROCOPY) {
+		serial_flush();
+		record(REC_TX, buf, size);
+		aio_write(buf, size);
+		return;
+	}
+	if (txlen + size > SERIAL_TXBUFSIZE)
+		serial_flush();
+	memcpy(txbuf + txlen, buf, size);
+	txlen += size;
+}
+
+/* remove a shadow entry, sending its write first if it's pending */
+static void shadow_drop(struct shadow *sh)
+{
+	struct shadow *last = &shadow[nr_shadow - 1];
+
+	if (sh == shadow_pending)
+		shadow_flush();
+	if (shadow_pending == last)
+		shadow_pending = sh;
+	*sh = *last;
+	nr_shadow--;
+}
+
+/*
+ * Find the shadow of an IO register, or NULL if it isn't shadowed.
+ * With create set, make a new (unknown valued) entry if necessary;
+ * any entry of the other size overlapping this one is dropped.
+ */
+static struct shadow *shadow_find(unsigned addr, unsigned char size,
+				  int create)
+{
+	struct shadow *sh;
+	int i;
+
+	if (addr - IO_START >= IO_SIZE)
+		return NULL;
+	for (i = 0; i < sizeof volatile_regs / sizeof *volatile_regs; i++)
+		if (addr == IO(volatile_regs[i]))
+			return NULL;
+
+	for (sh = shadow; sh < &shadow[nr_shadow]; sh++) {
+		if (sh->addr == addr && sh->size == size)
+			return sh;
+		if ((sh->addr & ~3) == (addr & ~3) && create) {
+			/* byte within word, or vice versa */
+			shadow_drop(sh--);
+		}
+	}
+	if (!create || nr_shadow == SHADOW_REGS)
+		return NULL;
+	sh = &shadow[nr_shadow++];
+	sh->addr = addr;
+	sh->size = size;
+	sh->value = 0;
+	return sh;
+}
+
+/* send the held-back register write */
+static void shadow_flush(void)
+{
+	struct shadow *sh = shadow_pending;
+
+	shadow_pending = NULL;
+	if (sh->size == 1) {
+		put_char('s');
+		put_word(sh->addr);
+		put_char(sh->value);
+	} else {
+		put_char('w');
+		put_word(sh->addr);
+		put_word(sh->value);
+	}
+}
+
+/* remember a register write, sending any other pending one first */
+static void shadow_write(struct shadow *sh, unsigned value)
+{
+	if (shadow_pending && shadow_pending != sh)
+		shadow_flush();
+	sh->value = value;
+	shadow_pending = sh;
+}
+
+/* a register was changed by the loader itself; drop what we know */
+static void shadow_forget(unsigned addr)
+{
+	struct shadow *sh;
+
+	for (sh = shadow; sh < &shadow[nr_shadow]; sh++) {
+		if ((sh->addr & ~3) == (addr & ~3))
+			shadow_drop(sh--);
+	}
+}
+
+/*
+ * Forget a shadowed register, for loader commands (DRAM detection,
+ * 8051 setup) that change IO registers on their own.
+ */
+void target_forget_register(unsigned addr)
+{
+	shadow_forget(addr);
 }
 
 /* ask the target to read a byte of memory */
 unsigned char target_read_byte(unsigned addr)
 {
+	struct shadow *sh = shadow_find(addr, 1, 0);
+	unsigned char data;
+
+	if (sh)
+		return sh->value;
 	put_char('g');
 	put_word(addr);
-	return get_char();
+	data = get_char();
+	if ((sh = shadow_find(addr, 1, 1)) != NULL)
+		sh->value = data;
+	return data;
 }
 
 /* tell the target to write a byte of memory */
 void target_write_byte(unsigned addr, unsigned char data)
 {
+	struct shadow *sh = shadow_find(addr, 1, 1);
+
+	if (sh) {
+		shadow_write(sh, data);
+		return;
+	}
 	put_char('s');
 	put_word(addr);
 	put_char(data);
@@ -214,44 +567,416 @@ void target_write_byte(unsigned addr, unsigned char data)
 /* ask the target to read a word of memory */
 unsigned target_read_word(unsigned addr)
 {
+	struct shadow *sh = shadow_find(addr, 4, 0);
+	unsigned data;
+
+	if (sh)
+		return sh->value;
 	put_char('r');
 	put_word(addr);
-	return get_word();
+	data = get_word();
+	if ((sh = shadow_find(addr, 4, 1)) != NULL)
+		sh->value = data;
+	return data;
 }
 
 /* tell the target to write a word of memory */
 void target_write_word(unsigned addr, unsigned data)
 {
+	struct shadow *sh = shadow_find(addr, 4, 1);
+
+	if (sh) {
+		shadow_write(sh, data);
+		return;
+	}
 	put_char('w');
 	put_word(addr);
 	put_word(data);
 }
 
-/* tell the target to write a block of memory */
-void target_write_block(unsigned addr, const char *buf,
+/*
+ * Send a whole register table in one go and wait for a single ack,
+ * rather than a read round trip for every read-modify-write.
+ */
+void target_apply_table(const struct reg_setting *table)
+{
+	struct shadow *sh;
+
+	put_char('T');
+	for (; table->size; table++) {
+		if (table->what)
+			printf("%s\n", table->what);
+		/* keep the shadows in step with what the loader does */
+		sh = shadow_find(table->addr, table->size, 0);
+		if (table->mask == ~0 || sh) {
+			sh = shadow_find(table->addr, table->size, 1);
+			if (sh)
+				sh->value = (table->mask == ~0 ? 0 :
+					     sh->value & ~table->mask)
+					    | table->value;
+		} else {
+			shadow_forget(table->addr);
+		}
+		put_char(table->size);
+		put_word(table->addr);
+		put_word(table->mask);
+		put_word(table->value);
+	}
+	put_char(0);
+	if (get_char() != '+') {
+		printf("Register table not acknowledged\n");
+		fail();
+	}
+}
+
+/* 8-bit additive checksum, as computed by the loader */
+static unsigned char checksum(const char *buf, unsigned size)
+{
+	unsigned char sum = 0;
+
+	while (size-- > 0)
+		sum += *buf++;
+	return sum;
+}
+
+/* count a failed block, giving up once it has used all its retries */
+void block_failed(const char *what, unsigned addr, int *retries)
+{
+	xfer_stats.failures++;
+	if (++*retries > SERIAL_RETRIES) {
+		printf("\n%s at 0x%08x, giving up after %d retries\n",
+		       what, addr, SERIAL_RETRIES);
+		fail();
+	}
+	xfer_stats.retries++;
+}
+
+static void window_queue(unsigned char type, unsigned addr, const char *raw,
+			 unsigned size, const char *data, unsigned datalen,
+			 unsigned progress, int retries);
+
+/*
+ * Collect the reply to the oldest block in flight; if the data didn't
+ * arrive intact, queue it again at the end of the window.  The CRC we
+ * expect is only worked out now, while later blocks are on the wire.
+ */
+static void window_ack(void)
+{
+	struct inflight f = inflight[first_inflight];
+	unsigned char seq;
+	unsigned crc;
+
+	seq = get_char();
+	crc = get_word();
+	if (seq != f.seq) {
+		printf("\nSerial sequence error (got %d, expected %d)\n",
+		       seq, f.seq);
+		fail();
+	}
+	first_inflight = (first_inflight + 1) % SERIAL_MAXWINDOW;
+	nr_inflight--;
+	metrics_rtt(f.queued);
+	if (crc != crc32(0, f.raw, f.size)) {
+		block_failed("Serial CRC error", f.addr, &f.retries);
+		if (deferring)
+			deferred[nr_deferred++] = f;
+		else
+			window_queue(f.type, f.addr, f.raw, f.size, f.data,
+				     f.datalen, f.progress, f.retries);
+		return;
+	}
+	xfer_stats.payload += f.size;
+	metrics_progress(f.progress);
+}
+
+/* send a 'P' frame, making room in the window first if need be */
+static void window_queue(unsigned char type, unsigned addr, const char *raw,
+			 unsigned size, const char *data, unsigned datalen,
+			 unsigned progress, int retries)
+{
+	struct inflight *f;
+
+	while (nr_inflight >= window)
+		window_ack();
+	f = &inflight[(first_inflight + nr_inflight++) % SERIAL_MAXWINDOW];
+	f->seq = next_seq++;
+	f->type = type;
+	f->addr = addr;
+	f->raw = raw;
+	f->size = size;
+	f->data = data;
+	f->datalen = datalen;
+	f->progress = progress;
+	f->retries = retries;
+
+	put_char('P');
+	put_char(f->seq);
+	put_char(type);
+	put_word(addr);
+	put_word(size);
+	put_block(data, datalen);
+	serial_flush();
+	f->queued = metrics_now();
+	xfer_stats.blocks++;
+	xfer_stats.bytes += datalen;
+}
+
+/*
+ * Send one block and check the loader's reply.  In windowed mode the
+ * block goes out as a 'P' frame, checked with a CRC-32, and we only
+ * wait for a reply when the window is full, picking up any that have
+ * already arrived on the way.  Otherwise we wait for the SRAM loader's
+ * 8-bit checksum.  Either way a damaged block is sent again.
+ */
+static void send_block(unsigned char type, unsigned addr, const char *raw,
+		       unsigned size, const char *data, unsigned datalen,
+		       unsigned progress)
+{
+	unsigned char sum, reply;
+	int retries = 0;
+	double start;
+
+	if (window) {
+		window_queue(type, addr, raw, size, data, datalen, progress,
+			     0);
+		/* after a fill, only fill_sync() may take replies */
+		while (type != 'F' && nr_inflight && serial_poll() >= 5)
+			window_ack();
+		return;
+	}
+
+	while (1) {
+		put_char(type);
+		put_word(addr);
+		put_word(size);
+		put_block(data, datalen);
+		xfer_stats.blocks++;
+		xfer_stats.bytes += datalen;
+		serial_flush();
+		start = metrics_now();
+		sum = checksum(raw, size);	/* while it goes out */
+		reply = get_char();
+		metrics_rtt(start);
+		if (reply == sum)
+			break;
+		block_failed("Serial checksum error", addr, &retries);
+	}
+	xfer_stats.payload += size;
+	metrics_progress(progress);
+}
+
+/* wait until every block in flight has been acknowledged */
+void target_sync(void)
+{
+	while (nr_inflight)
+		window_ack();
+}
+
+/*
+ * Wait for the reply to a fill.  The loader doesn't read the UART while
+ * it fills, so a block sent meanwhile would overflow its FIFO; those
+ * that fail before then are only sent again once the fill's reply is
+ * in, and waited for in turn in case one of them is a fill.
+ */
+static void fill_sync(void)
+{
+	struct inflight *f;
+	int i, n;
+
+	do {
+		deferring = 1;
+		target_sync();
+		deferring = 0;
+		n = nr_deferred;
+		nr_deferred = 0;
+		for (i = 0; i < n; i++) {
+			f = &deferred[i];
+			window_queue(f->type, f->addr, f->raw, f->size,
+				     f->data, f->datalen, f->progress,
+				     f->retries);
+		}
+	} while (n);
+}
+
+/* send a buffer as plain blocks */
+static void write_plain(unsigned addr, const char *buf,
 			unsigned size, unsigned progress)
 {
-	assert(portfd >= 0);
 	while (size > 0) {
-		char checksum = 0;
 		int step = min(size, SERIAL_BLOCKSIZE);
-		
-		put_char('W');
-		put_word(addr);
-		put_word(step);
-		xawrite(portfd, buf, step);
+
+		progress += step;
+		send_block('W', addr, buf, step, buf, step, progress);
 		addr += step;
+		buf += step;
 		size -= step;
-		progress += step;
-		while (step-- > 0) {
-			checksum += *buf++;
+	}
+}
+
+/*
+ * Send a buffer, each chunk the compressor managed to shrink as an
+ * LZ stream ('Z') which the loader decodes straight into DRAM, and
+ * the rest as plain 'W' blocks.
+ */
+static void write_compressed(unsigned addr, const char *buf,
+			     unsigned size, unsigned progress)
+{
+	struct chunk_list *cl;
+	struct chunk *c;
+	unsigned i;
+
+	if (!(cl = prep_chunks(buf, size)))
+		cl = compress_start((const unsigned char *)buf, size);
+	for (i = 0; i < compress_count(cl); i++) {
+		c = compress_wait(cl, i);
+		if (c->csize) {
+			send_block('Z', addr + c->offset, buf + c->offset,
+				   c->size, (const char *)c->data, c->csize,
+				   progress + c->offset + c->size);
+		} else {
+			send_block('W', addr + c->offset, buf + c->offset,
+				   c->size, buf + c->offset, c->size,
+				   progress + c->offset + c->size);
 		}
-		if (checksum != (char)get_char()) {
-			printf("\nSerial checksum error\n");
-			exit(1);
+	}
+	/* the chunks' data must stay around until they're acknowledged */
+	target_sync();
+	compress_finish(cl);
+}
+
+/*
+ * Send a buffer, having the loader fill in runs of a repeated pattern
+ * ('F') if it can, and sending the segments in between plain or
+ * compressed.
+ */
+static void write_segments(unsigned addr, const char *buf,
+			   unsigned size, unsigned progress, int compress)
+{
+	struct segment *seg, *s;
+	unsigned count;
+
+	if (!fills) {
+		if (compress)
+			write_compressed(addr, buf, size, progress);
+		else
+			write_plain(addr, buf, size, progress);
+		return;
+	}
+
+	if (!(seg = prep_segments(buf, size, &count)))
+		seg = fill_scan(buf, size, &count);
+	for (s = seg; s < seg + count; s++) {
+		if (s->fill) {
+			send_block('F', addr + s->offset, buf + s->offset,
+				   s->size, buf + s->offset, 4,
+				   progress + s->offset + s->size);
+			/* the loader can't take more while it fills */
+			fill_sync();
+		} else if (compress) {
+			write_compressed(addr + s->offset, buf + s->offset,
+					 s->size, progress + s->offset);
+		} else {
+			write_plain(addr + s->offset, buf + s->offset,
+				    s->size, progress + s->offset);
 		}
-		printf("0x%08x\r", progress);
-		fflush(NULL);
 	}
+	free(seg);
+}
+
+/* tell the target to write a block of memory */
+void target_write_block(unsigned addr, const char *buf,
+			unsigned size, unsigned progress)
+{
+	assert(portfd >= 0);
+	write_segments(addr, buf, size, progress, 0);
+	target_sync();
 }
 
+/* tell the target to write a block of memory, compressing it */
+void target_write_compressed(unsigned addr, const char *buf,
+			     unsigned size, unsigned progress)
+{
+	assert(portfd >= 0);
+	write_segments(addr, buf, size, progress, 1);
+	target_sync();
+}
+
+static void read_ask(unsigned addr, unsigned size)
+{
+	put_char('R');
+	put_word(addr);
+	put_word(size);
+	serial_flush();
+}
+
+/*
+ * Read a block of memory from the target into buf, as 'R' blocks.  The
+ * next one is asked for while the last is still coming in, so the line
+ * from the target doesn't wait on a round trip; only one, as the
+ * target's UART FIFO holds one command and no more.
+ */
+void target_read_block(unsigned addr, char *buf, unsigned size,
+		       unsigned progress)
+{
+	unsigned offset = 0, asked = 0, n, i;
+	unsigned char sum;
+	int retries = 0;
+
+	assert(portfd >= 0);
+	target_sync();
+	while (offset < size) {
+		while (asked < size && asked < offset + SERIAL_READAHEAD *
+						   SERIAL_READSIZE) {
+			n = min(size - asked, SERIAL_READSIZE);
+			read_ask(addr + asked, n);
+			asked += n;
+		}
+
+		n = min(size - offset, SERIAL_READSIZE);
+		sum = 0;
+		for (i = 0; i < n; i++)
+			sum += buf[offset + i] = get_char();
+		if (get_char() != sum) {
+			block_failed("Read-back checksum error", addr + offset,
+				     &retries);
+			/* what was asked for after it is of no use now */
+			for (i = offset + n; i < asked; i += SERIAL_READSIZE) {
+				n = min(asked - i, SERIAL_READSIZE) + 1;
+				while (n--)
+					get_char();
+			}
+			asked = offset;
+			continue;
+		}
+		retries = 0;
+		offset += n;
+		metrics_progress(progress + offset);
+	}
+}
+
+/*
+ * Have the loader hash the pages of a block of memory, putting their
+ * CRC-32s in hashes; the last page may be short.
+ */
+void target_hash_pages(unsigned addr, unsigned size, unsigned pagesize,
+		       unsigned *hashes)
+{
+	assert(portfd >= 0);
+	target_sync();
+	put_char('H');
+	put_word(addr);
+	put_word(size);
+	put_word(pagesize);
+	while (size > 0) {
+		*hashes++ = get_word();
+		size -= min(size, pagesize);
+	}
+}
+
+/* summarise what it took to get the data across */
+void print_xfer_stats(void)
+{
+	printf("Sent %u blocks (%u bytes), %u failed checks, %u retries\n",
+	       xfer_stats.blocks, xfer_stats.bytes, xfer_stats.failures,
+	       xfer_stats.retries);
+}
@@ -6,10 +6,40 @@
 
 #include <termios.h>
 
+/*
+ * One entry of a register table for target_apply_table():
+ * *addr = (*addr & ~mask) | value, as a 1- or 4-byte access.
+ * A mask of ~0 sets the register without reading it first.
+ * Tables end with an entry whose size is 0.
+ */
+struct reg_setting {
+	const char	*what;		/* progress message, or NULL */
+	unsigned char	size;
+	unsigned	addr;
+	unsigned	mask;
+	unsigned	value;
+};
+
+/* transfer statistics, reported at the end */
+struct xfer_stats {
+	unsigned	blocks;		/* sent, including retries */
+	unsigned	bytes;		/* on the wire, including retries */
+	unsigned	payload;	/* written to target memory */
+	unsigned	failures;	/* checksum/CRC mismatches, timeouts */
+	unsigned	retries;	/* blocks sent again */
+};
+
+extern __thread struct xfer_stats xfer_stats;
+
 extern void serial_open(const char *dev);
 extern void serial_close(void);
+extern void serial_abort(void);
 extern void serial_baud(speed_t speed);
 extern void serial_terminal(void);
+extern void serial_flush(void);
+extern void serial_drain(void);
+extern void serial_window(int blocks);
+extern void serial_fills(int enable);
 
 extern unsigned char get_char(void);
 extern int get_char_timeout(int msecs);
@@ -18,11 +48,22 @@ extern unsigned get_word(void);
 extern void put_word(unsigned w);
 extern void put_block(const char *buf, unsigned size);
 
+extern void target_forget_register(unsigned addr);
 extern unsigned char target_read_byte(unsigned addr);
 extern void target_write_byte(unsigned addr, unsigned char data);
 extern unsigned target_read_word(unsigned addr);
 extern void target_write_word(unsigned addr, unsigned data);
+extern void target_apply_table(const struct reg_setting *table);
 extern void target_write_block(unsigned addr, const char *buf,
 			       unsigned size, unsigned progress);
+extern void block_failed(const char *what, unsigned addr, int *retries);
+extern void target_sync(void);
+extern void print_xfer_stats(void);
+extern void target_write_compressed(unsigned addr, const char *buf,
+				    unsigned size, unsigned progress);
+extern void target_hash_pages(unsigned addr, unsigned size,
+			      unsigned pagesize, unsigned *hashes);
+extern void target_read_block(unsigned addr, char *buf, unsigned size,
+			      unsigned progress);
 
 #endif /* _SHOEHORN_SERIAL_H */
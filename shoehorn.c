@@ -38,12 +38,26 @@
 #include <ctype.h>
 #include <getopt.h>
 #include <errno.h>
+#include <glob.h>
 #include <stdint.h>
+#include <netinet/ether.h>
 
+#include "board.h"
+#include "bundle.h"
+#include "daemon.h"
+#include "delta.h"
+#include "dump.h"
 #include "eth.h"
+#include "group.h"
+#include "image.h"
 #include "ioregs.h"
+#include "loader.h"
+#include "metrics.h"
+#include "prep.h"
+#include "record.h"
 #include "serial.h"
 #include "util.h"
+#include "verify.h"
 #include "cs8900.h"
 
 #define _POSIX_SOURCE	1
@@ -60,6 +74,8 @@ static const char version[] = "shoehorn v3.4-nyuu";
 #define START_CHAR	'<'
 #define END_CHAR	'>'
 #define MAX_FRAGS	100
+#define MAX_PORTS	64
+#define DEFAULT_PORT	"/dev/ttyS0"
 #define DRAM_START	0xc0000000
 
 #define MINORBITS	8
@@ -78,28 +94,59 @@ static const char version[] = "shoehorn v3.4-nyuu";
 
 #define KERNEL_OFFSET	0x00038000	/* beginning of kernel image */
 #define PAGE		0x1000
+#define BANK_SIZE	0x10000000	/* each nCS DRAM bank's window */
+#define MAX_BANKS	4		/* in param_struct */
 
 #define INITRD_START	0xc0c00000
+#define DRAM_PATTERN	0x12345678
 
-#define ETH_STEP	1024
+#define ETH_WINDOW	16	/* burst frames in flight */
+#define ETH_MIN_RTO	0.05	/* seconds */
+#define ETH_MAX_RTO	1.0
 
+static unsigned dram_granule = 64 * 1024;
+static unsigned kernel_room = 4096 * 1024;	/* for a streamed kernel */
+static int compress = -1;	/* if the loader can */
+static int delta = 0;
 static int ethernet = 0;
+static int nostage2 = 0;
+static int window = 4;		/* blocks in flight, if the loader can */
+static __thread int use_compress, use_delta;	/* as this board's loader can */
+static __thread int use_ethernet;
+static __thread int use_group;	/* images to all the boards at once */
+static __thread int sharing;	/* writing an image they all have */
 static int hardware = 0;
 static int terminal = 0;
+static int verify = 0;
 
 struct option options[] = {
 	{ "anvil",	0, &hardware,	'a' },
+	{ "bundle",	1, 0,		'b' },
 	{ "edb7211",	0, &hardware,	'e' },
 	{ "tracker",    0, &hardware,   't' },
 	{ "phatbox",	0, &hardware,	'p' },
+	{ "compress",	0, &compress,	1 },
+	{ "connect",	1, 0,		'C' },
+	{ "daemon",	1, 0,		'D' },
+	{ "nocompress",	0, &compress,	0 },
+	{ "delta",	0, &delta,	1 },
+	{ "dram-step",	1, 0,		'S' },
 	{ "ethernet",	0, &ethernet,	1 },
+	{ "group",	1, 0,		'g' },
 	{ "initrd",	1, 0,		'i' },
 	{ "kernel",	1, 0,		'k' },
+	{ "kernel-room", 1, 0,		'K' },
 	{ "loader",	1, 0,		'l' },
 	{ "netif",	1, 0,		'n' },
 	{ "port",	1, 0,		'p' },
+	{ "record",	1, 0,		'r' },
+	{ "stage2",	1, 0,		'2' },
+	{ "stats",	1, 0,		's' },
+	{ "nostage2",	0, &nostage2,	1 },
 	{ "terminal",	0, &terminal,	1 },
+	{ "verify",	0, &verify,	1 },
 	{ "version",	0, 0,		'v' },
+	{ "window",	1, 0,		'w' },
 	{ 0,		0, 0,		0 }
 };
 
@@ -117,18 +164,40 @@ static int arch_number	= -1;
 static char *initrd	= "initrd";
 static char *kernel	= "Image";
 static char *loader	= loaderpath(LOADERPATH) "loader.bin";
+static char *stage2	= loaderpath(LOADERPATH) "loader2.bin";
 static char *netif	= "eth0";
-static char *port	= "/dev/ttyS0";
+static char *ports[MAX_PORTS];
+static int nr_ports;
+static char *stats	= NULL;
+static char *recording	= NULL;
+static char *daemon_path = NULL;
+static char *connect_path = NULL;
+static char *dump_file	= NULL;		/* "dump ADDR LEN FILE" */
+static char *bundle_out	= NULL;		/* "bundle FILE" */
+static char *bundle_path = NULL;	/* --bundle */
+static struct bundle *bundle;
+static int own_kargs;		/* a command line rather than the bundle's */
+static unsigned dump_addr, dump_len;
 
 char *progname		= "UNKNOWN";
 
+/* shared by every board */
 char kargs[256];
-unsigned char remotemac[6];
+static unsigned char *loader_buf, *stage2_buf;
+static unsigned stage2_size;
+static struct image *kernel_img, *initrd_img;
+
+/* one board's */
+__thread unsigned caps;		/* what the running loader can do */
+__thread unsigned dram_step;	/* DRAM detection granularity */
+static __thread int stage2_running;
+__thread unsigned char remotemac[6];
 
 struct fragment {
 	unsigned int	start;
 	unsigned int	size;
-} frag_list[MAX_FRAGS], *frag;
+};
+__thread struct fragment frag_list[MAX_FRAGS], *frag;
 
 /*
  * Print usage instructions and exit
@@ -137,30 +206,73 @@ void
 usage_and_exit(void)
 {
 	printf("Usage: %s [options] [kernel command line]\n"
+	       "       %s [options] dump ADDR LEN FILE\n"
+	       "       %s [options] bundle FILE [kernel command line]\n"
 	       "Available options (defaults):\n"
 	       "        --anvil\n"
+	       "        --bundle FILE (boot from it, not --kernel and --initrd)\n"
 	       "        --edb7211\n"
 		   "        --tracker\n"
 	       "        --phatbox\n"
+	       "        --compress, --nocompress (if loader supports it)\n"
+	       "        --connect SOCKET (have a --daemon boot --port or its own)\n"
+	       "        --daemon SOCKET (stay, and boot on request)\n"
+	       "        --delta (send only changed pages, if loader supports it)\n"
+	       "        --dram-step KB (%d; granularity of DRAM detection)\n"
 	       "        --ethernet\n"
+	       "        --group MAC (send images to several boards at it; broadcast)\n"
 	       "        --initrd (%s)\n"
 	       "        --kernel (%s)\n"
+	       "        --kernel-room KB (%d; DRAM kept for a streamed kernel)\n"
 	       "        --loader (%s)\n"
 	       "        --netif (%s)\n"
-	       "        --port (%s)\n"
+	       "        --port (%s; repeat it, or use a glob, for several boards)\n"
+	       "        --record FILE (log the session, for shoehorn-replay)\n"
+	       "        --stage2 (%s), --nostage2\n"
+	       "        --stats FILE (write a JSON summary)\n"
 	       "        --terminal\n"
-	       "        --version\n",
-	       progname, initrd, kernel, loader, netif, port);
+	       "        --verify (read back the kernel and initrd)\n"
+	       "        --version\n"
+	       "        --window (%d blocks in flight, if loader supports it)\n",
+	       progname, progname, progname, dram_granule / 1024, initrd, kernel,
+	       kernel_room / 1024, loader, netif,
+	       DEFAULT_PORT, stage2, window);
 	exit(1);
 }
 
 
+/*
+ * Add the ports matching pattern; one that matches nothing is kept
+ * as it is, so that opening it fails with the usual message.
+ */
+static void
+add_port(const char *pattern)
+{
+	glob_t g;
+	size_t i;
+
+	if (glob(pattern, GLOB_NOCHECK, NULL, &g) != 0) {
+		fprintf(stderr, "%s: bad port pattern\n", pattern);
+		exit(1);
+	}
+	for (i = 0; i < g.gl_pathc; i++) {
+		if (nr_ports == MAX_PORTS) {
+			fprintf(stderr, "Too many ports (limit %d)\n",
+				MAX_PORTS);
+			exit(1);
+		}
+		ports[nr_ports++] = strdup(g.gl_pathv[i]);
+	}
+	globfree(&g);
+}
+
 /*
  * Parse the command line options
  */
 static void
 parse_command_line(int argc, char **argv)
 {
+	struct ether_addr *mac;
 	int c;
 	
 	while (1) {
@@ -171,12 +283,34 @@ parse_command_line(int argc, char **argv)
 		switch (c) {
 		case 0:
 			break;
+		case 'b':
+			bundle_path = optarg;
+			break;
+		case 'C':
+			connect_path = optarg;
+			break;
+		case 'D':
+			daemon_path = optarg;
+			break;
+		case 'g':
+			if (!(mac = ether_aton(optarg)))
+				usage_and_exit();
+			memcpy(group_mac, mac, sizeof group_mac);
+			break;
 		case 'i':
 			initrd = optarg;
 			break;
 		case 'k':
 			kernel = optarg;
 			break;
+		case 'K':
+			kernel_room = atoi(optarg) * 1024;
+			if (kernel_room < PAGE || kernel_room > BANK_SIZE) {
+				fprintf(stderr, "--kernel-room: from %d to %d "
+					"kB\n", PAGE / 1024, BANK_SIZE / 1024);
+				exit(1);
+			}
+			break;
 		case 'l':
 			loader = optarg;
 			break;
@@ -184,19 +318,84 @@ parse_command_line(int argc, char **argv)
 			netif = optarg;
 			break;
 		case 'p':
-			port = optarg;
+			add_port(optarg);
+			break;
+		case 'r':
+			recording = optarg;
+			break;
+		case '2':
+			stage2 = optarg;
+			break;
+		case 's':
+			stats = optarg;
+			break;
+		case 'S':
+			dram_granule = atoi(optarg) * 1024;
+			if (dram_granule < PAGE || dram_granule > BANK_SIZE ||
+			    dram_granule & (dram_granule - 1)) {
+				fprintf(stderr, "--dram-step: a power of two, "
+					"from %d to %d kB\n", PAGE / 1024,
+					BANK_SIZE / 1024);
+				exit(1);
+			}
 			break;
 		case 'v':
 			puts(version);
 			exit(0);
+		case 'w':
+			window = atoi(optarg);
+			if (window < 0) {
+				fprintf(stderr, "--window: 0 or more blocks\n");
+				exit(1);
+			}
+			break;
 		default:
 			usage_and_exit();
 		}
 	}
+	if (optind < argc && strcmp(argv[optind], "dump") == 0) {
+		char *end1, *end2;
+
+		if (argc - optind != 4)
+			usage_and_exit();
+		dump_addr = strtoul(argv[optind + 1], &end1, 0);
+		dump_len = strtoul(argv[optind + 2], &end2, 0);
+		if (*end1 || *end2 || !dump_len ||
+		    dump_addr + dump_len - 1 < dump_addr)
+			usage_and_exit();
+		dump_file = argv[optind + 3];
+		optind = argc;
+		if (connect_path || daemon_path || nr_ports > 1) {
+			fprintf(stderr, "dump needs a single port, "
+				"and no --daemon or --connect\n");
+			exit(1);
+		}
+	}
+	if (optind < argc && strcmp(argv[optind], "bundle") == 0) {
+		if (argc - optind < 2)
+			usage_and_exit();
+		bundle_out = argv[optind + 1];
+		optind += 2;	/* the rest is the command line */
+		return;
+	}
+	if (connect_path)
+		return;		/* the daemon's options go */
 	if (hardware == 0) {
 		fprintf(stderr, "Need to specify hardware type (hint: --phatbox)\n");
 		usage_and_exit();
 	}
+	if (nr_ports == 0)
+		ports[nr_ports++] = DEFAULT_PORT;
+	board_multi = nr_ports > 1;
+	if ((board_multi || daemon_path) && (terminal || recording)) {
+		fprintf(stderr, "--terminal and --record "
+			"need a single port, and no --daemon\n");
+		exit(1);
+	}
+	if (daemon_path && ethernet) {
+		fprintf(stderr, "--ethernet needs no --daemon\n");
+		exit(1);
+	}
 }
 
 /*
@@ -226,76 +425,187 @@ build_kargs(int argc, char **argv)
 }
 
 
-void target_write_ethernet(unsigned addr, const char *buf,
-			   unsigned size, unsigned progress)
-{
-	unsigned char frame [2048];
+/*
+ * Ethernet download in bursts: one 'B' command on the serial line,
+ * then frames of ETH_BURST_DATA bytes with sequence numbers (see
+ * loader.h), ETH_WINDOW of them in flight.  The loader takes them in
+ * order and acks over Ethernet with the number of the frame it wants
+ * next, so a lost frame shows up as a repeated ack, or as no ack in
+ * time, and we go back to it.  The serial line only carries the
+ * command and, at the end, the CRC-32 of everything written.
+ *
+ * The timeout follows the measured round trip, as in RFC 6298,
+ * leaving out frames that were sent more than once.
+ */
+static __thread double eth_srtt, eth_rttvar, eth_rto = 0.5;
 
-	while (size > 0) {
-		unsigned char checksum = 0;
-		unsigned char targetsum;
-		unsigned step;
-		int response, tries = 5;
+static void eth_rtt(double start)
+{
+	double rtt = metrics_now() - start;
+	double err = rtt > eth_srtt ? rtt - eth_srtt : eth_srtt - rtt;
 
-		step = min(size, ETH_STEP);
-		put_char('E');
-		put_word(addr);
-		put_word(step);
+	metrics_rtt(start);
+	if (!eth_srtt) {
+		eth_srtt = rtt;
+		eth_rttvar = rtt / 2;
+	} else {
+		eth_rttvar = 0.75 * eth_rttvar + 0.25 * err;
+		eth_srtt = 0.875 * eth_srtt + 0.125 * rtt;
+	}
+	eth_rto = eth_srtt + 4 * eth_rttvar;
+	if (eth_rto < ETH_MIN_RTO)
+		eth_rto = ETH_MIN_RTO;
+	if (eth_rto > ETH_MAX_RTO)
+		eth_rto = ETH_MAX_RTO;
+}
 
-		/* ethernet frame format:
-		   6-byte dest, 6-byte src, 2-byte dummy type and <=
-		   1024-byte data data size must be an even number */
+#define BURST_HEAD	(ETH_HEADER + sizeof(struct eth_burst))
 
-		memset(frame, 0, sizeof frame);
-		memcpy(frame, remotemac, 6);
-		*(unsigned short*)(frame + 12) = 0xabba;
-		memcpy(frame + 14, buf, step);
+/* send frames first to last - 1 of a burst, all at once */
+static void eth_send_frames(unsigned addr, const char *buf, unsigned size,
+			    unsigned first, unsigned last)
+{
+	unsigned char head[ETH_WINDOW][BURST_HEAD];
+	struct eth_frame frame[ETH_WINDOW];
+	unsigned seq, i;
+
+	for (seq = first, i = 0; seq < last; seq++, i++) {
+		memcpy(head[i], remotemac, 6);
+		memcpy(head[i] + 6, eth_mac(), 6);
+		head[i][12] = ETH_TYPE >> 8;
+		head[i][13] = ETH_TYPE & 0xff;
+		frame[i].head = head[i];
+		frame[i].headlen = BURST_HEAD;
+		frame[i].data = buf + seq * ETH_BURST_DATA;
+		frame[i].datalen = min(size - seq * ETH_BURST_DATA,
+				       ETH_BURST_DATA);
+		put_le(head[i] + ETH_HEADER, addr);
+		put_le(head[i] + ETH_HEADER + 4, seq);
+		put_le(head[i] + ETH_HEADER + 8, frame[i].datalen);
+		xfer_stats.blocks++;
+		xfer_stats.bytes += frame[i].datalen;
+	}
+	eth_send(frame, i);
+}
 
-		do {
-			eth_write(frame, step + 14);
-			targetsum = response = get_char_timeout(500);
-		} while ((response < 0) && --tries);
+static void target_write_burst(unsigned addr, const char *buf,
+			       unsigned size, unsigned progress)
+{
+	unsigned frames = (size + ETH_BURST_DATA - 1) / ETH_BURST_DATA;
+	unsigned char ack[64];
+	double *sent = xmalloc(frames * sizeof *sent);
+	unsigned acked, next, last, seq, dup, targetcrc;
+	int timeouts = 0, retries = 0, c;
 
-		if (!tries) {
-			printf("\nEthernet: no answer\n");
-			exit(1);
+	while (1) {
+		put_char('B');
+		put_word(addr);
+		put_word(size);
+		put_word(ETH_BURST_DATA);
+		/* the target must see the command before the frames */
+		serial_drain();
+		memset(sent, 0, frames * sizeof *sent);
+		acked = next = 0;
+		dup = ~0;
+		c = -1;
+		while (acked < frames) {
+			last = min(frames, acked + ETH_WINDOW);
+			if (next < last) {
+				eth_send_frames(addr, buf, size, next, last);
+				/* 0: not sent yet, -1: sent again (Karn) */
+				for (; next < last; next++)
+					sent[next] = sent[next] ? -1
+								: metrics_now();
+			}
+			if (!eth_read(ack, sizeof ack, remotemac,
+				      eth_rto * 1000 + 1)) {
+				/* all there, and the last ack lost? */
+				if ((c = get_char_timeout(0)) >= 0)
+					break;
+				block_failed("Ethernet: no ack",
+					     addr + acked * ETH_BURST_DATA,
+					     &timeouts);
+				eth_rto = min(eth_rto * 2, ETH_MAX_RTO);
+				xfer_stats.retries += next - acked - 1;
+				next = acked;
+				continue;
+			}
+			if (get_le(ack + ETH_HEADER) != addr)
+				continue;
+			seq = get_le(ack + ETH_HEADER + 4);
+			if (seq > acked && seq <= next) {
+				if (sent[seq - 1] > 0)
+					eth_rtt(sent[seq - 1]);
+				timeouts = 0;
+				acked = seq;
+				metrics_progress(progress +
+						 min(acked * ETH_BURST_DATA, size));
+			} else if (seq == acked && seq != dup && seq < next) {
+				/* it's missing one: go back to it, once */
+				dup = seq;
+				xfer_stats.failures++;
+				xfer_stats.retries += next - acked;
+				next = acked;
+			}
 		}
 
-		addr += step;
-		size -= step;
-		progress += step;
-		while (step-- > 0) {
-			checksum += *buf++;
-		}
-		if (checksum != targetsum) {
-			fprintf(stderr, "\nEthernet checksum error\n");
-			exit(1);
-		}
-		printf("0x%08x\r", progress);
-		fflush(NULL);
+		targetcrc = c >= 0 ? c : get_char();
+		targetcrc |= get_char() << 8;
+		targetcrc |= get_char() << 16;
+		targetcrc |= get_char() << 24;
+		if (targetcrc == crc32(0, buf, size))
+			break;
+		block_failed("Ethernet CRC error", addr, &retries);
 	}
+	xfer_stats.payload += size;
+	metrics_progress(progress + size);
+	free(sent);
 }
 
-void target_write(unsigned addr, const char *buf,
-		  unsigned size, unsigned progress)
+void target_send(unsigned addr, const char *buf,
+		 unsigned size, unsigned progress)
 {
 	/* XXX this is kind of nasty */
-	if (ethernet)
-		target_write_ethernet(addr, buf, size, progress);
+	if (use_ethernet)
+		target_write_burst(addr, buf, size, progress);
+	else if (use_compress)
+		target_write_compressed(addr, buf, size, progress);
 	else
 		target_write_block(addr, buf, size, progress);
 }
 
+void target_write(unsigned addr, const char *buf,
+		  unsigned size, unsigned progress)
+{
+	struct segment *seg, *s;
+	unsigned count;
+
+	if (use_group && sharing) {
+		if (group_write(addr, buf, size, progress))
+			return;
+		use_group = 0;
+	}
+	if (!use_delta) {
+		target_send(addr, buf, size, progress);
+		return;
+	}
+	seg = delta_scan(addr, buf, size, dram_step, &count);
+	for (s = seg; s < seg + count; s++)
+		target_send(addr + s->offset, buf + s->offset, s->size,
+			    progress + s->offset);
+	free(seg);
+}
+
 /*
  * Write an object to the target, spanning multiple DRAM fragments
  * Returns final address
  */
-unsigned int
-target_write_fragmented(unsigned int addr, char *buf, unsigned int size)
+static unsigned int
+write_fragmented(unsigned int addr, char *buf, unsigned int size,
+		 int progress)
 {
 	struct fragment *frag;
 	unsigned int frag_end = 0;
-	int progress = 0;
 	
 	for (frag = &frag_list[1]; frag->size != 0; frag++) {
 		frag_end = frag->start + frag->size;
@@ -307,7 +617,7 @@ target_write_fragmented(unsigned int addr, char *buf, unsigned int size)
 		int step = min(size, frag_end - addr);
 		if (step <= 0) {
 			printf("Insufficient DRAM space\n");
-			exit(1);
+			fail();
 		}
 		target_write(addr, buf, step, progress);
 		addr += step;
@@ -326,6 +636,44 @@ target_write_fragmented(unsigned int addr, char *buf, unsigned int size)
 	return addr;
 }
 
+unsigned int
+target_write_fragmented(unsigned int addr, char *buf, unsigned int size)
+{
+	metrics_object(size);
+	addr = write_fragmented(addr, buf, size, 0);
+	metrics_object_end(size);
+	return addr;
+}
+
+/*
+ * Write an image to the target piece by piece as it is read, spanning
+ * multiple DRAM fragments.  Returns final address
+ */
+unsigned int
+target_write_image(unsigned int addr, struct image *img)
+{
+	const char *data;
+	unsigned int n, progress = 0;
+
+	/* a mapped image may be shared by several boards: all at once,
+	   without moving its cursor */
+	if (!img->streamed) {
+		sharing = 1;
+		addr = target_write_fragmented(addr, (char *)img->map,
+					       img->size);
+		sharing = 0;
+		return addr;
+	}
+
+	metrics_object(0);
+	while ((n = image_next(img, &data)) > 0) {
+		addr = write_fragmented(addr, (char *)data, n, progress);
+		progress += n;
+	}
+	metrics_object_end(progress);
+	return addr;
+}
+
 
 void
 ping(void)
@@ -336,7 +684,7 @@ ping(void)
 	put_char('a');
 	if ((c = get_char()) != '!') {
 		printf("Got %02x\n", c);
-		exit(1);
+		fail();
 	}
 }
 
@@ -397,6 +745,8 @@ void
 target_write_params(unsigned long initrd_start, unsigned long initrd_size)
 {
 	struct param_struct ps;
+	struct fragment *f;
+	unsigned bank, offset, done, n, pages = 0;
 
 	/* sanity checking to keep updates from breaking anything */
 	assert(PARAM_SIZE == PARAM_END - PARAM_OFFSET);
@@ -407,16 +757,29 @@ target_write_params(unsigned long initrd_start, unsigned long initrd_size)
 	memset(&ps, 0, sizeof ps);
 	/* printf("- page_size: %d\n", PAGE); */
 	ps.u1.s.page_size = PAGE;
-	printf("- nr_pages (all banks): %d\n", 4096);
-	ps.u1.s.nr_pages = 4096;
+	/* the DRAM found, whole pages of it, by bank; a run may go on
+	   past the end of one bank into the next */
+	for (f = &frag_list[1]; f->size != 0; f++) {
+		for (done = 0; done < f->size; done += n) {
+			offset = f->start + done - DRAM_START;
+			bank = offset / BANK_SIZE;
+			n = min(f->size - done, BANK_SIZE - offset % BANK_SIZE);
+			if (bank < MAX_BANKS)
+				ps.u1.s.pages_in_bank[bank] += n / PAGE;
+		}
+	}
+	for (bank = 0; bank < MAX_BANKS; bank++)
+		pages += ps.u1.s.pages_in_bank[bank];
+	printf("- nr_pages (all banks): %d\n", pages);
+	ps.u1.s.nr_pages = pages;
 	/* XXX */
 	ps.u1.s.flags = FLAG_READONLY | FLAG_RDLOAD | FLAG_RDPROMPT;
 	printf("- rootdev: (RAMDISK_MAJOR, 0)\n");
 	ps.u1.s.rootdev = MKDEV(RAMDISK_MAJOR, 0);
-	printf("- pages_in_bank[0]: %d\n", 2048);
-	ps.u1.s.pages_in_bank[0] = 2048;
-	printf("- pages_in_bank[1]: %d\n", 2048);
-	ps.u1.s.pages_in_bank[1] = 2048;
+	for (bank = 0; bank < MAX_BANKS; bank++)
+		if (ps.u1.s.pages_in_bank[bank])
+			printf("- pages_in_bank[%d]: %d\n", bank,
+			       ps.u1.s.pages_in_bank[bank]);
 	printf("- initrd_start: 0x%lx\n", initrd_start);
 	ps.u1.s.initrd_start = initrd_start;
 	printf("- initrd_size: 0x%lx\n", initrd_size);
@@ -432,28 +795,26 @@ target_write_params(unsigned long initrd_start, unsigned long initrd_size)
 		kargs, sizeof(kargs));
 }
 
-	
+
+static const struct reg_setting anvil_regs[] = {
+	/* IO_SYSCON3 = (IO_SYSCON3 & ~CLKCTL) | CLKCTL_73 */
+	{ "- 73MHz core clock",	4, IO(SYSCON3),	CLKCTL,	CLKCTL_73 },
+	/* IO_DRFPR = 0x83 */
+	{ "- 32kHz DRAM refresh", 4, IO(DRFPR),	~0,	0x83 },
+	/* IO_PDDR = 0x10: enable AuxPwrGate transceiver */
+	{ "- enabling UART2",	1, IO(PDDR),	~0,	0x10 },
+	/* IO_SYSCON2 |= UART2EN */
+	{ NULL,			4, IO(SYSCON2),	0,	UART2EN },
+	{ NULL,			0 }
+};
+
 void
 init_anvil(void)
 {
 	printf("- flushing cache/TLB\n");
 	put_char('4');
 
-	printf("- 73MHz core clock\n");
-	/* IO_SYSCON3 = (IO_SYSCON3 & ~CLKCTL) | CLKCTL_73 */
-	target_write_word(IO(SYSCON3),
-		(target_read_word(IO(SYSCON3)) & ~CLKCTL) | CLKCTL_73);
-	
-	printf("- 32kHz DRAM refresh\n");
-	/* IO_DRFPR = 0x83 */
-	target_write_word(IO(DRFPR), 0x83);
-
-	printf("- enabling UART2\n");
-	/* IO_PDDR = 0x10 */
-	target_write_byte(IO(PDDR), 0x10); /* enable AuxPwrGate transceiver */
-	/* IO_SYSCON2 |= UART2EN */
-	target_write_word(IO(SYSCON2),
-		target_read_word(IO(SYSCON2)) | UART2EN);
+	target_apply_table(anvil_regs);
 
 	printf("Switching to 115200 baud\n");
 	/* IO_UBRLCR1 = IO_UBRLCR1 & ~BRDIV | BR_115200 */
@@ -473,48 +834,38 @@ post_anvil(void)
 	serial_baud(B9600);
 }
 
-	
-void
-init_edb7211(void)
-{
-	printf("- flushing cache/TLB\n");
-	put_char('4');
 
-	printf("- 73MHz core clock\n");
+static const struct reg_setting edb7211_regs[] = {
 	/* IO_SYSCON3 = (IO_SYSCON3 & ~CLKCTL) | CLKCTL_73 */
-	target_write_word(IO(SYSCON3),
-		(target_read_word(IO(SYSCON3)) & ~CLKCTL) | CLKCTL_73);
-	
-	printf("- 64kHz DRAM refresh\n");
+	{ "- 73MHz core clock",	4, IO(SYSCON3),	CLKCTL,	CLKCTL_73 },
 	/* IO_DRFPR = 0x81 */
-	target_write_word(IO(DRFPR), 0x81);
-
-	printf("- enabling UART2\n");
-	/* IO_PDDR = 0x10 */
+	{ "- 64kHz DRAM refresh", 4, IO(DRFPR),	~0,	0x81 },
+	/* IO_PDDR = 0x10: enable AuxPwrGate transceiver */
 	/* XXX is this right for EDB7211? */
-	target_write_byte(IO(PDDR), 0x10); /* enable AuxPwrGate transceiver */
+	{ "- enabling UART2",	1, IO(PDDR),	~0,	0x10 },
 	/* IO_SYSCON2 |= UART2EN */
-	target_write_word(IO(SYSCON2),
-		target_read_word(IO(SYSCON2)) | UART2EN);
-
-	printf("- Activate LED flasher\n");
+	{ NULL,			4, IO(SYSCON2),	0,	UART2EN },
 	/* IO_LEDFLSH = 0x40 */
-	target_write_byte(IO(LEDFLSH), 0x40);
-
-	printf("- Setting up flash at CS0 and CS1, 32 Bit, 3 Waitstates\n");
+	{ "- Activate LED flasher", 1, IO(LEDFLSH), ~0,	0x40 },
 	/* IO_MEMCFG1 = (IO_MEMCFG1 & 0xffff0000) | 0x00001414 */
-	target_write_word(IO(MEMCFG1),
-		(target_read_word(IO(MEMCFG1)) & 0xffff0000) | 0x00001414);
-
-	printf("- Setting up CS8900 (Ethernet) at CS2, 32 Bit, 5 Waitstates\n");
+	{ "- Setting up flash at CS0 and CS1, 32 Bit, 3 Waitstates",
+				4, IO(MEMCFG1),	0x0000ffff, 0x00001414 },
 	/* IO_MEMCFG1 = (IO_MEMCFG1 & 0xff00ffff) | 0x000c0000 */
-	target_write_word(IO(MEMCFG1),
-		(target_read_word(IO(MEMCFG1)) & 0xff00ffff) | 0x000c0000);
-
-	printf("- Setting up Keyboard at CS3, 8 Bit, 3 Waitstates\n");
+	{ "- Setting up CS8900 (Ethernet) at CS2, 32 Bit, 5 Waitstates",
+				4, IO(MEMCFG1),	0x00ff0000, 0x000c0000 },
 	/* IO_MEMCFG1 = (IO_MEMCFG1 & 0x00ffffff) | 0x16000000 */
-	target_write_word(IO(MEMCFG1),
-		(target_read_word(IO(MEMCFG1)) & 0x00ffffff) | 0x16000000);
+	{ "- Setting up Keyboard at CS3, 8 Bit, 3 Waitstates",
+				4, IO(MEMCFG1),	0xff000000, 0x16000000 },
+	{ NULL,			0 }
+};
+
+void
+init_edb7211(void)
+{
+	printf("- flushing cache/TLB\n");
+	put_char('4');
+
+	target_apply_table(edb7211_regs);
 
 	printf("Switching to 115200 baud\n");
 	/* IO_UBRLCR1 = IO_UBRLCR1 & ~BRDIV | BR_115200 */
@@ -535,34 +886,31 @@ post_edb7211(void)
 }
 
 
+#define SDCONF 0x2300
+#define SDRFPR 0x2340
+
+static const struct reg_setting tracker_regs[] = {
+	/* IO_SYSCON3 = (IO_SYSCON3 & ~CLKCTL) | CLKCTL_73 */
+	{ "- 73MHz core clock",	4, IO(SYSCON3),	CLKCTL,	CLKCTL_73 },
+	/* IO_SDCONF = 0x522 */
+	{ "- SDRAM 64Mbit, CAS=2 W=16", 4, IO(SDCONF), ~0, 0x522 },
+	/* 64kHz DRAM refresh is normally done but not effective as it can be:
+	{ "- 64kHz DRAM refresh", 4, IO(DRFPR),	~0,	0x81 }, */
+	/* IO_LEDFLSH = 0x40 */
+	{ "- Activate LED flasher", 1, IO(LEDFLSH), ~0,	0x40 },
+	/* IO_MEMCFG1 = (IO_MEMCFG1 & 0xffff0000) | 0x00000014 */
+	{ "- Setting up flash at CS0, 16 Bit, 3 Waitstate",
+				4, IO(MEMCFG1),	0x0000ffff, 0x00000014 },
+	{ NULL,			0 }
+};
+
 void
 init_tracker(void)
 {
 	printf("- flushing cache/TLB\n");
 	put_char('4');
 
-	printf("- 73MHz core clock\n");
-	/* IO_SYSCON3 = (IO_SYSCON3 & ~CLKCTL) | CLKCTL_73 */
-	target_write_word(IO(SYSCON3),
-		(target_read_word(IO(SYSCON3)) & ~CLKCTL) | CLKCTL_73);
-
-#define SDCONF 0x2300
-#define SDRFPR 0x2340
-	printf("- SDRAM 64Mbit, CAS=2 W=16\n");
-	/* IO_DRFPR = 0x81 */
-	target_write_word(IO(SDCONF), 0x522);
-
-	//printf("- 64kHz DRAM refresh\n");	//Normally done but not effective
-	///* IO_DRFPR = 0x81 */				//as it can be
-	//target_write_word(IO(), 0x81);
-
-	printf("- Activate LED flasher\n");
-	/* IO_LEDFLSH = 0x40 */
-	target_write_byte(IO(LEDFLSH), 0x40);
-
-	printf("- Setting up flash at CS0, 16 Bit, 3 Waitstate\n");
-	target_write_word(IO(MEMCFG1),
-		(target_read_word(IO(MEMCFG1)) & 0xffff0000) | 0x00000014);
+	target_apply_table(tracker_regs);
 
 	printf("Switching to 115200 baud\n");
 	/* IO_UBRLCR1 = IO_UBRLCR1 & ~BRDIV | BR_115200 */
@@ -582,6 +930,28 @@ post_tracker(void)
 	serial_baud(B9600);
 }
 
+/*
+ * Note the ROM table's mask is the set of bits to keep, while ours
+ * (and the loader's 'T' command) is the set of bits to replace.
+ */
+static const struct reg_setting phatbox_regs[] = {
+	{ "SYSCON1: Enabling UART1 and EXCKEN",
+				4, IO(SYSCON1),	~0,	0x40100 },
+	{ "MEMCFG1: Enabling CLKENB for flash rom (MEMCFG1)",
+				4, IO(MEMCFG1),	3,	0x80 },
+	{ "MEMCFG2: Setting SDRAM parms -- CLKENB, SQAENB, 1 wait state, 16 bits",
+				4, IO(MEMCFG2),	~0,	0xBD00 },
+	{ "PADDR: Setting Port A Direction register...",
+				4, IO(PADDR),	0x00FF0000, 0xFF000000 },
+	{ "PADR: Setting Port A Data register...",
+				4, IO(PADR),	0x00FF0000, 0 },
+	{ "PEDDR: Setting Port E Direction register...",
+				4, IO(PEDDR),	~0xFF,	0 },
+	{ "PEDR: Setting Port E Data register...",
+				4, IO(PEDR),	~0xFF,	0 },
+	{ NULL,			0 }
+};
+
 void
 init_phatbox(void)
 {
@@ -605,33 +975,7 @@ init_phatbox(void)
   printf("- flushing cache/TLB\n");
   put_char('4');
   
-  
-  printf("SYSCON1: Enabling UART1 and EXCKEN\n");
-  target_write_word(IO(SYSCON1),0x40100);
-  
-  printf("MEMCFG1: Enabling CLKENB for flash rom (MEMCFG1)\n");
-  target_write_word(IO(MEMCFG1),
-		    (target_read_word(IO(MEMCFG1)) & (~3)) | 0x80);
-  
-  printf("MEMCFG2: Setting SDRAM parms -- CLKENB, SQAENB, 1 wait state, 16 bits\n");
-  target_write_word(IO(MEMCFG2), 0xBD00);
-  
-  printf("PADDR: Setting Port A Direction register...\n");
-  target_write_word(IO(PADDR), 
-		    (target_read_word(IO(PADDR)) & 0xFF00FFFF) | 0xFF000000);
-  
-  printf("PADR: Setting Port A Data register...\n");
-  target_write_word(IO(PADR), 
-		    (target_read_word(IO(PADR)) & 0xFF00FFFF) | 0);
-  
-  printf("PEDDR: Setting Port E Direction register...\n");
-  target_write_word(IO(PEDDR), 
-		    (target_read_word(IO(PEDDR)) & 0xFF) | 0);
-  
-  printf("PEDR: Setting Port E Data register...\n");
-  target_write_word(IO(PEDR), 
-			  (target_read_word(IO(PEDR)) & 0xFF) | 0);
-  
+  target_apply_table(phatbox_regs);
 	
 	printf("Switching to 115200 baud\n");
 	/* IO_UBRLCR1 = IO_UBRLCR1 & ~BRDIV | BR_115200 */
@@ -660,6 +1004,9 @@ init_8051(void)
 	c=d=e=f=0;
 
 	put_char('i');
+	/* the loader reprograms UART2 */
+	target_forget_register(IO(SYSCON2));
+	target_forget_register(IO(UBRLCR2));
 	while (((c=get_char()) != 0xff) || (d != 0x00) || (e != 0xff) || (f != 0x00)) {
 		printf("Got %02x\n", c);
 		f=e;
@@ -672,30 +1019,34 @@ void
 detect_dram(void)
 {
 	unsigned int start, size, total_size;
+	int width;
 	
-	put_char('d');
-	printf("- %d bits wide\n", get_char());
+	put_char('D');
+	put_word(dram_step = dram_granule);
+	target_forget_register(IO(SYSCON2));	/* loader sets DRAMSZ */
+	if ((width = get_char()) == '?') {
+		printf("Loader can't detect DRAM this way; wrong %s?\n",
+		       loader);
+		fail();
+	}
+	printf("- %d bits wide\n", width);
 	frag_list[0].start = 0;	/* item 0 is a dummy, list starts at 1 */
 	frag_list[0].size = 0;
 	total_size = 0;
 	frag = frag_list;
-	size = get_word();
 	while (1) {
 		start = get_word();
 		if (start == 0) {
 			break;
 		}
-		if (start == frag->start + frag->size) {
-			frag->size += size;
-		} else {
-			frag++;
-			if (frag >= &frag_list[MAX_FRAGS-1]) {
-				printf("Too many DRAM fragments\n");
-				exit(1);
-			}
-			frag->start = start;
-			frag->size = size;
+		size = get_word();
+		frag++;
+		if (frag >= &frag_list[MAX_FRAGS-1]) {
+			printf("Too many DRAM fragments\n");
+			fail();
 		}
+		frag->start = start;
+		frag->size = size;
 		total_size += size;
 	}
 	frag++;
@@ -706,108 +1057,410 @@ detect_dram(void)
 }
 
 
-void perror_usage_exit(const char *s)
+/*
+ * Set DRAMSZ for the DRAM's width without detect_dram(), which would
+ * write all over it: only the first two words are tried, and put back
+ * as they read in whichever width turns out to be the right one.
+ */
+static void
+probe_dram_width(void)
 {
-	fprintf(stderr, "%s: ", progname);
-	fprintf(stderr, "%s: %s\n", s, strerror(errno));
-	usage_and_exit();
+	unsigned syscon2, saved32[2], saved16[2];
+	int i;
+
+	syscon2 = target_read_word(IO(SYSCON2)) & ~DRAMSZ;
+	target_write_word(IO(SYSCON2), syscon2 | DRAMSZ);
+	for (i = 0; i < 2; i++)
+		saved16[i] = target_read_word(DRAM_START + i * 4);
+	target_write_word(IO(SYSCON2), syscon2);
+	for (i = 0; i < 2; i++)
+		saved32[i] = target_read_word(DRAM_START + i * 4);
+
+	target_write_word(DRAM_START, DRAM_PATTERN);
+	target_write_word(DRAM_START + 4, 0);	/* discharge the data bus */
+	if (target_read_word(DRAM_START) == DRAM_PATTERN) {
+		printf("- 32 bits wide\n");
+		for (i = 0; i < 2; i++)
+			target_write_word(DRAM_START + i * 4, saved32[i]);
+	} else {
+		printf("- 16 bits wide\n");
+		target_write_word(IO(SYSCON2), syscon2 | DRAMSZ);
+		for (i = 0; i < 2; i++)
+			target_write_word(DRAM_START + i * 4, saved16[i]);
+	}
 }
 
+/* the DRAM fragment holding all of start..start+size-1, or NULL */
+static struct fragment *
+find_fragment(unsigned int start, unsigned int size)
+{
+	struct fragment *f;
+
+	for (f = &frag_list[1]; f->size != 0; f++) {
+		if ((f->start <= start) && (start + size <= f->start + f->size))
+			return f;
+	}
+	return NULL;
+}
 
 /*
- * Send loader.bin to the target
- * Initialise some target registers, for Anvil hardware
- * Detect what DRAM is present, building a list of fragments
- * Load the kernel image and initrd into available fragments
- * Write a kernel parameter block with command-line arguments
- * Jump to the kernel entry point
+ * Replace the SRAM loader with the stage 2 loader, which runs from
+ * DRAM and so must wait until DRAM has been detected.
  */
-int
-main(int argc, char **argv)
+void
+start_stage2(const unsigned char *buf, unsigned size)
 {
-	unsigned char *initrd_buf, *kernel_buf, *loader_buf;
-	unsigned kernel_size, initrd_size, loader_size;
-	unsigned long kernel_end, initrd_start = INITRD_START, size;
-	int i;
-	uid_t ruid, euid, suid;
-	int getresuid(uid_t *, uid_t *, uid_t *);	/* linux only????? */
-	
-	progname = strrchr(argv[0], '/');
-	if (progname == NULL) {
-		progname = argv[0];
-	} else {
-		progname++;
+	if (!find_fragment(STAGE2_START, STAGE2_SIZE)) {
+		printf("No DRAM at 0x%08x; staying with the SRAM loader\n",
+		       STAGE2_START);
+		return;
 	}
-	parse_command_line(argc, argv);
+	stage2_running = 1;
+	printf("Starting stage 2 loader:\n");
+	print_size(STAGE2_START, size);
+	metrics_object(size);
+	target_write_block(STAGE2_START, (const char *)buf, size, 0);
+	metrics_object_end(size);
+	put_char('c');
+	put_word(STAGE2_START);
+	put_word(hardware == 'p');	/* 8051 already set up */
+	put_word(0);
+	put_word(0);
+	put_word(0);
+	ping();
+}
 
-	/* make output to stdout immediately visible */
-	setbuf(stdout, NULL);
+static void
+plan_line(const char *what, unsigned int start, unsigned int size,
+	  int streamed)
+{
+	if (size)
+		printf("- %-10s 0x%08x-0x%08x (%dkB%s)\n", what, start,
+		       start + size - 1, (size + 1023) / 1024,
+		       streamed ? " at most, streamed" : "");
+	else
+		printf("- %-10s 0x%08x- (streamed, size not known yet)\n",
+		       what, start);
+}
 
-	/* initialize Ethernet */
-	if (ethernet) {
-		printf("Initializing local network interface\n");
-		eth_open(netif);
-	}
+/* a plan that failed may have counted on a streamed kernel's size */
+static void
+room_hint(void)
+{
+	if (kernel_img->streamed)
+		printf("(%s is streamed and planned at %dkB; "
+		       "see --kernel-room)\n", kernel_img->name,
+		       kernel_room / 1024);
+}
 
-	/* drop root privs if setuid root */
-	if ( (geteuid() == 0) && (getuid() != 0) ) {
-		printf("Dropping root privileges\n");
-		if (setuid(getuid()) != 0) {
-			fprintf(stderr, "%s: error in droping root-privs\n",
-								progname);
-			exit(EXIT_FAILURE);
+/*
+ * Plan where everything goes before sending any of it.  The parameter
+ * block and the kernel go where the kernel expects them; the stage 2
+ * loader sits between the two (see loader.h).  The initrd goes in the
+ * highest pages that hold it whole above the kernel, leaving the kernel
+ * the most room to grow into.  A streamed initrd's size isn't known
+ * yet, so it goes at INITRD_START; a bundle may say where it goes.  A
+ * streamed kernel is planned at kernel_room, and checked once sent.
+ * Fails if something won't fit.
+ * Returns the initrd's address.
+ */
+static unsigned int
+plan_memory(void)
+{
+	unsigned int kernel_start = DRAM_START + KERNEL_OFFSET;
+	unsigned int kernel_size = kernel_img->streamed ? kernel_room
+						       : kernel_img->size;
+	unsigned int kernel_end = (kernel_start + kernel_size + PAGE - 1) &
+		~(PAGE - 1);
+	unsigned int start = 0, size;
+	struct fragment *f;
+
+	printf("Memory plan:\n");
+	if (!find_fragment(DRAM_START + PARAM_OFFSET, PARAM_SIZE)) {
+		printf("No DRAM for the parameter block at 0x%08x\n",
+		       DRAM_START + PARAM_OFFSET);
+		fail();
+	}
+	plan_line("parameters", DRAM_START + PARAM_OFFSET, PARAM_SIZE, 0);
+	if (stage2_running)
+		plan_line("stage 2", STAGE2_START, STAGE2_SIZE, 0);
+
+	if (!find_fragment(kernel_start, kernel_size)) {
+		printf("Not enough DRAM for %s at 0x%08x\n",
+		       kernel_img->name, kernel_start);
+		room_hint();
+		fail();
+	}
+	plan_line("kernel", kernel_start, kernel_size, kernel_img->streamed);
+
+	if (bundle && bundle->initrd_addr) {
+		start = bundle->initrd_addr;
+		if (!find_fragment(start, initrd_img->size) ||
+		    start < kernel_end) {
+			printf("No room for %s at 0x%08x, where %s puts it\n",
+			       initrd_img->name, start, bundle_path);
+			room_hint();
+			fail();
 		}
-		/* FIXME: make it portable to systems w/o saved uid */
-		/* check if root privs are really dropped */
-		if (getresuid(&ruid, &euid, &suid) != 0) {
-			fprintf(stderr, "%s: could not check if root-privs "
-						"were dropped\n", progname);
-			exit(EXIT_FAILURE);
+	} else if (initrd_img->streamed) {
+		start = INITRD_START;
+		if (!find_fragment(start, 1) || start < kernel_end) {
+			printf("No room for streamed %s at 0x%08x\n",
+			       initrd_img->name, start);
+			room_hint();
+			fail();
 		}
-		if ( (ruid == 0) || (euid == 0) || (suid == 0) ) {
-			fprintf(stderr, "%s: not all root-privs were dropped\n"
-					"\truid: %d, euid: %d, suid: %d\n",
-				       	progname, ruid, euid, suid);
-			exit(EXIT_FAILURE);
+	} else {
+		size = (initrd_img->size + PAGE - 1) & ~(PAGE - 1);
+		for (f = &frag_list[1]; f->size != 0; f++);
+		while (--f > frag_list) {
+			if (f->size < size)
+				continue;
+			start = f->start + f->size - size;
+			if (start >= kernel_end)
+				break;
+		}
+		if (f == frag_list) {
+			printf("Not enough DRAM for %s: it needs %dkB "
+			       "above the kernel, in one piece\n",
+			       initrd_img->name, size / 1024);
+			room_hint();
+			fail();
 		}
 	}
+	plan_line("initrd", start, initrd_img->streamed ? 0
+						       : initrd_img->size, 0);
+	return start;
+}
 
-	/* fill in kargs *after* dropping privileges */
-	build_kargs(argc, argv);
+/*
+ * Read an image back from the target and compare it.  A streamed image
+ * isn't kept once it's sent, so there's nothing to compare it with.
+ * Returns how many bytes differ.
+ */
+static unsigned int
+verify_image(unsigned int addr, struct image *img)
+{
+	printf("Verifying %s:\n", img->name);
+	if (img->streamed) {
+		printf("- streamed, so not kept; skipping it\n");
+		return 0;
+	}
+	return target_verify(addr, (const char *)img->map, img->size,
+			     caps & CAP_HASH);
+}
 
-	/* slurp files into buffers */
+/* ask the loader what it can do; the SRAM loader doesn't know 'v' */
+unsigned
+query_caps(void)
+{
+	unsigned char c;
+
+	put_char('v');
+	c = get_char();
+	if (c == '?')
+		return 0;
+	if (c != 'V') {
+		printf("Got %02x\n", c);
+		fail();
+	}
+	return get_word();
+}
+
+
+void perror_usage_exit(const char *s)
+{
+	fprintf(stderr, "%s: ", progname);
+	fprintf(stderr, "%s: %s\n", s, strerror(errno));
+	usage_and_exit();
+}
+
+
+static void boot(const char *port);
+static void dump(const char *port);
+
+/*
+ * The files a boot needs.  A daemon reads them again into a set of its
+ * own, and only swaps that in once it has all been read and checked.
+ */
+struct files {
+	unsigned char	*loader_buf, *stage2_buf;
+	unsigned	stage2_size;
+	struct image	*kernel_img, *initrd_img;
+	struct bundle	*bundle;
+	int		prepped;	/* by prep_image() */
+};
+
+static int prepped;
+
+/* let go of a set, or as much of it as was read */
+static void
+close_files(struct files *f)
+{
+	if (f->prepped) {
+		prep_forget((const char *)f->kernel_img->map);
+		prep_forget((const char *)f->initrd_img->map);
+	}
+	if (f->bundle) {
+		bundle_close(f->bundle);
+	} else {
+		if (f->kernel_img)
+			image_close(f->kernel_img);
+		if (f->initrd_img)
+			image_close(f->initrd_img);
+	}
+	free(f->loader_buf);
+	free(f->stage2_buf);
+	memset(f, 0, sizeof *f);
+}
+
+static int
+load_failed(struct files *f)
+{
+	close_files(f);
+	return -1;
+}
+
+/*
+ * Slurp the loaders into buffers, and map the images or start reading
+ * them.  A daemon prepares the images once rather than on every boot,
+ * as it does for several boards.  Returns -1, having said why and let
+ * go of what it had read, if any of it can't be used.
+ */
+static int
+load_files(struct files *f)
+{
+	unsigned loader_size;
+
+	memset(f, 0, sizeof *f);
 	loader_size = SRAM_SIZE;  /* must allocate at least SRAM_SIZE bytes */
-	read_file(loader, &loader_buf, &loader_size);
-	kernel_size = 0;
-	read_file(kernel, &kernel_buf, &kernel_size);
-	initrd_size = 0;
-	read_file(initrd, &initrd_buf, &initrd_size);
+	if (read_file(loader, &f->loader_buf, &loader_size) < 0)
+		return load_failed(f);
+	if (!dump_file && bundle_path) {
+		if (!(f->bundle = bundle_open(bundle_path)))
+			return load_failed(f);
+		if (f->bundle->kernel_addr != DRAM_START + KERNEL_OFFSET) {
+			fprintf(stderr, "%s: its kernel goes at 0x%08x, "
+				"not 0x%08x\n", bundle_path,
+				f->bundle->kernel_addr,
+				DRAM_START + KERNEL_OFFSET);
+			return load_failed(f);
+		}
+		f->kernel_img = f->bundle->kernel;
+		f->initrd_img = f->bundle->initrd;
+	} else if (!dump_file) {
+		if (!(f->kernel_img = image_open(kernel)) ||
+		    !(f->initrd_img = image_open(initrd)))
+			return load_failed(f);
+	}
+	if ((board_multi || daemon_path) &&
+	    (f->kernel_img->streamed || f->initrd_img->streamed)) {
+		fprintf(stderr, "%s: several boards or a daemon need the "
+			"images in regular files\n", progname);
+		return load_failed(f);
+	}
 
 	/* make sure loader isn't too big */
 	if (loader_size > SRAM_SIZE) {
 		fprintf(stderr, "%s: loader too large (limit %d bytes)\n",
 			progname, SRAM_SIZE);
-		exit(1);
+		return load_failed(f);
 	}
 	if (loader_size > SRAM_SIZE - 0x100)
 		fprintf(stderr, "%s: warning: loader stack might clobber code\n",
 				progname);
 
+	if (!nostage2) {
+		if (read_file(stage2, &f->stage2_buf, &f->stage2_size) < 0)
+			return load_failed(f);
+		if (f->stage2_size > STAGE2_SIZE - STAGE2_STACK) {
+			fprintf(stderr, "%s: stage 2 loader too large "
+				"(limit %d bytes)\n", progname,
+				STAGE2_SIZE - STAGE2_STACK);
+			return load_failed(f);
+		}
+	}
+
+	/* a bundle's were prepared when it was made */
+	if ((board_multi || daemon_path) && !f->bundle) {
+		prep_image((const char *)f->kernel_img->map,
+			   f->kernel_img->size);
+		prep_image((const char *)f->initrd_img->map,
+			   f->initrd_img->size);
+		f->prepped = 1;
+	}
+	return 0;
+}
+
+/* put f's files in use, and leave f with the ones that were */
+static void
+swap_files(struct files *f)
+{
+	struct files old = { loader_buf, stage2_buf, stage2_size,
+			     kernel_img, initrd_img, bundle, prepped };
+
+	loader_buf = f->loader_buf;
+	stage2_buf = f->stage2_buf;
+	stage2_size = f->stage2_size;
+	kernel_img = f->kernel_img;
+	initrd_img = f->initrd_img;
+	bundle = f->bundle;
+	prepped = f->prepped;
+	if (bundle && !own_kargs)
+		strncpy(kargs, bundle->kargs, sizeof kargs - 1);
+	*f = old;
+}
+
+static void
+unload_files(void)
+{
+	struct files f;
+
+	memset(&f, 0, sizeof f);
+	swap_files(&f);
+	close_files(&f);
+}
+
+/* read the files again, keeping the ones we have if they won't do */
+static void
+reload_files(void)
+{
+	struct files f;
+
+	if (load_files(&f) < 0) {
+		printf("Keeping the files we have\n");
+		return;
+	}
+	swap_files(&f);
+	close_files(&f);
+}
+
+/*
+ * Wake the board on port up, give it the SRAM loader and set up its
+ * hardware, up to where its DRAM can be used.
+ */
+static void
+start_target(const char *port)
+{
 	/* open serial port and start talking to hardware */
+	stage2_running = 0;
 	serial_open(port);
+	metrics_phase(PHASE_WAIT);
 	printf("Waiting for target - press Wakeup now. (ie turn it on!)\n");
 	if (get_char() != START_CHAR) {
 		printf("Expected start character '%c'\n", START_CHAR);
-		exit(1);
+		fail();
 	}
+	metrics_phase(PHASE_LOADER);
 	printf("Writing SRAM loader...\n");
 	put_block(loader_buf, SRAM_SIZE);
 	if (get_char() != END_CHAR) {
 		printf("Expected end character '%c'\n", END_CHAR);
-		exit(1);
+		fail();
 	}
 	ping();
-	
+
+	metrics_phase(PHASE_INIT);
 	switch(hardware) {
 	case 'a':
 		/* Anvil hardware doesn't appear to have an arch. number;
@@ -838,105 +1491,309 @@ main(int argc, char **argv)
 	assert(arch_number > 0);
 	ping();
 
-	if (ethernet) {
-		unsigned	allff;
-		unsigned	allzero;
-		unsigned short	status;
-
-		printf("Initializing remote Ethernet\n");
-		put_char('e');
-		status = get_char();
-		status += get_char() << 8;
-		printf("cs8900 status: %04x (", status);
-		if (status & PP_SelfSTAT_EEPROM) {
-			printf("EEPROM present:");
-			if (status & PP_SelfSTAT_EEPROM_OK)
-				printf(" OK, ");
-			printf(" size = ");
-			if (status & PP_SelfSTAT_EEsize) {
-				printf("64");
-			} else {
-				printf("128/256");
-			}
-			printf(" words");
+	if (hardware == 'p'){
+		printf("Initializing 8051\n");
+		init_8051();
+	}
+}
+
+/* set up the board's CS8900, and learn or give it its MAC address */
+static void
+init_remote_ethernet(void)
+{
+	int		i;
+	unsigned	allff;
+	unsigned	allzero;
+	unsigned short	status;
+
+	printf("Initializing remote Ethernet\n");
+	put_char('e');
+	status = get_char();
+	status += get_char() << 8;
+	printf("cs8900 status: %04x (", status);
+	if (status & PP_SelfSTAT_EEPROM) {
+		printf("EEPROM present:");
+		if (status & PP_SelfSTAT_EEPROM_OK)
+			printf(" OK, ");
+		printf(" size = ");
+		if (status & PP_SelfSTAT_EEsize) {
+			printf("64");
+		} else {
+			printf("128/256");
 		}
-		printf(")\n");
-		if (get_char() != '+') {
-			fprintf(stderr, "%s: Ethernet initialization error\n",
-					progname);
-			exit(1);
+		printf(" words");
+	}
+	printf(")\n");
+	if (get_char() != '+') {
+		fprintf(stderr, "%s: Ethernet initialization error\n",
+				progname);
+		exit(1);
+	}
+	printf("MAC address of target is ");
+	allff = 1;
+	allzero = 1;
+	for (i=0; i<6; i++) {
+		remotemac[i] = get_char();
+		if (remotemac[i] != 0xff) {
+			allff = 0;
 		}
-		printf("MAC address of target is ");
-		allff = 1;
-		allzero = 1;
+	       	if (remotemac[i] != 0x00) {
+			allzero = 0;
+		}
+		putchar('.');
+	}
+	putchar(' ');
+	allff |= allzero;
+	if (allff) {
+		printf("uninitialized; setting.\n");
+		put_char('M');
+		/* set 12:34:56:78:9a:bc as MAC address */
 		for (i=0; i<6; i++) {
-			remotemac[i] = get_char();
-			if (remotemac[i] != 0xff) {
-				allff = 0;
-			}
-		       	if (remotemac[i] != 0x00) {
-				allzero = 0;
-			}
-			putchar('.');
+			put_char(0x12 + i * 0x22);
 		}
-		putchar(' ');
-		allff |= allzero;
-		if (allff) {
-			printf("uninitialized; setting.\n");
-			put_char('M');
-			/* set 12:34:56:78:9a:bc as MAC address */
-			for (i=0; i<6; i++) {
-				put_char(0x12 + i * 0x22);
-			}
-			printf("Now MAC address of device is ");
+		printf("Now MAC address of device is ");
+	}
+	for (i=0; i<6; i++) {
+		remotemac[i] = allff ? get_char() : remotemac[i];
+		printf("%02X%c", remotemac[i], i==5 ? '\n' : ':');
+	}
+	if (!board_multi)
+		eth_filter(remotemac);
+}
+
+/* boot one or several boards; returns how many failed */
+static int
+boot_ports(char **ports, int nr_ports)
+{
+	board_multi = nr_ports > 1;
+	if (stats)
+		metrics_open(stats, version);
+	if (board_multi)
+		return boards_run(ports, nr_ports, boot);
+	boot(ports[0]);
+	return 0;
+}
+
+/*
+ * Send loader.bin to the target
+ * Initialise some target registers, for Anvil hardware
+ * Detect what DRAM is present, building a list of fragments
+ * Load the kernel image and initrd into available fragments
+ * Write a kernel parameter block with command-line arguments
+ * Jump to the kernel entry point
+ */
+int
+main(int argc, char **argv)
+{
+	struct files files;
+	int failures;
+	uid_t ruid, euid, suid;
+	int getresuid(uid_t *, uid_t *, uid_t *);	/* linux only????? */
+	
+	progname = strrchr(argv[0], '/');
+	if (progname == NULL) {
+		progname = argv[0];
+	} else {
+		progname++;
+	}
+	parse_command_line(argc, argv);
+
+	/* make output to stdout visible a line at a time; the progress
+	   line is flushed as it is drawn */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	/* initialize Ethernet; making a bundle or asking a daemon needs none */
+	if (ethernet && !bundle_out && !connect_path) {
+		printf("Initializing local network interface\n");
+		eth_open(netif);
+	}
+
+	/* drop root privs if setuid root */
+	if ( (geteuid() == 0) && (getuid() != 0) ) {
+		printf("Dropping root privileges\n");
+		if (setuid(getuid()) != 0) {
+			fprintf(stderr, "%s: error in droping root-privs\n",
+								progname);
+			exit(EXIT_FAILURE);
 		}
-		for (i=0; i<6; i++) {
-			remotemac[i] = allff ? get_char() : remotemac[i];
-			printf("%02X%c", remotemac[i], i==5 ? '\n' : ':');
+		/* FIXME: make it portable to systems w/o saved uid */
+		/* check if root privs are really dropped */
+		if (getresuid(&ruid, &euid, &suid) != 0) {
+			fprintf(stderr, "%s: could not check if root-privs "
+						"were dropped\n", progname);
+			exit(EXIT_FAILURE);
+		}
+		if ( (ruid == 0) || (euid == 0) || (suid == 0) ) {
+			fprintf(stderr, "%s: not all root-privs were dropped\n"
+					"\truid: %d, euid: %d, suid: %d\n",
+				       	progname, ruid, euid, suid);
+			exit(EXIT_FAILURE);
 		}
 	}
-	if (hardware == 'p'){
-		printf("Initializing 8051\n");
-		init_8051();
+
+	/* the daemon boots; all we need is its socket, as the user */
+	if (connect_path)
+		return daemon_request(connect_path, ports, nr_ports);
+
+	/* fill in kargs *after* dropping privileges */
+	build_kargs(argc, argv);
+	own_kargs = kargs[0] != 0;
+	/* only after dropping them too: it reads and replaces files */
+	if (bundle_out) {
+		if (!(kernel_img = image_open(kernel)) ||
+		    !(initrd_img = image_open(initrd)))
+			exit(1);
+		bundle_write(bundle_out, kernel_img, DRAM_START + KERNEL_OFFSET,
+			     initrd_img, kargs);
+		image_close(kernel_img);
+		image_close(initrd_img);
+		return 0;
+	}
+	if (recording)
+		record_open(recording);
+
+	/* the stage 2 loader is optional; a dump only wants its Ethernet */
+	if (dump_file && !ethernet)
+		nostage2 = 1;
+	if (!nostage2 && access(stage2, R_OK) != 0) {
+		printf("%s: not found, using the SRAM loader only\n", stage2);
+		nostage2 = 1;
+	}
+	/* a daemon's images must outlive the files being rewritten */
+	image_snapshot = daemon_path != NULL;
+	if (load_files(&files) < 0)
+		exit(1);
+	swap_files(&files);
+	if (dump_file) {
+		dump(ports[0]);
+		if (ethernet)
+			eth_close();
+		unload_files();
+		return 0;
 	}
+	if (daemon_path) {
+		char *files[] = { loader, kernel, initrd, stage2 };
+		int nr_files = nostage2 ? 3 : 4;
+
+		if (bundle_path) {
+			files[1] = bundle_path;
+			files[2] = stage2;
+			nr_files--;
+		}
+		daemon_run(daemon_path, files, nr_files, reload_files,
+			   boot_ports, ports, nr_ports);
+	}
+
+	failures = boot_ports(ports, nr_ports);
+	if (ethernet)
+		eth_close();
+	unload_files();
+	return failures ? 1 : 0;
+}
+
+/*
+ * Boot the board on port, from the boot ROM to starting the kernel.
+ * With several boards this runs once for each, side by side.
+ */
+static void
+boot(const char *port)
+{
+	unsigned long kernel_end, initrd_start;
+	unsigned initrd_size;
+
+	start_target(port);
+	metrics_phase(PHASE_DRAM);
 	printf("Detecting DRAM\n");
 	detect_dram();
-	
-	printf("Loading %s:\n", kernel);
-	print_size(DRAM_START + KERNEL_OFFSET, kernel_size);
-	kernel_end = target_write_fragmented(DRAM_START + KERNEL_OFFSET,
-		kernel_buf, kernel_size);
-	free(kernel_buf);
-
-	/* Find a start address for initrd.  We put it
-	   at the highest possible page-aligned address. */
-	size = (initrd_size + PAGE - 1) & ~(PAGE - 1);
-	for (frag = &frag_list[1]; frag->size != 0; frag++);
-	frag--;
-	while ((size > 0) && (frag > frag_list)) {
-		int step = min(size, frag->size);
-		initrd_start = frag->start + frag->size - step;
-		size -= step;
-		frag--;
+
+	if (!nostage2) {
+		metrics_phase(PHASE_STAGE2);
+		start_stage2(stage2_buf, stage2_size);
+	}
+	caps = query_caps();
+	printf("Loader capabilities:%s%s%s%s%s%s%s%s\n",
+	       caps ? "" : " none",
+	       caps & CAP_LZ ? " compression" : "",
+	       caps & CAP_WINDOW ? " window" : "",
+	       caps & CAP_FILL ? " fill" : "",
+	       caps & CAP_HASH ? " hash" : "",
+	       caps & CAP_ETH ? " ethernet" : "",
+	       caps & CAP_GROUP ? " group" : "",
+	       caps & CAP_SEND ? " send" : "");
+	use_compress = compress;
+	if (use_compress < 0) {
+		use_compress = !!(caps & CAP_LZ);
+	} else if (use_compress && !(caps & CAP_LZ)) {
+		printf("Loader can't decompress; sending uncompressed\n");
+		use_compress = 0;
+	}
+	use_delta = delta;
+	if (use_delta && !(caps & CAP_HASH)) {
+		printf("Loader can't hash pages; sending everything\n");
+		use_delta = 0;
 	}
-	/* XXX miket: trying this out */
-	printf("initrd_start is %lx\n", initrd_start);
-	initrd_start = INITRD_START;
-	printf("Moving initrd_start to %lx\n", initrd_start);
-	/* end XXX area */
+	use_ethernet = ethernet;
+	if (use_ethernet && !(caps & CAP_ETH)) {
+		printf("Loader has no Ethernet; sending over serial\n");
+		use_ethernet = 0;
+	}
+	if (use_ethernet)
+		init_remote_ethernet();
+
+	/* several boards get the images together, and the rest serially */
+	use_group = board_multi && use_ethernet;
+	if (use_group && !(caps & CAP_GROUP)) {
+		printf("Loader can't take group bursts; sending over serial\n");
+		use_group = 0;
+	}
+	if (!use_group)
+		board_ungroup();
+	if (board_multi)
+		use_ethernet = 0;
+	if (caps & CAP_WINDOW)
+		serial_window(window);
+	if (caps & CAP_FILL)
+		serial_fills(1);
+	initrd_start = plan_memory();
+	
+	metrics_phase(PHASE_KERNEL);
+	printf("Loading %s:\n", kernel_img->name);
+	if (!kernel_img->streamed)
+		print_size(DRAM_START + KERNEL_OFFSET, kernel_img->size);
+	kernel_end = target_write_image(DRAM_START + KERNEL_OFFSET, kernel_img);
+	if (kernel_img->streamed)
+		print_size(DRAM_START + KERNEL_OFFSET, kernel_img->size);
+
+	/* a streamed kernel's size is only known now */
 	if (initrd_start < kernel_end) {
 		printf("Not enough space for initrd\n");
-		exit(1);
+		room_hint();
+		fail();
 	}
 
-	printf("Loading %s:\n", initrd);
-	print_size(initrd_start, initrd_size);
-	target_write_fragmented(initrd_start, initrd_buf, initrd_size);
-	free(initrd_buf);
+	metrics_phase(PHASE_INITRD);
+	printf("Loading %s:\n", initrd_img->name);
+	if (!initrd_img->streamed)
+		print_size(initrd_start, initrd_img->size);
+	target_write_image(initrd_start, initrd_img);
+	if (initrd_img->streamed)
+		print_size(initrd_start, initrd_img->size);
+	initrd_size = initrd_img->size;
 	
+	metrics_phase(PHASE_PARAMS);
 	printf("Writing parameter area\n");
 	target_write_params(initrd_start, initrd_size);
+
+	if (verify) {
+		metrics_phase(PHASE_VERIFY);
+		if (verify_image(DRAM_START + KERNEL_OFFSET, kernel_img) +
+		    verify_image(initrd_start, initrd_img)) {
+			printf("Verification failed\n");
+			fail();
+		}
+	}
 	
+	metrics_phase(PHASE_BOOT);
 	switch(hardware) {
 	case 'a':
 		post_anvil();
@@ -957,8 +1814,7 @@ main(int argc, char **argv)
 	}
 	ping();
 
-	if (ethernet)
-		eth_close();
+	print_xfer_stats();
 	
 	printf("Starting kernel\n");
 	put_char('c');
@@ -967,6 +1823,8 @@ main(int argc, char **argv)
 	put_word(arch_number);
 	put_word(0);
 	put_word(0);
+	serial_flush();
+	metrics_done();
 
 	/* I've found this bit useful for debugging: If the kernel doesn't
 	   seem to boot, run "shoehorn --terminal" and plug head-armv.S
@@ -976,6 +1834,45 @@ main(int argc, char **argv)
 		serial_terminal();
 
 	serial_close();
-	return 0;
 }
 
+/*
+ * Read dump_len bytes at dump_addr on the board on port into dump_file,
+ * after a reset that kept what its DRAM had.  Only the stage 2 loader's
+ * own area is written to, and that only for --ethernet.
+ */
+static void
+dump(const char *port)
+{
+	const unsigned char *mac = NULL;
+
+	start_target(port);
+	printf("Probing DRAM\n");
+	probe_dram_width();
+
+	if (!nostage2) {
+		/* it goes where it always does, without detect_dram() */
+		frag_list[1].start = STAGE2_START;
+		frag_list[1].size = STAGE2_SIZE;
+		frag_list[2].start = frag_list[2].size = 0;
+		if (dump_addr < STAGE2_START + STAGE2_SIZE &&
+		    STAGE2_START < dump_addr + dump_len)
+			printf("Warning: the stage 2 loader overwrites "
+			       "0x%08x-0x%08x of the dump\n", STAGE2_START,
+			       STAGE2_START + STAGE2_SIZE - 1);
+		start_stage2(stage2_buf, stage2_size);
+		caps = query_caps();
+		if (caps & CAP_SEND) {
+			init_remote_ethernet();
+			mac = remotemac;
+		} else {
+			printf("Loader can't send over Ethernet; "
+			       "reading over serial\n");
+		}
+	}
+
+	printf("Dumping 0x%08x-0x%08x to %s\n", dump_addr,
+	       dump_addr + dump_len - 1, dump_file);
+	dump_memory(dump_addr, dump_len, dump_file, mac);
+	serial_close();
+}
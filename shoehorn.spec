@@ -45,7 +45,9 @@ rm -rf $RPM_BUILD_ROOT
 %defattr (4755, root, root, -)
 /usr/bin/shoehorn
 %defattr (755, root, root, -)
+/usr/bin/shoehorn-replay
 /usr/lib/shoehorn/loader.bin
+/usr/lib/shoehorn/loader2.bin
 
 %changelog 
 
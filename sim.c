@@ -0,0 +1,815 @@
+/*
+ * sim.c --	Run the loaders on the host, for testing without a board.
+ *
+ * loader.c is compiled natively twice, as the SRAM loader and (with
+ * STAGE2) as the stage 2 loader, with SIM defined so that its IO_*
+ * register accesses come through sim_io() here.  The internal
+ * registers, SRAM and DRAM are mapped at their real addresses, so the
+ * loader's own pointers work unchanged, and UART1 is a pseudo-terminal
+ * which an unmodified shoehorn can use:
+ *
+ *	loader-sim [-b baud] [-m MB] [-l link] [-d dumpfile] [-1]
+ *		   [-e netif [-x percent]]
+ *	shoehorn --port /dev/pts/N ...
+ *
+ * UART1 runs at the rate the host programs into UBRLCR1 (or -b; 0 for
+ * as fast as possible), with a 16 byte FIFO each way, so transfer times
+ * come out close to a real board's.  DRAM is -m MB (32), repeated
+ * across the DRAM area like a bank with unconnected address lines.
+ * Opening the pty stands in for pressing Wakeup.  Calling anything but
+ * the stage 2 loader counts as starting a kernel: DRAM is dumped if
+ * asked, then the board resets, keeping DRAM, ready for the next boot.
+ * Nothing is connected to UART2, so there's no PhatBox 8051.
+ *
+ * With -e, the CS8900A is on that network interface: it gets the frames
+ * for its address, and broadcasts, at 10 Mbit/s into a CS_BUFFER byte
+ * buffer, dropping what doesn't fit, and -x of them at random besides.
+ * It has no EEPROM, so its address is all zeroes until it's set.
+ *
+ * A write to UARTDR1 can't be told from a read as it happens, so each
+ * access takes the next received byte out of the FIFO and leaves it in
+ * the register with RX_MARK set.  At the next register access, if the
+ * mark has gone the loader wrote the register: the byte written is sent
+ * and the received one goes back in the FIFO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cs8900.h"
+#include "ioregs.h"
+#include "loader.h"
+#include "pty.h"
+#include "util.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE	0x100000
+#endif
+
+#define SRAM_START	0x10000000
+#define SRAM_SIZE	0x800
+#define DRAM_START	0xc0000000
+#define DRAM_AREA	0x20000000	/* up to 0xe0000000 */
+
+#define FIFO_SIZE	16
+#define BACKLOG		4096		/* bytes read from the pty, not yet arrived */
+#define RX_MARK		0x80000000
+#define SPIN_LIMIT	64		/* identical SYSFLG1 polls before sleeping */
+#define REG(offset)	((volatile unsigned *)(unsigned long)(IO_START + (offset)))
+
+#define CS_MARK		0xa5a50000	/* as RX_MARK, in the unused top half */
+#define CS_BUFFER	4096		/* receive buffer, bytes */
+#define CS_FRAMES	16
+#define CS_MAXFRAME	1518
+#define CS_RATE		10e6		/* bits/s */
+
+/* the two loaders, renamed for stage 2 by the Makefile */
+extern int cmain(int init8051);
+extern int stage2_cmain(int init8051);
+
+static int master = -1;
+static int baud = -1;			/* -1: follow UBRLCR1 */
+static double byte_time;
+static unsigned dram_size = 32 << 20;
+static char *dump_file;
+static int once;
+static int wakeup_ms = 200;
+static jmp_buf reset_jmp;
+
+/* receive: bytes from the host arrive at bl_time[], then enter the FIFO */
+static unsigned char backlog[BACKLOG];
+static double bl_time[BACKLOG];
+static int bl_head, bl_len;
+static double rx_last;
+static unsigned char rx_fifo[FIFO_SIZE];
+static int rx_head, rx_count;
+
+/* transmit: bytes leave the FIFO at tx_time[] and go to the host */
+static unsigned char tx_fifo[FIFO_SIZE * 2];
+static double tx_time[FIFO_SIZE * 2];
+static int tx_head, tx_count;
+static double tx_last;
+
+static int dr1_pending, dr1_popped;
+static unsigned char dr1_byte;
+static unsigned last_flags;
+static int spins;
+static int host_gone;
+static int host_hup;		/* closed, but there may be more to read */
+static unsigned long bytes_in, bytes_out;
+static double wakeup;
+
+/* the CS8900A */
+struct cs_frame {
+	unsigned char	data[CS_MAXFRAME];
+	unsigned	len;
+	double		arrival;	/* all of it, in the buffer */
+};
+static int cs_sock = -1;
+static int cs_loss;			/* percent */
+static unsigned cs_reg[8];		/* RTDATA ... PDATA, by offset / 4 */
+static int cs_pending = -1;		/* the last access */
+static unsigned short cs_pp[0x200 / 2];	/* PacketPage, as last written */
+static struct cs_frame cs_rx[CS_FRAMES];
+static int cs_head, cs_count;
+static unsigned cs_pos;			/* halfwords of cs_rx[cs_head] read */
+static int cs_reading;
+static double cs_wire;			/* when the last frame is all in */
+static double cs_txwire;		/* when the last one sent is all out */
+static unsigned char cs_tx[CS_MAXFRAME + 1];
+static unsigned cs_txlen, cs_txpos;
+static int cs_spins;
+static unsigned long frames_in, frames_out, frames_lost;
+
+char *progname = "loader-sim";
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void map(unsigned long addr, unsigned long len, int flags, int fd)
+{
+	void *p;
+
+	p = mmap((void *)addr, len, PROT_READ | PROT_WRITE,
+		flags | MAP_FIXED_NOREPLACE, fd, 0);
+	if (p == MAP_FAILED || p != (void *)addr) {
+		fprintf(stderr, "loader-sim: can't map 0x%08lx\n", addr);
+		exit(1);
+	}
+}
+
+/*
+ * DRAM is a memfd mapped over and over across the DRAM area, so that
+ * detect_dram() sees the aliases it would on a board.
+ */
+static void map_memory(void)
+{
+	unsigned long off, len;
+	int fd;
+
+	map(IO_START, IO_SIZE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+	map(SRAM_START, 0x1000, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+
+	if ((fd = memfd_create("loader-sim-dram", 0)) < 0)
+		perror_exit("memfd_create");
+	if (ftruncate(fd, dram_size) < 0)
+		perror_exit("ftruncate");
+	for (off = 0; off < DRAM_AREA; off += dram_size) {
+		len = DRAM_AREA - off < dram_size ? DRAM_AREA - off : dram_size;
+		map(DRAM_START + off, len, MAP_SHARED, fd);
+	}
+}
+
+
+static void update_baud(void)
+{
+	int rate = baud;
+
+	if (rate < 0)
+		rate = 230400 / ((*REG(UBRLCR1) & BRDIV) + 1);
+	byte_time = rate ? 10.0 / rate : 0;
+}
+
+/* the host has gone; start again when it comes back */
+static void hangup(void)
+{
+	longjmp(reset_jmp, 1);
+}
+
+static void read_pty(double t)
+{
+	unsigned char buf[BACKLOG];
+	int n, i, room = BACKLOG - bl_len;
+
+	if (room < BACKLOG / 4 || host_gone)
+		return;
+	n = read(master, buf, room);
+	if (n < 0 && errno == EAGAIN)
+		return;
+	if (n <= 0) {
+		/* still deliver what it sent before it went */
+		host_gone = 1;
+		return;
+	}
+	bytes_in += n;
+	for (i = 0; i < n; i++) {
+		int j = (bl_head + bl_len++) % BACKLOG;
+
+		rx_last = (rx_last > t ? rx_last : t) + byte_time;
+		backlog[j] = buf[i];
+		bl_time[j] = rx_last;
+	}
+}
+
+static void write_pty(const unsigned char *buf, int len)
+{
+	int n;
+
+	while (len > 0 && !host_gone) {
+		n = write(master, buf, len);
+		if (n < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { master, POLLOUT, 0 };
+
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		if (n <= 0) {
+			host_gone = 1;
+			return;
+		}
+		bytes_out += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void rx_push_front(unsigned char c)
+{
+	rx_head = (rx_head + FIFO_SIZE - 1) % FIFO_SIZE;
+	rx_fifo[rx_head] = c;
+	rx_count++;
+}
+
+static unsigned char rx_pop(void)
+{
+	unsigned char c = rx_fifo[rx_head];
+
+	rx_head = (rx_head + 1) % FIFO_SIZE;
+	rx_count--;
+	return c;
+}
+
+static void tx_push(unsigned char c, double t)
+{
+	int i = (tx_head + tx_count++) % (FIFO_SIZE * 2);
+
+	tx_last = (tx_last > t ? tx_last : t) + byte_time;
+	tx_fifo[i] = c;
+	tx_time[i] = tx_last;
+}
+
+/* move bytes along the wires, and update the flags to suit */
+static void pump(void)
+{
+	unsigned char out[FIFO_SIZE * 2];
+	volatile unsigned *flags = REG(SYSFLG1);
+	double t = now();
+	int n = 0;
+
+	update_baud();
+	while (tx_count && t >= tx_time[tx_head]) {
+		out[n++] = tx_fifo[tx_head];
+		tx_head = (tx_head + 1) % (FIFO_SIZE * 2);
+		tx_count--;
+	}
+	if (n)
+		write_pty(out, n);
+
+	read_pty(t);
+	while (bl_len && rx_count < FIFO_SIZE && t >= bl_time[bl_head]) {
+		rx_fifo[(rx_head + rx_count++) % FIFO_SIZE] = backlog[bl_head];
+		bl_head = (bl_head + 1) % BACKLOG;
+		bl_len--;
+	}
+
+	*flags &= ~(URXFE1 | UTXFF1 | UBUSY1);
+	if (!rx_count)
+		*flags |= URXFE1;
+	if (tx_count >= FIFO_SIZE)
+		*flags |= UTXFF1;
+	if (tx_count)
+		*flags |= UBUSY1;
+	*REG(SYSFLG2) |= URXFE2;
+}
+
+/* nothing will change until the next byte moves: sleep till then */
+static void wait_event(void)
+{
+	struct pollfd pfd = { master, POLLIN, 0 };
+	double next = -1, t = now();
+	int timeout;
+
+	if (tx_count)
+		next = tx_time[tx_head];
+	if (bl_len && rx_count < FIFO_SIZE && (next < 0 || bl_time[bl_head] < next))
+		next = bl_time[bl_head];
+	if (next < 0 && host_gone)
+		hangup();
+	timeout = next < 0 ? -1 : next <= t ? 0 : (int)((next - t) * 1000) + 1;
+	if (timeout == 0)
+		return;
+	if (host_gone) {
+		usleep(timeout * 1000);
+		return;
+	}
+	if (bl_len > BACKLOG * 3 / 4)
+		pfd.events = 0;
+	if (host_hup) {
+		usleep(timeout < 0 ? 1000 : timeout * 1000);
+		return;
+	}
+	/* what it wrote before it closed is still to be read: read_pty()
+	   gets it, then finds it gone */
+	if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLHUP))
+		host_hup = 1;
+}
+
+/* finish off the last UARTDR1 access, now we know what it was */
+static void settle(void)
+{
+	unsigned v;
+
+	if (!dr1_pending)
+		return;
+	dr1_pending = 0;
+	v = *REG(UARTDR1);
+	if (v & RX_MARK)
+		return;
+	if (dr1_popped)
+		rx_push_front(dr1_byte);
+	tx_push(v & 0xff, now());
+}
+
+/* take frames off the interface, if the wire is free for another */
+static void cs_receive(void)
+{
+	struct cs_frame *f;
+	struct sockaddr_ll sa;
+	socklen_t salen = sizeof sa;
+	unsigned char *ia = (unsigned char *)&cs_pp[PP_IA / 2];
+	unsigned used = 0;
+	double t = now();
+	int i, n;
+
+	if (cs_sock < 0)
+		return;
+	while (t >= cs_wire) {
+		f = &cs_rx[(cs_head + cs_count) % CS_FRAMES];
+		n = recvfrom(cs_sock, f->data, sizeof f->data, MSG_DONTWAIT,
+			     (struct sockaddr *)&sa, &salen);
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n < 0)
+			perror_exit("recvfrom");
+		if (sa.sll_pkttype == PACKET_OUTGOING || n < ETH_HEADER ||
+		    !(cs_pp[PP_LineCTL / 2] & PP_LineCTL_Rx) ||
+		    (memcmp(f->data, ia, 6) &&
+		     memcmp(f->data, "\xff\xff\xff\xff\xff\xff", 6) &&
+		     !(f->data[0] & 1 &&
+		       cs_pp[PP_RxCTL / 2] & PP_RxCTL_Multicast)))
+			continue;
+		cs_wire = (cs_wire > t ? cs_wire : t) + (n + 24) * 8 / CS_RATE;
+		for (i = 0; i < cs_count; i++)
+			used += cs_rx[(cs_head + i) % CS_FRAMES].len;
+		if (cs_count == CS_FRAMES || used + n > CS_BUFFER ||
+		    rand() % 100 < cs_loss) {
+			frames_lost++;
+			continue;
+		}
+		f->len = n;
+		f->arrival = cs_wire;
+		cs_count++;
+		frames_in++;
+	}
+}
+
+static void cs_send(void)
+{
+	unsigned len = cs_txlen < 60 ? 60 : cs_txlen;
+
+	double t = now();
+
+	memset(cs_tx + cs_txlen, 0, len - cs_txlen);
+	if (cs_sock >= 0 && write(cs_sock, cs_tx, len) != len)
+		perror_exit("write");
+	cs_txwire = (cs_txwire > t ? cs_txwire : t) + (len + 24) * 8 / CS_RATE;
+	frames_out++;
+	cs_txlen = 0;
+}
+
+static void cs_drop(void)
+{
+	cs_head = (cs_head + 1) % CS_FRAMES;
+	cs_count--;
+	cs_reading = 0;
+}
+
+/*
+ * Nothing to receive yet: sleep till something comes, over the wire
+ * or, for a loader watching both, from the host.
+ */
+static void cs_wait(void)
+{
+	struct pollfd pfd[2] = { { cs_sock, POLLIN, 0 }, { master, POLLIN, 0 } };
+	double t = now(), next = cs_count ? cs_rx[cs_head].arrival : cs_wire;
+	struct timespec ts = { 0, 10000000 };
+
+	if (next > t) {
+		ts.tv_sec = next - t;
+		ts.tv_nsec = (next - t - ts.tv_sec) * 1e9 + 1000;
+		pfd[0].events = 0;
+	} else if (cs_count)
+		return;
+	if (host_gone || host_hup || rx_count)
+		pfd[1].events = 0;
+	ppoll(pfd, 2, &ts, NULL);
+}
+
+/*
+ * The RxEvent for the next frame, if it is all in, and start reading
+ * it.  One that wasn't read to the end is gone.
+ */
+static unsigned short cs_rxevent(void)
+{
+	if (cs_reading)
+		cs_drop();
+	cs_receive();
+	if (!cs_count || cs_rx[cs_head].arrival > now()) {
+		if (++cs_spins > SPIN_LIMIT) {
+			cs_wait();
+			cs_spins = 0;
+		}
+		return 0;
+	}
+	cs_spins = 0;
+	cs_reading = 1;
+	cs_pos = 0;
+	return PP_RER_RxOK | (cs_rx[cs_head].data[0] & 1 ?
+			      PP_RER_Broadcast : PP_RER_IA);
+}
+
+/* the next ISQ event: only RxEvents, and only if they are enabled */
+static unsigned short cs_isq(void)
+{
+	unsigned short event;
+
+	if (!(cs_pp[PP_RxCFG / 2] & PP_RxCFG_RxOK))
+		return 0;
+	event = cs_rxevent();
+	return event ? event | ISQ_RxEvent : 0;
+}
+
+/* what a read of PacketPage register reg gives, and what it does */
+static unsigned short cs_get(unsigned reg)
+{
+	switch (reg) {
+	case PP_ChipID:
+		return 0x630e;
+	case PP_SelfSTAT:
+		return PP_SelfSTAT_InitD;
+	case PP_BusSTAT:
+		/* the chip has room for a frame once the last has gone */
+		if (cs_txlen && now() < cs_txwire)
+			usleep((cs_txwire - now()) * 1e6 + 1);
+		return cs_txlen ? PP_BusSTAT_TxRDY : 0;
+	case PP_RER:
+		return cs_rxevent();
+	}
+	return reg < sizeof cs_pp ? cs_pp[reg / 2] : 0;
+}
+
+static void cs_put(unsigned reg, unsigned short v)
+{
+	if (reg == PP_SelfCTL && v & PP_SelfCTL_Reset) {
+		memset(cs_pp, 0, sizeof cs_pp);
+		cs_count = cs_reading = 0;
+		cs_txlen = 0;
+		return;
+	}
+	if (reg == PP_RxCFG && v & PP_RxCFG_Skip1) {
+		if (cs_reading)
+			cs_drop();
+		v &= ~PP_RxCFG_Skip1;
+	}
+	if (reg < sizeof cs_pp)
+		cs_pp[reg / 2] = v;
+}
+
+/* the next halfword of the frame being read: status, length, data */
+static unsigned short cs_rtdata(void)
+{
+	struct cs_frame *f = &cs_rx[cs_head];
+	unsigned i = (cs_pos - 2) * 2;
+
+	if (!cs_reading)
+		return 0;
+	if (cs_pos == 0)
+		return PP_RER_RxOK;
+	if (cs_pos == 1)
+		return f->len;
+	return f->data[i] | (i + 1 < f->len ? f->data[i + 1] << 8 : 0);
+}
+
+/* finish off the last CS8900 access, as for UARTDR1 */
+static void cs_settle(void)
+{
+	unsigned v;
+	int offset = cs_pending;
+
+	if (offset < 0)
+		return;
+	cs_pending = -1;
+	v = cs_reg[offset / 4];
+	if ((v & 0xffff0000) == CS_MARK) {
+		/* a read */
+		if (offset == 0x00 && cs_reading &&
+		    ++cs_pos >= 2 + (cs_rx[cs_head].len + 1) / 2)
+			cs_drop();
+		return;
+	}
+	v &= 0xffff;
+	switch (offset) {
+	case 0x00:
+		if (cs_txpos < cs_txlen) {
+			cs_tx[cs_txpos++] = v;
+			cs_tx[cs_txpos++] = v >> 8;
+			if (cs_txpos >= cs_txlen)
+				cs_send();
+		}
+		break;
+	case 0x08:
+		cs_txlen = 0;
+		break;
+	case 0x0C:
+		cs_txlen = v > CS_MAXFRAME ? CS_MAXFRAME : v;
+		cs_txpos = 0;
+		break;
+	case 0x14:
+		cs_reg[offset / 4] = v;
+		break;
+	case 0x18:
+		cs_put(cs_reg[0x14 / 4] & 0xffff, v);
+		break;
+	}
+}
+
+volatile unsigned *sim_cs8900(unsigned offset)
+{
+	unsigned v = 0xffff;		/* nothing there */
+
+	cs_settle();
+	/* a loader polling the chip and the UART in turn isn't idle */
+	spins = 0;
+	if (cs_sock >= 0) {
+		switch (offset) {
+		case 0x00:
+			v = cs_rtdata();
+			break;
+		case 0x10:
+			v = cs_isq();
+			break;
+		case 0x14:
+			v = cs_reg[offset / 4] & 0xffff;
+			break;
+		case 0x18:
+			v = cs_get(cs_reg[0x14 / 4] & 0xffff);
+			break;
+		default:
+			v = 0;
+		}
+	}
+	if (offset != 0x14)
+		cs_reg[offset / 4] = CS_MARK | v;
+	else
+		cs_reg[offset / 4] |= CS_MARK;
+	cs_pending = offset;
+	return &cs_reg[offset / 4];
+}
+
+static void cs_open(const char *netif)
+{
+	struct sockaddr_ll sa;
+
+	if ((cs_sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0)
+		perror_exit("socket");
+	memset(&sa, 0, sizeof sa);
+	sa.sll_family = AF_PACKET;
+	sa.sll_protocol = htons(ETH_P_ALL);
+	if (!(sa.sll_ifindex = if_nametoindex(netif))) {
+		fprintf(stderr, "loader-sim: no interface %s\n", netif);
+		exit(1);
+	}
+	if (bind(cs_sock, (struct sockaddr *)&sa, sizeof sa) < 0)
+		perror_exit("bind");
+}
+
+volatile void *sim_io(unsigned offset)
+{
+	volatile unsigned *dr1 = REG(UARTDR1);
+	unsigned flags;
+
+	cs_settle();
+	settle();
+	pump();
+
+	switch (offset) {
+	case SYSFLG1:
+		flags = *REG(SYSFLG1);
+		if (flags != last_flags)
+			spins = 0;
+		else if (++spins > SPIN_LIMIT) {
+			wait_event();
+			pump();
+			spins = 0;
+		}
+		last_flags = *REG(SYSFLG1);
+		break;
+
+	case UARTDR1:
+		/* a write clears the mark; settle() puts the byte back then */
+		dr1_popped = rx_count > 0;
+		dr1_byte = dr1_popped ? rx_pop() : 0;
+		*dr1 = RX_MARK | dr1_byte;
+		dr1_pending = 1;
+		spins = 0;
+		break;
+
+	case UARTDR2:
+		*REG(UARTDR2) = 0;
+		break;
+
+	default:
+		spins = 0;
+	}
+	return (volatile void *)(unsigned long)(IO_START + offset);
+}
+
+
+/* the boot ROM's part: '<', 2kB of loader into SRAM, '>' */
+static unsigned char rom_get(void)
+{
+	pump();
+	while (!rx_count) {
+		wait_event();
+		pump();
+	}
+	return rx_pop();
+}
+
+static void rom_put(unsigned char c)
+{
+	pump();
+	while (tx_count >= FIFO_SIZE) {
+		wait_event();
+		pump();
+	}
+	tx_push(c, now());
+}
+
+static void drain_tx(void)
+{
+	pump();
+	while (tx_count) {
+		wait_event();
+		pump();
+	}
+}
+
+static void dump_dram(void)
+{
+	FILE *f;
+
+	if (!(f = fopen(dump_file, "w")) ||
+	    fwrite((void *)(unsigned long)DRAM_START, dram_size, 1, f) != 1 ||
+	    fclose(f))
+		perror_exit(dump_file);
+}
+
+void sim_call(unsigned addr, int r0, int r1, int r2, int r3)
+{
+	cs_settle();
+	settle();
+	drain_tx();
+	if (addr == STAGE2_START)
+		stage2_cmain(r0);
+
+	printf("loader-sim: kernel called at 0x%08x (r0-r3 0x%x 0x%x 0x%x 0x%x) "
+		"after %.1fs, %lu bytes in, %lu out\n",
+		addr, r0, r1, r2, r3, now() - wakeup, bytes_in, bytes_out);
+	if (cs_sock >= 0)
+		printf("loader-sim: %lu frames in, %lu out, %lu lost\n",
+			frames_in, frames_out, frames_lost);
+	if (dump_file)
+		dump_dram();
+	if (once)
+		exit(0);
+	longjmp(reset_jmp, 1);
+}
+
+/* the real loader flushes caches here; the host's are coherent */
+void flush_v3(void) { }
+void flush_v4(void) { }
+
+
+static void reset(void)
+{
+	memset((void *)(unsigned long)IO_START, 0, IO_SIZE);
+	*REG(UBRLCR1) = FIFOEN | 3 << WRDLEN_SHIFT | BR_9600;
+	bl_len = rx_count = tx_count = 0;
+	rx_last = tx_last = 0;
+	dr1_pending = spins = host_gone = host_hup = 0;
+	bytes_in = bytes_out = 0;
+	memset(cs_pp, 0, sizeof cs_pp);
+	cs_pending = -1;
+	cs_count = cs_reading = 0;
+	cs_txlen = 0;
+	frames_in = frames_out = frames_lost = 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: loader-sim [-b baud] [-m MB] [-l link] [-d dumpfile] [-1]\n"
+		"                  [-e netif [-x percent]]\n"
+		"  -b baud	pace UART1 at this rate, 0 for no pacing\n"
+		"		(default: as programmed into UBRLCR1)\n"
+		"  -m MB		DRAM size (32)\n"
+		"  -l link	symlink to the pty, for --port\n"
+		"  -d dumpfile	write DRAM here when the kernel is called\n"
+		"  -1		exit when the kernel is called\n"
+		"  -e netif	put the CS8900 on this network interface\n"
+		"  -x percent	lose this many of the frames it receives\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *link_name = NULL, *name;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "b:m:l:d:1e:x:")) != -1) {
+		switch (c) {
+		case 'b':
+			baud = atoi(optarg);
+			break;
+		case 'm':
+			dram_size = atoi(optarg) << 20;
+			if (!dram_size || dram_size > DRAM_AREA ||
+			    dram_size & (dram_size - 1)) {
+				fprintf(stderr, "loader-sim: bad DRAM size\n");
+				exit(1);
+			}
+			break;
+		case 'l':
+			link_name = optarg;
+			break;
+		case 'd':
+			dump_file = optarg;
+			break;
+		case '1':
+			once = 1;
+			break;
+		case 'e':
+			cs_open(optarg);
+			break;
+		case 'x':
+			cs_loss = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	master = pty_open(link_name, &name);
+	map_memory();
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("loader-sim: UART1 on %s, %uMB DRAM\n", name, dram_size >> 20);
+
+	setjmp(reset_jmp);
+	reset();
+	pty_wait_host(master, wakeup_ms);
+	wakeup = now();
+
+	rom_put('<');
+	for (i = 0; i < SRAM_SIZE; i++)
+		((unsigned char *)SRAM_START)[i] = rom_get();
+	rom_put('>');
+	cmain(0);
+	return 0;
+}
@@ -3,6 +3,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,11 +15,27 @@
 extern char *progname;
 
 
-void perror_exit(const char *errstr)
+/* set when booting several boards: give up on this one only */
+void (*fail_hook)(void);
+
+void fail(void)
+{
+	if (fail_hook)
+		fail_hook();
+	exit(1);
+}
+
+/* as perror(), with our name first */
+void perror_msg(const char *errstr)
 {
 	fprintf(stderr, "%s: ", progname);
 	fprintf(stderr, "%s: %s\n", errstr,strerror(errno));
-	exit(1);
+}
+
+void perror_exit(const char *errstr)
+{
+	perror_msg(errstr);
+	fail();
 }
 
 void print_size(unsigned start, unsigned size)
@@ -30,15 +47,21 @@ void print_size(unsigned start, unsigned size)
 			start, size, start + size - 1);
 }
 
-void read_file(const char *filename, unsigned char **buf, unsigned *size)
+/*
+ * Read a file into a buffer of at least *size bytes.  Returns -1,
+ * having said why, if it can't.
+ */
+int read_file(const char *filename, unsigned char **buf, unsigned *size)
 {
 	FILE *f;
 	unsigned rdsize;
 	unsigned bufsize;
 
 	f = fopen(filename, "r");
-	if (!f)
-		perror_exit(filename);
+	if (!f) {
+		perror_msg(filename);
+		return -1;
+	}
 	fseek(f, 0L, SEEK_END);
 	bufsize = rdsize = ftell(f);
 	if (*size > rdsize) {	/* min buffer size requested */
@@ -51,7 +74,10 @@ void read_file(const char *filename, unsigned char **buf, unsigned *size)
 	*buf = xmalloc(bufsize);
 	if (rdsize != fread(*buf, 1, rdsize, f)) {
 		printf("%s: couldn't read whole file\n", filename);
-		exit(1);
+		fclose(f);
+		free(*buf);
+		*buf = NULL;
+		return -1;
 	}
 	fclose(f);
 	printf("%s: %d bytes", filename, rdsize);
@@ -62,6 +88,7 @@ void read_file(const char *filename, unsigned char **buf, unsigned *size)
 	*size = rdsize;
 	if (*size & 1)
 		*size += 1;
+	return 0;
 }
 
 void *xmalloc(size_t size)
@@ -122,3 +149,59 @@ ssize_t xawrite(int fd, const void *buf, size_t count)
 	return count;
 }
 
+
+/*
+ * CRC-32 as used by zlib and Ethernet, four bytes at a time using
+ * four lookup tables ("slicing by 4").  Start with a crc of 0.
+ */
+static unsigned crc_table[4][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	unsigned c, n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[0][n] = c;
+	}
+	for (n = 0; n < 256; n++) {
+		c = crc_table[0][n];
+		for (k = 1; k < 4; k++) {
+			c = crc_table[0][c & 0xff] ^ (c >> 8);
+			crc_table[k][n] = c;
+		}
+	}
+}
+
+unsigned crc32(unsigned crc, const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+	unsigned c = ~crc;
+
+	pthread_once(&crc_once, crc_init);
+	for (; size >= 4; size -= 4, p += 4) {
+		c ^= p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+		c = crc_table[3][c & 0xff] ^ crc_table[2][(c >> 8) & 0xff] ^
+		    crc_table[1][(c >> 16) & 0xff] ^ crc_table[0][c >> 24];
+	}
+	while (size--)
+		c = crc_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+	return ~c;
+}
+
+/* little-endian words in frames, whatever the host's byte order */
+unsigned get_le(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+void put_le(unsigned char *p, unsigned w)
+{
+	p[0] = w;
+	p[1] = w >> 8;
+	p[2] = w >> 16;
+	p[3] = w >> 24;
+}
@@ -7,12 +7,18 @@
 
 #define min(a,b)	((a)<(b) ? (a) : (b))
 
+extern void (*fail_hook)(void);
+extern void fail(void);
+extern void perror_msg(const char *errstr);
 extern void perror_exit(const char *errstr);
 extern void print_size(unsigned start, unsigned size);
-extern void read_file(const char *filename, unsigned char **buf,
-		      unsigned *size);
+extern int read_file(const char *filename, unsigned char **buf,
+		     unsigned *size);
 
 extern void *xmalloc(size_t size);
+extern unsigned crc32(unsigned crc, const void *buf, size_t size);
+extern unsigned get_le(const unsigned char *p);
+extern void put_le(unsigned char *p, unsigned w);
 
 extern void xclose(int fd);
 extern ssize_t xread(int fd, void *buf, size_t count);
@@ -0,0 +1,136 @@
+/*
+ * verify.c --	Read back what was written, and say where it differs.
+ *
+ * With --verify, each image is compared with what the target has once
+ * it has all been sent.  A stage 2 loader hashes the pages first ('H'),
+ * and only the pages whose hashes differ are read back; the SRAM loader
+ * can't, so all of it is, with target_read_block().  Where the
+ * target's copy differs is listed as ranges of addresses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "metrics.h"
+#include "prep.h"
+#include "serial.h"
+#include "util.h"
+#include "verify.h"
+
+#define VERIFY_BLOCK	4096	/* compared in pieces this big */
+#define VERIFY_CHUNK	64	/* compared at once, before looking closer */
+#define VERIFY_RANGES	16	/* differing ranges listed, at most */
+
+/* the differences found so far */
+struct diff {
+	unsigned	start, end;	/* the last range, if end isn't 0 */
+	unsigned	ranges;
+	unsigned	bytes;
+};
+
+
+static void diff_close(struct diff *d)
+{
+	if (!d->end)
+		return;
+	if (++d->ranges <= VERIFY_RANGES)
+		printf("- differs: 0x%08x-0x%08x (%u bytes)\n",
+		       d->start, d->end - 1, d->end - d->start);
+	d->end = 0;
+}
+
+/* note where got, read back from addr, differs from buf */
+static void diff_block(struct diff *d, unsigned addr, const char *buf,
+		       const char *got, unsigned size)
+{
+	unsigned i, j, n;
+
+	for (i = 0; i < size; i += n) {
+		n = min(size - i, VERIFY_CHUNK);
+		if (!memcmp(buf + i, got + i, n)) {
+			diff_close(d);
+			continue;
+		}
+		for (j = i; j < i + n; j++) {
+			if (buf[j] == got[j]) {
+				diff_close(d);
+				continue;
+			}
+			if (d->end != addr + j) {
+				diff_close(d);
+				d->start = addr + j;
+			}
+			d->end = addr + j + 1;
+			d->bytes++;
+		}
+	}
+}
+
+/* read size bytes back from addr, noting where they differ from buf */
+static void read_back(struct diff *d, unsigned addr, const char *buf,
+		      unsigned size, unsigned progress)
+{
+	char *got = xmalloc(size);
+	unsigned i, n;
+
+	target_read_block(addr, got, size, progress);
+	for (i = 0; i < size; i += n) {
+		n = min(size - i, VERIFY_BLOCK);
+		diff_block(d, addr + i, buf + i, got + i, n);
+	}
+	free(got);
+}
+
+/*
+ * Check that the target has buf at addr, listing the ranges where it
+ * doesn't.  hash says the loader can hash pages.  Returns how many
+ * bytes differ.
+ */
+unsigned target_verify(unsigned addr, const char *buf, unsigned size,
+		       int hash)
+{
+	struct diff d = { 0, 0, 0, 0 };
+	unsigned pages = (size + DELTA_PAGESIZE - 1) / DELTA_PAGESIZE;
+	unsigned *ours, *theirs, i, end, offset, n, read = 0;
+
+	metrics_object(0);
+	if (!hash) {
+		read_back(&d, addr, buf, size, 0);
+		read = size;
+	} else {
+		ours = xmalloc(pages * sizeof *ours);
+		theirs = xmalloc(pages * sizeof *theirs);
+		if (!prep_hashes(buf, size, ours))
+			for (i = 0; i < pages; i++)
+				ours[i] = crc32(0, buf + i * DELTA_PAGESIZE,
+						min(size - i * DELTA_PAGESIZE,
+						    DELTA_PAGESIZE));
+		target_hash_pages(addr, size, DELTA_PAGESIZE, theirs);
+
+		/* read back each run of pages whose hashes differ */
+		for (i = 0; i < pages; i = end) {
+			for (end = i; end < pages && ours[end] != theirs[end];
+			     end++)
+				;
+			if (end == i) {
+				end++;
+				continue;
+			}
+			offset = i * DELTA_PAGESIZE;
+			n = min(size, end * DELTA_PAGESIZE) - offset;
+			read_back(&d, addr + offset, buf + offset, n, read);
+			read += n;
+		}
+		free(ours);
+		free(theirs);
+	}
+	if (read)
+		metrics_object_end(read);
+	diff_close(&d);
+	if (d.ranges > VERIFY_RANGES)
+		printf("- and %u more ranges\n", d.ranges - VERIFY_RANGES);
+	printf("- %u bytes read back, %u differ\n", read, d.bytes);
+	return d.bytes;
+}
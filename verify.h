@@ -0,0 +1,10 @@
+/*
+ * verify.h --	Read back what was written, and say where it differs.
+ */
+#ifndef _SHOEHORN_VERIFY_H
+#define _SHOEHORN_VERIFY_H
+
+extern unsigned target_verify(unsigned addr, const char *buf, unsigned size,
+			      int hash);
+
+#endif /* _SHOEHORN_VERIFY_H */